@@ -1,12 +1,16 @@
-#!/usr/bin/python
+#!/usr/bin/env python3
 
 """High-level interface to adns."""
 
 import adns
-from exceptions import Exception
+from time import time
 
 class Error(Exception): pass
 
+# what callbacks get for a query that failed without an answer, e.g.
+# on its way out of the queue of s.set_ratelimit()
+_failed = (adns.status.systemfail, None, 0, ())
+
 class QueryEngine:
 
     callback_submit = None
@@ -20,22 +24,24 @@ class QueryEngine:
     def synchronous(self, qname, rr, flags=0):
         return self._s.synchronous(qname, rr, flags)
 
-    def submit(self, qname, rr, flags=0, callback=None, extra=None):
+    def submit(self, qname, rr, flags=0, callback=None, extra=None,
+               priority=adns.priority.interactive):
         callback = callback or self.callback_submit
-        if not callback: raise Error, "callback required"
-        q = self._s.submit(qname, rr, flags)
+        if not callback: raise Error("callback required")
+        q = self._s.submit(qname, rr, flags, priority)
         self._queries[q] = qname, rr, flags, callback, extra
 
-    def submit_reverse(self, qname, rr, flags=0, callback=None, extra=None):
+    def submit_reverse(self, qname, rr, flags=0, callback=None, extra=None,
+                       priority=adns.priority.interactive):
         callback = callback or self.callback_submit_reverse
-        if not callback: raise Error, "callback required"
-        q = self._s.submit_reverse(qname, rr, flags)
+        if not callback: raise Error("callback required")
+        q = self._s.submit_reverse(qname, rr, flags, priority)
         self._queries[q] = qname, rr, flags, callback, extra
 
     def submit_reverse_any(self, qname, rr, flags=0,
                            callback=None, extra=None):
         callback = callback or self.callback_submit_reverse_any
-        if not callback: raise Error, "callback required"
+        if not callback: raise Error("callback required")
         q = self._s.submit_reverse_any(qname, rr, flags)
         self._queries[q] = qname, rr, flags, callback, extra
 
@@ -46,10 +52,11 @@ class QueryEngine:
         
     def run(self, timeout=0):
         for q in self._s.completed(timeout):
-            answer = q.check()
-            qname, rr, flags, callback, extra = self._queries[q]
-            del self._queries[q]
-            apply(callback, (answer, qname, rr, flags, extra))
+            qname, rr, flags, callback, extra = self._queries.pop(q)
+            try: answer = q.check()
+            except adns.LimitError: continue # shed, see s.set_limits()
+            except adns.Error: answer = _failed
+            callback(answer, qname, rr, flags, extra)
 
     def finished(self):
         return not len(self._queries)
@@ -59,13 +66,172 @@ class QueryEngine:
             self.run(1)
 
     def run_max(self, max):
-        from time import time
         quittime = time()+max
         while not self.finished() and time()<=quittime:
             self.run(1)
 
     def globalsystemfailure(self):
+        # the state would still deliver them, failed
+        self._s.cancel_all()
         self._s.globalsystemfailure()
         self._queries.clear()
 
+class ResolverPool(QueryEngine):
+
+    """A QueryEngine spreading queries over several upstream
+    nameservers, each with its own adns state.
+
+    Each query goes to the upstream with the lowest smoothed RTT among
+    those failing less than maxfailure of the time; an unhealthy one
+    gets a single query every probe seconds so it can recover.  If
+    hedge is set to a fraction such as 0.95, a query still unanswered
+    after that percentile of its upstream's latency is sent to the
+    next best upstream as well, and the first good answer wins; a
+    query is hedged at most once.  The submit methods return the query
+    to pass to cancel()."""
+
+    def __init__(self, nameservers, config='', hedge=None,
+                 maxfailure=0.5, probe=5.0, flags=adns.iflags.noautosys):
+        self._nameservers = list(nameservers)
+        self._states = [adns.init(flags, configtext='nameserver %s\n%s'
+                                  % (ns, config))
+                        for ns in self._nameservers]
+        self._queries = {}
+        self._hedge = hedge
+        self._maxfailure = maxfailure
+        self._probe = probe
+        self._probed = {}
+        self._probes = []
+        self.hedges = self.hedge_wins = 0
+        self._rank()
+
+    def _rank(self):
+        now = time()
+        ranked = []
+        self._unmeasured = 0
+        for s in self._states:
+            stats = s.stats()
+            sick = stats['failure_rate'] >= self._maxfailure
+            if sick and now - self._probed.get(s, 0) >= self._probe:
+                self._probed[s] = now
+                self._probes.append(s)
+            rtt = stats['rtt']
+            if not rtt and not sick:
+                # try it once, then wait for it to answer
+                self._unmeasured = 1
+                if stats['inflight']: rtt = 1e9
+            ranked.append((sick, rtt, stats['inflight'], s))
+        ranked.sort(key=lambda r: r[:3])
+        self._ranked = [r[-1] for r in ranked]
+
+    def _pick(self, exclude=None):
+        while self._probes:
+            s = self._probes.pop()
+            if s is not exclude: return s
+        for s in self._ranked:
+            if s is not exclude: return s
+
+    def _submit(self, method, args, callback, extra):
+        if not callback: raise Error("callback required")
+        # spread queries out until every upstream has been measured
+        if self._unmeasured: self._rank()
+        s = self._pick()
+        q = getattr(s, method)(*args)
+        # method, args, callback, extra, attempts, submitted, first, hedged
+        self._queries[q] = [method, args, callback, extra, [(q, s)], time(), q,
+                            0]
+        return q
+
+    def synchronous(self, qname, rr, flags=0):
+        return self._pick().synchronous(qname, rr, flags)
+
+    def submit(self, qname, rr, flags=0, callback=None, extra=None,
+               priority=adns.priority.interactive):
+        return self._submit('submit', (qname, rr, flags, priority),
+                            callback or self.callback_submit, extra)
+
+    def submit_reverse(self, qname, rr, flags=0, callback=None, extra=None,
+                       priority=adns.priority.interactive):
+        return self._submit('submit_reverse', (qname, rr, flags, priority),
+                            callback or self.callback_submit_reverse, extra)
+
+    def submit_reverse_any(self, qname, rr, flags=0,
+                           callback=None, extra=None):
+        return self._submit('submit_reverse_any', (qname, rr, flags),
+                            callback or self.callback_submit_reverse_any,
+                            extra)
+
+    def _forget(self, rec, keep=None):
+        for q, s in rec[4]:
+            if q is keep: continue
+            del self._queries[q]
+            try: q.cancel()
+            except adns.Error: pass
+
+    def cancel(self, query):
+        rec = self._queries.get(query)
+        if rec: self._forget(rec)
+
+    def _hedge_due(self, timeout):
+        """Hedges overdue queries; returns how long until the next is due."""
+        now = time()
+        for rec in list(self._queries.values()):
+            if rec[7]: continue     # once only, even if the hedge failed
+            q, s = rec[4][0]
+            delay = s.latency(self._hedge)
+            if not delay: continue
+            if rec[5] + delay > now:
+                timeout = min(timeout, rec[5] + delay - now)
+                continue
+            s2 = self._pick(s)
+            if s2 is None: continue
+            q2 = getattr(s2, rec[0])(*rec[1])
+            rec[4].append((q2, s2))
+            rec[7] = 1
+            self._queries[q2] = rec
+            self.hedges = self.hedges + 1
+        return timeout
+
+    def run(self, timeout=0):
+        self._rank()
+        if self._hedge is not None:
+            timeout = self._hedge_due(timeout)
+        adns.select(self._states, timeout)
+        for s in self._states:
+            for q in s.completed():
+                rec = self._queries.get(q)
+                if not rec: continue
+                try: answer = q.check()
+                except adns.LimitError: answer = None # shed
+                except adns.Error: answer = _failed
+                if len(rec[4]) > 1 and (answer is None or
+                   adns.status.max_localfail < answer[0] <=
+                   adns.status.max_tempfail):
+                    # give the other one its chance
+                    del self._queries[q]
+                    rec[4].remove((q, s))
+                    continue
+                if answer is None:
+                    del self._queries[q]
+                    continue
+                if q is not rec[6]:
+                    self.hedge_wins = self.hedge_wins + 1
+                del self._queries[q]
+                self._forget(rec, q)
+                method, args, callback, extra = rec[:4]
+                callback(answer, args[0], args[1], args[2], extra)
+
+    def globalsystemfailure(self):
+        for s in self._states:
+            s.cancel_all()
+            s.globalsystemfailure()
+        self._queries.clear()
+
+    def stats(self):
+        """Returns the stats of each upstream, keyed by nameserver."""
+        d = {}
+        for ns, s in zip(self._nameservers, self._states):
+            d[ns] = s.stats()
+        return d
+
 init = QueryEngine
@@ -1,6 +1,7 @@
-#!/usr/bin/env python
-import os, sys, string
-import ADNS
+#!/usr/bin/env python3
+import os, sys
+from time import time
+import adns, ADNS
 
 class DNSBL:
 
@@ -31,31 +32,61 @@ class DNSBL:
 
 class DNSBLQueryEngine(ADNS.QueryEngine):
 
+    """A QueryEngine checking addresses against DNSBLs.
+
+    Verdicts, positive and negative, are kept in an adns.listings()
+    until their TTLs expire, so an address seen again is answered
+    without going to DNS; listings.range() reports a whole /24."""
+
     def __init__(self, s=None, blacklists=None):
         ADNS.QueryEngine.__init__(self, s)
         self.blacklists = {}
         self.dnsbl_results = {}
+        self.listings = adns.listings()
+        self._listno = {}
         if blacklists:
             for l in blacklists: self.blacklist(l)
             
     def blacklist(self, dnsbl):
         """Add a DNSBL."""
         self.blacklists[dnsbl.name] = dnsbl
+        if dnsbl.name not in self._listno:
+            self._listno[dnsbl.name] = len(self._listno)
         
     def submit_dnsbl(self, qname):
         from adns import rr
+        self.dnsbl_results[qname] = []
         for l, d in self.blacklists.items():
-            self.dnsbl_results[qname] = []
+            answers = self.listings.get(qname, self._listno[l])
+            if answers is not None:
+                self.dnsbl_listed(qname, l, answers)
+                continue
             self.submit_reverse_any(qname, d.zone, rr.A,
                                     callback=self.dnsbl_callback,
                                     extra=l)
 
     def dnsbl_callback(self, answer, qname, rr, flags, l):
-        if not answer[0]:
-            for addr in answer[3]:
-                self.dnsbl_results[qname].append( (
-                    self.blacklists[l].results.get(addr, "%s-%s"%(l,addr)),
-                    self.blacklists[l].getURL(qname)) )
+        status, cname, expires, answers = answer
+        if status in (adns.status.ok, adns.status.nxdomain,
+                      adns.status.nodata):
+            self.listings.set(qname, self._listno[l], answers,
+                              int(expires - time()))
+        if not status:
+            self.dnsbl_listed(qname, l, answers)
+
+    def dnsbl_listed(self, qname, l, answers):
+        for addr in answers:
+            self.dnsbl_results[qname].append( (
+                self.blacklists[l].results.get(addr, "%s-%s"%(l,addr)),
+                self.blacklists[l].getURL(qname)) )
+
+    def dnsbl_range(self, net):
+        """Return (ip, DNSBL name, answers) for every address in the
+        /24 net with a verdict that has not expired."""
+        names = {}
+        for l, n in self._listno.items(): names[n] = l
+        return [ (ip, names[n], answers)
+                 for ip, n, answers in self.listings.range(net) ]
 
 if __name__ == "__main__":
     blacklists = [
@@ -76,7 +107,7 @@ if __name__ == "__main__":
         hits = []
         for l, url in v: hits.append(l)
         if len(listed) > 1:
-            print "%s: %s" % (k, string.join(hits))
+            print("%s: %s" % (k, " ".join(hits)))
         else:
-            print string.join(hits)
+            print(" ".join(hits))
             
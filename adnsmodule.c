@@ -5,52 +5,266 @@ the Free Software Foundation; either version 2, or (at your option)
 any later version.
 */
 
+#define PY_SSIZE_T_CLEAN
 #include "Python.h"
-#include "pymemcompat.h"
+#include "structmember.h"
 #include <adns.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
-static PyObject *ErrorObject;
-static PyObject *NotReadyError;
-static PyObject *LocalError;
-static PyObject *RemoteError, *RemoteFailureError, *RemoteTempError,
-	*RemoteConfigError;
-static PyObject *QueryError;
-static PyObject *PermanentError, *NXDomainError, *NoDataError;
+#if PY_VERSION_HEX < 0x030a0000
+#error "adns needs Python 3.10 or newer"
+#endif
+
+/* Per-module state: the exceptions and types of one adns module, so
+   that several interpreters can each have their own.  Objects find it
+   through their (heap) type. */
+typedef struct {
+	PyObject *ErrorObject;
+	PyObject *NotReadyError;
+	PyObject *LocalError;
+	PyObject *RemoteError, *RemoteFailureError, *RemoteTempError,
+		*RemoteConfigError;
+	PyObject *QueryError;
+	PyObject *PermanentError, *NXDomainError, *NoDataError;
+	PyObject *LimitError;
+	PyTypeObject *ADNS_Statetype;
+	PyTypeObject *ADNS_Querytype;
+	PyTypeObject *ADNS_Listingstype;
+} adnsstate;
 
 /* ----------------------------------------------------- */
 
 /* Declarations for objects of type ADNS_State */
 
+struct _ADNS_Queryobject;
+struct _replay;
+struct _cache;
+struct _srvset;
+
+/* Simple chained hash table of byte-string keys.  Entries embed a
+   _hnode as their first member; the table never owns them. */
+
+typedef struct _hnode {
+	struct _hnode *next;
+	unsigned long hash;
+	const char *key;
+	size_t keylen;
+} _hnode;
+
+typedef struct {
+	_hnode **buckets;
+	size_t nbuckets, count;
+} _htab;
+
+/* Intrusive list of query objects that the state knows about but adns
+   does not; the list does not own references to them. */
+typedef struct {
+	struct _ADNS_Queryobject *head, *tail;
+	size_t count;
+} _qlist;
+
+/* A mutex that the thread holding it may take again, as happens when
+   a query object is freed while its state is in use.  With the GIL,
+   _lock_acquire() lets the GIL go if it has to wait, so that whoever
+   holds the lock can get on and release it. */
+typedef struct {
+	pthread_mutex_t mutex;
+	unsigned long owner;		/* PyThread_get_thread_ident() */
+	unsigned long depth;
+} _lock;
+
+static void
+_lock_init(_lock *l)
+{
+	l->owner = l->depth = 0;
+	pthread_mutex_init(&l->mutex, NULL);
+}
+
+/* Takes l for the calling thread, which does not hold it, at depth;
+   this may block, so the GIL must not be held. */
+static void
+_lock_take(
+	_lock *l,
+	unsigned long depth
+	)
+{
+	pthread_mutex_lock(&l->mutex);
+	__atomic_store_n(&l->owner, PyThread_get_thread_ident(),
+			 __ATOMIC_RELAXED);
+	l->depth = depth;
+}
+
+/* Lets go of l however deeply it is held; returns the depth to give
+   to _lock_take() afterwards. */
+static unsigned long
+_lock_drop(_lock *l)
+{
+	unsigned long depth = l->depth;
+	l->depth = 0;
+	__atomic_store_n(&l->owner, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&l->mutex);
+	return depth;
+}
+
+static void
+_lock_acquire(_lock *l)
+{
+	/* only this thread ever stores its own ident */
+	if (__atomic_load_n(&l->owner, __ATOMIC_RELAXED) ==
+	    PyThread_get_thread_ident()) {
+		l->depth++;
+		return;
+	}
+	if (pthread_mutex_trylock(&l->mutex)) {
+		Py_BEGIN_ALLOW_THREADS;
+		pthread_mutex_lock(&l->mutex);
+		Py_END_ALLOW_THREADS;
+	}
+	__atomic_store_n(&l->owner, PyThread_get_thread_ident(),
+			 __ATOMIC_RELAXED);
+	l->depth = 1;
+}
+
+static void
+_lock_release(_lock *l)
+{
+	if (--l->depth) return;
+	__atomic_store_n(&l->owner, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&l->mutex);
+}
+
+/* Define name_locked(), the method table entry for method name, which
+   calls it holding lock (an expression in self). */
+#define _LOCKED(name, type, lock)				\
+static PyObject *						\
+name##_locked(type *self, PyObject *args)			\
+{								\
+	PyObject *r;						\
+	_lock_acquire(lock);					\
+	r = name(self, args);					\
+	_lock_release(lock);					\
+	return r;						\
+}
+
+#define _LOCKED_FAST(name, type, lock)				\
+static PyObject *						\
+name##_locked(type *self, PyObject *const *args, Py_ssize_t nargs) \
+{								\
+	PyObject *r;						\
+	_lock_acquire(lock);					\
+	r = name(self, args, nargs);				\
+	_lock_release(lock);					\
+	return r;						\
+}
+
+#define _LAT_BUCKETS 64		/* see _latency_note() */
+#define _TCP_TYPES 16		/* see _tcp_note() */
+
 typedef struct {
 	PyObject_HEAD
+	adnsstate *m;			/* of the module it came from */
 	adns_state state;
+	FILE *diagfile;			/* adns.init() diagfile, or NULL */
+	FILE *recfile;			/* s.record() output, or NULL */
+	struct _replay *replay;		/* s.replay() recording, or NULL */
+	struct _cache *cache;		/* answer cache, or NULL */
+	unsigned long refresh_hits;	/* see s.set_refresh() */
+	double refresh_fraction;
+	unsigned long refreshes;
+	_qlist ready;			/* answered, waiting for s.completed() */
+	_qlist queue;			/* held back by s.set_ratelimit() */
+	_qlist bulk;			/* the same, for priority.bulk queries */
+	_qlist racing;			/* s.submit_addr() queries in progress */
+	_htab srvsets;			/* s.endpoints() cache */
+	struct _srvset *srv_first, *srv_last;	/* most recently used first */
+	unsigned long long rnd;		/* see _random() */
+	double rtt;			/* upstream latency, EWMA */
+	double failrate;		/* upstream failures, EWMA */
+	unsigned long answers, failures;
+	unsigned long lat_hist[_LAT_BUCKETS], lat_count;
+	double hedge_p, hedge_min;	/* see s.set_hedge() */
+	int txtmode;			/* see s.set_txtmode() */
+	unsigned long hedges, hedge_wins;
+	double rl_qps, rl_burst, rl_tokens, rl_stamp;
+	int rl_maxinflight;
+	int rl_reserve;			/* of rl_maxinflight, not for bulk */
+	int inflight;			/* queries handed to adns */
+	unsigned long throttled;
+	struct _ADNS_Queryobject *sent_first, *sent_last; /* inflight, oldest first */
+	struct _ADNS_Queryobject *live_first, *live_last; /* see _live_add() */
+	size_t answer_bytes;		/* held by queries, see _query_charge() */
+	size_t lim_bytes;		/* see s.set_limits() */
+	int lim_pending;
+	int lim_policy;
+	double lim_wait;
+	unsigned long lim_rejected, lim_shed;
+	struct { adns_rrtype type; double until; } tcp[_TCP_TYPES];
+	int ntcp;			/* see s.set_tcp() */
+	double tcp_idle;
+	unsigned long tcp_queries, tcp_fallbacks;
+	_lock lock;			/* held by every method, see _state_io() */
+	pthread_cond_t polled;		/* a thread's select() has returned */
+	int polling;			/* a thread is in select() */
+	int wake[2];			/* pipe to cut that select() short */
 } ADNS_Stateobject;
 
-staticforward PyTypeObject ADNS_Statetype;
-
 
 
 /* ---------------------------------------------------------------- */
 
 /* Declarations for objects of type ADNS_Query */
 
-typedef struct {
+typedef struct _ADNS_Queryobject {
 	PyObject_HEAD
 	ADNS_Stateobject *s;
 	adns_query query;
+	adns_query hedge;		/* duplicate of query, see _hedge_due() */
+	int hedged;
 	PyObject *answer;
 	PyObject *exc_type;
 	PyObject *exc_value;
 	PyObject *exc_traceback;
+	char *key;			/* see _make_key() */
+	size_t keylen;
+	struct timeval submitted;
+	double due;			/* when a ready answer may be delivered */
+	int inflight;			/* counted in s->inflight */
+	struct _ADNS_Queryobject *sent_prev, *sent_next;
+	int live;			/* in the registry, see _live_add() */
+	struct _ADNS_Queryobject *live_prev, *live_next;
+	size_t charged;			/* counted in s->answer_bytes */
+	int background;			/* owned by the state, not the caller */
+	int bulk;			/* submitted with priority.bulk */
+	int batched;			/* driven by a _batch, see _batch_add() */
+	int stale;			/* answer is an expired cache entry */
+	int usevc;			/* sent over TCP, see _adns_submit() */
+	_qlist *list;			/* ready list or queue it is on */
+	struct _ADNS_Queryobject *prev, *next;
+	struct _ADNS_Queryobject *parent;	/* s.submit_addr() it is part of */
+	struct _ADNS_Queryobject *kids[2];	/* preferred family first */
+	double grace;
+	PyObject *parts;		/* s.submit_partial() kids, or NULL */
+	PyObject *callback;		/* for each RR it completes */
 } ADNS_Queryobject;
 
-staticforward PyTypeObject ADNS_Querytype;
-
 
 
 /* ---------------------------------------------------------------- */
@@ -149,6 +363,57 @@ static _constant_class adns_s[] = {
 	{ NULL, 0 }
 };
 
+/* How TXT RRs are returned, see s.set_txtmode(). */
+enum { _txt_tuple, _txt_joined, _txt_buffer };
+
+static _constant_class adns_txtmode[] = {
+	{ "tuple", _txt_tuple },
+	{ "joined", _txt_joined },
+	{ "buffer", _txt_buffer },
+	{ NULL, 0 }
+};
+
+/* Query priorities, see s.set_ratelimit(). */
+enum { _prio_interactive, _prio_bulk };
+
+static _constant_class adns_priority[] = {
+	{ "interactive", _prio_interactive },
+	{ "bulk", _prio_bulk },
+	{ NULL, 0 }
+};
+
+/* What a submission over the limits does, see s.set_limits(). */
+enum { _lim_reject, _lim_block, _lim_shed };
+
+static _constant_class adns_limit[] = {
+	{ "reject", _lim_reject },
+	{ "block", _lim_block },
+	{ "shed", _lim_shed },
+	{ NULL, 0 }
+};
+
+/* Length of the text of TXT RR s, character-strings joined. */
+static Py_ssize_t
+_txt_len(adns_rr_intstr *s)
+{
+	Py_ssize_t n = 0;
+	for (; s->i != -1; s++)
+		n += s->i;
+	return n;
+}
+
+static void
+_txt_join(
+	char *p,
+	adns_rr_intstr *s
+	)
+{
+	for (; s->i != -1; s++) {
+		memcpy(p, s->str, s->i);
+		p += s->i;
+	}
+}
+
 static PyObject *
 interpret_addr(
 	adns_rr_addr *v
@@ -159,7 +424,7 @@ interpret_addr(
 							 inet_ntoa(v->addr.inet.sin_addr)) ;
 	} else if (v->addr.inet.sin_family == AF_INET6) {
 		char addr_out[INET6_ADDRSTRLEN];
-		inet_ntop(AF_INET6, &v->addr.inet.sin_addr, (char*)&addr_out, INET6_ADDRSTRLEN);
+		inet_ntop(AF_INET6, &v->addr.inet6.sin6_addr, (char*)&addr_out, INET6_ADDRSTRLEN);
 		return Py_BuildValue("is", v->addr.inet.sin_family, addr_out);
 	} else {
 		return NULL;
@@ -191,16 +456,34 @@ interpret_hostaddr(
 
 static PyObject *
 interpret_answer(
-	adns_answer *answer
+	adns_answer *answer,
+	int txtmode
 	)
 {
-	PyObject *o, *rrs;
+	PyObject *o, *rrs, *block = NULL;
+	char *text = NULL;
+	Py_ssize_t off = 0;
 	int i;
 	adns_rrtype t = answer->type & adns_rrt_typemask;
 	adns_rrtype td = answer->type & adns__qtf_deref;
 
+	if (t == adns_r_txt && txtmode == _txt_buffer) {
+		/* one bytes object for the answer, and a memoryview
+		   slice of it for each RR */
+		for (i=0; i<answer->nrrs; i++)
+			off += _txt_len(answer->rrs.manyistr[i]);
+		if (!(o = PyBytes_FromStringAndSize(NULL, off))) return NULL;
+		text = PyBytes_AS_STRING(o);
+		block = PyMemoryView_FromObject(o);
+		Py_DECREF(o);
+		if (!block) return NULL;
+		off = 0;
+	}
 	rrs = PyTuple_New(answer->nrrs);
-	if (!rrs) return NULL;
+	if (!rrs) {
+		Py_XDECREF(block);
+		return NULL;
+	}
 	for (i=0; i<answer->nrrs; i++) {
 		PyObject *a = NULL;
 		switch (t) {
@@ -225,10 +508,10 @@ interpret_answer(
 			{
 				adns_rr_intstrpair *v = \
 					answer->rrs.intstrpair+i;
-				a = Py_BuildValue("s#s#", v->array[0].str,
-						  v->array[0].i,
+				a = Py_BuildValue("y#y#", v->array[0].str,
+						  (Py_ssize_t) v->array[0].i,
 						  v->array[1].str,
-						  v->array[1].i);
+						  (Py_ssize_t) v->array[1].i);
 			}
 			break;
 		case adns_r_mx_raw:
@@ -247,7 +530,7 @@ interpret_answer(
 		case adns_r_cname:
 			{
 				char *(*v) = answer->rrs.str+i;
-				a = PyString_FromString(*v);
+				a = PyUnicode_FromString(*v);
 			}
 			break;
 		case adns_r_txt:
@@ -257,13 +540,27 @@ interpret_answer(
 				int ai;
 				adns_rr_intstr *(*s) = answer->rrs.manyistr+i;
 
+				if (txtmode == _txt_joined) {
+					a = PyBytes_FromStringAndSize(NULL,
+							_txt_len(*s));
+					if (a)
+						_txt_join(PyBytes_AS_STRING(a), *s);
+					break;
+				}
+				if (txtmode == _txt_buffer) {
+					Py_ssize_t n = _txt_len(*s);
+					_txt_join(text + off, *s);
+					a = PySequence_GetSlice(block, off, off + n);
+					off += n;
+					break;
+				}
 				while ((*s)[array_len].i != -1)
 					array_len++;
 
 				if (!(a = PyTuple_New(array_len))) break;
 				for (ai = 0; ai < array_len; ai++)
 				{
-					txt = PyString_FromStringAndSize((*s)[ai].str, (*s)[ai].i);
+					txt = PyBytes_FromStringAndSize((*s)[ai].str, (*s)[ai].i);
 					if (!txt) {
 						Py_DECREF(a);
 						a = NULL;
@@ -278,7 +575,7 @@ interpret_answer(
 				a = interpret_hostaddr(answer->rrs.hostaddr+i);
 			} else {
 				char *(*v) = answer->rrs.str+i;
-				a = PyString_FromString(*v);
+				a = PyUnicode_FromString(*v);
 			}
 			break;
 		case adns_r_soa_raw:
@@ -289,7 +586,7 @@ interpret_answer(
 						  v->expire, v->minimum);
 			}
 			break;
-		case adns_r_rp:
+		case adns_r_rp_raw:
 			{
 				adns_rr_strpair *v = answer->rrs.strpair+i;
 				a = Py_BuildValue("ss", v->array[0], v->array[1]);
@@ -312,736 +609,7024 @@ interpret_answer(
 			Py_INCREF(a);
 		}
 		if (!a) {
+			Py_XDECREF(block);
 			Py_DECREF(rrs);
 			return NULL;
 		}
 		PyTuple_SET_ITEM(rrs, i, a);
 	}
-	o = Py_BuildValue("isiO", (int) answer->status, answer->cname,
-			  answer->expires, rrs);
+	Py_XDECREF(block);
+	o = Py_BuildValue("islO", (int) answer->status, answer->cname,
+			  (long) answer->expires, rrs);
 	Py_DECREF(rrs);
 	return o ;
 }
 
-static char adns_exception__doc__[] = \
-"exception(s)\n\
-\n\
-Checks the status code of an answer and raises an exception if necessary.\n";
+/* ---------------------------------------------------------------- */
 
-static PyObject*
-adns_exception(
-	PyObject *self,
-	PyObject *args
-	)
+static double
+_now(void)
 {
-	PyObject *e, *m;
-	adns_status status;
-	if (!PyArg_ParseTuple(args, "i", &status))
-		return NULL;
-	switch (status) {
-	case adns_s_ok:
-		Py_INCREF(Py_None);
-		return Py_None;
-	case adns_s_nomemory:
-		return PyErr_NoMemory();
-	case adns_s_unknownrrtype:
-	case adns_s_systemfail:
-		e = LocalError;
-		break;
-	case adns_s_timeout:
-	case adns_s_allservfail:
-	case adns_s_norecurse:
-	case adns_s_invalidresponse:
-	case adns_s_unknownformat:
-		e = RemoteFailureError;
-		break;
-	case adns_s_rcodeservfail:
-	case adns_s_rcodeformaterror:
-	case adns_s_rcodenotimplemented:
-	case adns_s_rcoderefused:
-	case adns_s_rcodeunknown:
-		e = RemoteTempError;
-		break;
-	case adns_s_inconsistent:
-	case adns_s_prohibitedcname:
-	case adns_s_answerdomaininvalid:
-	case adns_s_invaliddata:
-		e = RemoteConfigError;
-	case adns_s_querydomainwrong:
-	case adns_s_querydomaininvalid:
-	case adns_s_querydomaintoolong:
-		e = QueryError;
-		break;
-	case adns_s_nxdomain:
-		e = NXDomainError;
-		break;
-	case adns_s_nodata:
-		e = NoDataError;
-		break;
-	default:
-		e = ErrorObject;
-	}
-	if (!(m=Py_BuildValue("is", status,
-				 adns_strerror((adns_status) status))))
-		return NULL;
-	PyErr_SetObject(e, m);
-	Py_DECREF(m);
-	return NULL;
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
 }
 
-/* ---------------------------------------------------------------- */
+static double
+_elapsed(struct timeval *since)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec - since->tv_sec) + (tv.tv_usec - since->tv_usec) / 1e6;
+}
 
-static char ADNS_State_synchronous__doc__[] = 
-"s.synchronous(name,type[,flags]\n\
-\n\
-Perform a query on name synchronously for RR type, returning the answer.\n\
-Answers returned as (status, cname, expires, rrs).\n\
-rrs is an n-tuple, each element is a RR. Format varies by\n\
-RR and query.\n"
-;
+static unsigned long
+_hash(const char *key, size_t len)
+{
+	unsigned long h = 5381;
+	while (len--)
+		h = h * 33 + (unsigned char) *key++;
+	return h;
+}
 
-static PyObject *
-ADNS_State_synchronous(
-	ADNS_Stateobject *self,
-	PyObject *args
-	)
+static _hnode *
+_htab_find(_htab *t, const char *key, size_t keylen, unsigned long hash)
 {
-	char *owner;
-	adns_rrtype type = 0;
-	adns_queryflags flags = 0;
-	adns_answer *answer_r;
-	int r;
-	PyObject *o;
-	if (!PyArg_ParseTuple(args, "si|i", &owner, &type, &flags))
-		return NULL;
-	Py_BEGIN_ALLOW_THREADS;
-	r = adns_synchronous(self->state, owner, type, flags, &answer_r);
-	Py_END_ALLOW_THREADS;
-	if (r) {
-		PyErr_SetString(ErrorObject, strerror(r));
-		return NULL;
+	_hnode *n;
+	if (!t->nbuckets) return NULL;
+	for (n = t->buckets[hash % t->nbuckets]; n; n = n->next)
+		if (n->hash == hash && n->keylen == keylen &&
+		    !memcmp(n->key, key, keylen))
+			return n;
+	return NULL;
+}
+
+static int
+_htab_insert(_htab *t, _hnode *n)
+{
+	if (t->count >= t->nbuckets) {
+		size_t i, nb = t->nbuckets ? t->nbuckets * 2 : 64;
+		_hnode **b = PyMem_Malloc(nb * sizeof(_hnode *));
+		if (!b) return -1;
+		memset(b, 0, nb * sizeof(_hnode *));
+		for (i = 0; i < t->nbuckets; i++) {
+			_hnode *m, *next;
+			for (m = t->buckets[i]; m; m = next) {
+				next = m->next;
+				m->next = b[m->hash % nb];
+				b[m->hash % nb] = m;
+			}
+		}
+		PyMem_Free(t->buckets);
+		t->buckets = b;
+		t->nbuckets = nb;
 	}
-	o = interpret_answer(answer_r);
-	free(answer_r);
-	return o;
+	n->next = t->buckets[n->hash % t->nbuckets];
+	t->buckets[n->hash % t->nbuckets] = n;
+	t->count++;
+	return 0;
+}
+
+static void
+_htab_remove(_htab *t, _hnode *n)
+{
+	_hnode **pp;
+	for (pp = &t->buckets[n->hash % t->nbuckets]; *pp; pp = &(*pp)->next)
+		if (*pp == n) {
+			*pp = n->next;
+			t->count--;
+			return;
+		}
 }
 
+static void
+_htab_free(_htab *t)
+{
+	PyMem_Free(t->buckets);
+	t->buckets = NULL;
+	t->nbuckets = t->count = 0;
+}
 
-static char ADNS_State_submit__doc__[] = 
-"s.submit(name,type[,flags])\n\
-\n\
-Submit a query. Returns a ADNS_Query object.\n"
-;
+/* Query keys identify a query independently of adns: a kind byte,
+   type and flags (big-endian), then owner and zone as C strings. */
 
-static ADNS_Queryobject *newADNS_Queryobject(ADNS_Stateobject *state);
+#define _QK_HDR 9
+enum { _qk_forward = 'f', _qk_reverse = 'r', _qk_reverse_any = 'z' };
 
-static PyObject *
-ADNS_State_submit(
-	ADNS_Stateobject *self,
-	PyObject *args
+static char *
+_make_key(
+	int kind,
+	const char *owner,
+	const char *zone,
+	adns_rrtype type,
+	adns_queryflags flags,
+	size_t *keylen_r
 	)
 {
-	char *owner;
-	adns_rrtype type = 0;
-	adns_queryflags flags = 0;
-	int r;
-	ADNS_Queryobject *o;
-	if (!PyArg_ParseTuple(args, "si|i", &owner, &type, &flags))
-		return NULL;
-	o = newADNS_Queryobject(self);
-	Py_BEGIN_ALLOW_THREADS;
-	r = adns_submit(self->state, owner, type, flags, o, &o->query);
-	Py_END_ALLOW_THREADS;
-	if (r) {
-		PyErr_SetString(ErrorObject, strerror(r));
+	size_t ol = strlen(owner), zl = zone ? strlen(zone) : 0;
+	unsigned char *k;
+	if (!(k = PyMem_Malloc(_QK_HDR + ol + zl + 2))) {
+		PyErr_NoMemory();
 		return NULL;
 	}
-	return (PyObject *) o;
+	k[0] = kind;
+	k[1] = type >> 24; k[2] = type >> 16; k[3] = type >> 8; k[4] = type;
+	k[5] = flags >> 24; k[6] = flags >> 16; k[7] = flags >> 8; k[8] = flags;
+	memcpy(k + _QK_HDR, owner, ol + 1);
+	if (zone) memcpy(k + _QK_HDR + ol + 1, zone, zl);
+	k[_QK_HDR + ol + 1 + zl] = '\0';
+	*keylen_r = _QK_HDR + ol + zl + 2;
+	return (char *) k;
 }
 
+static adns_rrtype
+_key_type(const char *key)
+{
+	const unsigned char *k = (const unsigned char *) key;
+	return (adns_rrtype) (((unsigned long) k[1] << 24) | (k[2] << 16) | (k[3] << 8) | k[4]);
+}
 
-static char ADNS_State_submit_reverse__doc__[] = 
-"s.submit_reverse(name,type[,flags])\n\
-\n\
-Submit a query. Returns a ADNS_Query object.\n\
-flags must specify some kind of PTR query."
-;
+static adns_queryflags
+_key_flags(const char *key)
+{
+	const unsigned char *k = (const unsigned char *) key;
+	return (adns_queryflags) (((unsigned long) k[5] << 24) | (k[6] << 16) | (k[7] << 8) | k[8]);
+}
 
+/* Compact answer encoding.  adns returns each answer as one malloc()ed
+   block full of internal pointers; _encode_answer() flattens it into a
+   pointer-free, big-endian byte string and _decode_answer() rebuilds an
+   equivalent answer that can be released with free().  The encoding
+   starts with the exact size of the block the decoder will need. */
 
-static PyObject *
-ADNS_State_submit_reverse(
-	ADNS_Stateobject *self,
-	PyObject *args
-	)
+#define _ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+typedef struct {
+	char *buf;
+	size_t len, size;
+	size_t arena;			/* size of the decoded block */
+	int failed;
+} _abuf;
+
+static void
+_abuf_put(_abuf *b, const void *p, size_t n)
 {
-	char *owner;
-	struct sockaddr_in addr;
-	adns_rrtype type = 0;
-	adns_queryflags flags = 0;
-	int r;
-	ADNS_Queryobject *o;
-	if (!PyArg_ParseTuple(args, "si|i", &owner, &type, &flags))
-		return NULL;
-        r = inet_aton(owner, (struct in_addr *) &(addr.sin_addr));
-        if (!r) {
-                PyErr_SetString(ErrorObject, "invalid IP address");
-                return NULL;
-        }
-	addr.sin_family = AF_INET;
-	o = newADNS_Queryobject(self);
-	Py_BEGIN_ALLOW_THREADS;
-	r = adns_submit_reverse(self->state, (struct sockaddr *)&addr, type, flags, o, &o->query);
-	Py_END_ALLOW_THREADS;
-	if (r) {
-		PyErr_SetString(ErrorObject, strerror(r));
-		return NULL;
+	if (b->failed) return;
+	if (b->len + n > b->size) {
+		size_t size = b->size ? b->size : 256;
+		char *nb;
+		while (size < b->len + n) size *= 2;
+		if (!(nb = PyMem_Realloc(b->buf, size))) {
+			b->failed = 1;
+			return;
+		}
+		b->buf = nb;
+		b->size = size;
 	}
-	return (PyObject *) o;
+	memcpy(b->buf + b->len, p, n);
+	b->len += n;
 }
 
-static char ADNS_State_submit_reverse_any__doc__[] = 
-"s.submit_reverse_any(name,zone,type[,flags])\n\
-\n\
-Submit a query. Returns a ADNS_Query object.\n\
-zone is in-addr.arpa., etc.\n\
-flags must specify some kind of PTR query."
-;
-
+static void
+_abuf_u32(_abuf *b, unsigned long v)
+{
+	unsigned char c[4];
+	c[0] = v >> 24; c[1] = v >> 16; c[2] = v >> 8; c[3] = v;
+	_abuf_put(b, c, 4);
+}
 
-static PyObject *
-ADNS_State_submit_reverse_any(
-	ADNS_Stateobject *self,
-	PyObject *args
-	)
+static void
+_abuf_u64(_abuf *b, unsigned long long v)
 {
-	char *owner, *zone;
-	struct sockaddr_in addr;
-	adns_rrtype type = 0;
-	adns_queryflags flags = 0;
-	int r;
-	ADNS_Queryobject *o;
-	if (!PyArg_ParseTuple(args, "ssi|i", &owner, &zone, &type, &flags))
-		return NULL;
-        r = inet_aton(owner, &(addr.sin_addr));
-        if (!r) {
-                PyErr_SetString(ErrorObject, "invalid IP address");
-                return NULL;
-        }
-	addr.sin_family = AF_INET;
-	o = newADNS_Queryobject(self);
-	Py_BEGIN_ALLOW_THREADS;
-	r = adns_submit_reverse_any(self->state, (struct sockaddr *)&addr, zone, type, flags, o, &o->query);
-	Py_END_ALLOW_THREADS;
-	if (r) {
-		PyErr_SetString(ErrorObject, strerror(r));
-		return NULL;
-	}
-	return (PyObject *) o;
+	_abuf_u32(b, (unsigned long) (v >> 32));
+	_abuf_u32(b, (unsigned long) (v & 0xffffffffUL));
+}
+
+static void
+_abuf_u16(_abuf *b, unsigned v)
+{
+	unsigned char c[2];
+	c[0] = v >> 8; c[1] = v;
+	_abuf_put(b, c, 2);
+}
+
+static void
+_abuf_bytes(_abuf *b, const char *s, int len)
+{
+	if (len < 0 || len >= 0xffff) {
+		b->failed = 1;
+		return;
+	}
+	_abuf_u16(b, len);
+	_abuf_put(b, s, len);
+	b->arena += _ALIGN(len + 1);
+}
+
+static void
+_abuf_str(_abuf *b, const char *s)
+{
+	if (!s) _abuf_u16(b, 0xffff);
+	else _abuf_bytes(b, s, strlen(s));
+}
+
+static void
+_abuf_addr(_abuf *b, adns_rr_addr *v)
+{
+	unsigned char fam;
+	if (v->addr.sa.sa_family == AF_INET) {
+		fam = 4;
+		_abuf_put(b, &fam, 1);
+		_abuf_put(b, &v->addr.inet.sin_addr, 4);
+	} else if (v->addr.sa.sa_family == AF_INET6) {
+		fam = 6;
+		_abuf_put(b, &fam, 1);
+		_abuf_put(b, &v->addr.inet6.sin6_addr, 16);
+	} else
+		b->failed = 1;
+}
+
+static void
+_abuf_hostaddr(_abuf *b, adns_rr_hostaddr *ha)
+{
+	int i;
+	_abuf_str(b, ha->host);
+	_abuf_u32(b, ha->astatus);
+	_abuf_u32(b, ha->naddrs);
+	if (ha->naddrs > 0) {
+		b->arena += _ALIGN(ha->naddrs * sizeof(adns_rr_addr));
+		for (i = 0; i < ha->naddrs; i++)
+			_abuf_addr(b, ha->addrs + i);
+	}
+}
+
+/* Appends the encoding of answer to b; returns -1 if the answer
+   cannot be encoded (unsupported type, or out of memory). */
+static int
+_encode_answer(_abuf *b, adns_answer *answer)
+{
+	adns_rrtype t = answer->type & adns_rrt_typemask;
+	adns_rrtype td = answer->type & adns__qtf_deref;
+	size_t start = b->len;
+	int i, rrsz;
+
+	b->arena = _ALIGN(sizeof(adns_answer));
+	_abuf_u32(b, 0);		/* arena size, patched below */
+	_abuf_u32(b, answer->status);
+	_abuf_u32(b, answer->type);
+	_abuf_u64(b, (unsigned long long) answer->expires);
+	_abuf_u32(b, answer->nrrs);
+	_abuf_str(b, answer->cname);
+	_abuf_str(b, answer->owner);
+	switch (t) {
+	case adns_r_a:
+		rrsz = td ? sizeof(adns_rr_addr) : sizeof(struct in_addr);
+		break;
+	case adns_r_aaaa:
+		rrsz = td ? sizeof(adns_rr_addr) : sizeof(struct in6_addr);
+		break;
+	case adns_r_hinfo:
+		rrsz = sizeof(adns_rr_intstrpair);
+		break;
+	case adns_r_mx_raw:
+		rrsz = td ? sizeof(adns_rr_inthostaddr) : sizeof(adns_rr_intstr);
+		break;
+	case adns_r_ptr_raw:
+	case adns_r_cname:
+		rrsz = sizeof(char *);
+		break;
+	case adns_r_txt:
+		rrsz = sizeof(adns_rr_intstr *);
+		break;
+	case adns_r_ns_raw:
+		rrsz = td ? sizeof(adns_rr_hostaddr) : sizeof(char *);
+		break;
+	case adns_r_soa_raw:
+		rrsz = sizeof(adns_rr_soa);
+		break;
+	case adns_r_rp_raw:
+		rrsz = sizeof(adns_rr_strpair);
+		break;
+	case adns_r_srv_raw:
+		rrsz = td ? sizeof(adns_rr_srvha) : sizeof(adns_rr_srvraw);
+		break;
+	default:
+		if (answer->nrrs) b->failed = 1;
+		rrsz = 0;
+	}
+	b->arena += _ALIGN(answer->nrrs * rrsz);
+	for (i = 0; i < answer->nrrs && !b->failed; i++) {
+		switch (t) {
+		case adns_r_a:
+			if (td) _abuf_addr(b, answer->rrs.addr+i);
+			else _abuf_put(b, answer->rrs.inaddr+i, 4);
+			break;
+		case adns_r_aaaa:
+			if (td) _abuf_addr(b, answer->rrs.addr+i);
+			else _abuf_put(b, answer->rrs.in6addr+i, 16);
+			break;
+		case adns_r_hinfo:
+			{
+				adns_rr_intstrpair *v = answer->rrs.intstrpair+i;
+				_abuf_bytes(b, v->array[0].str, v->array[0].i);
+				_abuf_bytes(b, v->array[1].str, v->array[1].i);
+			}
+			break;
+		case adns_r_mx_raw:
+			if (td) {
+				adns_rr_inthostaddr *v = answer->rrs.inthostaddr+i;
+				_abuf_u32(b, v->i);
+				_abuf_hostaddr(b, &v->ha);
+			} else {
+				adns_rr_intstr *v = answer->rrs.intstr+i;
+				_abuf_u32(b, v->i);
+				_abuf_str(b, v->str);
+			}
+			break;
+		case adns_r_ptr_raw:
+		case adns_r_cname:
+			_abuf_str(b, answer->rrs.str[i]);
+			break;
+		case adns_r_txt:
+			{
+				adns_rr_intstr *s = answer->rrs.manyistr[i];
+				int n = 0;
+				while (s[n].i != -1)
+					n++;
+				_abuf_u16(b, n);
+				b->arena += _ALIGN((n + 1) * sizeof(adns_rr_intstr));
+				for (n = 0; s[n].i != -1; n++)
+					_abuf_bytes(b, s[n].str, s[n].i);
+			}
+			break;
+		case adns_r_ns_raw:
+			if (td) _abuf_hostaddr(b, answer->rrs.hostaddr+i);
+			else _abuf_str(b, answer->rrs.str[i]);
+			break;
+		case adns_r_soa_raw:
+			{
+				adns_rr_soa *v = answer->rrs.soa+i;
+				_abuf_str(b, v->mname);
+				_abuf_str(b, v->rname);
+				_abuf_u32(b, v->serial);
+				_abuf_u32(b, v->refresh);
+				_abuf_u32(b, v->retry);
+				_abuf_u32(b, v->expire);
+				_abuf_u32(b, v->minimum);
+			}
+			break;
+		case adns_r_rp_raw:
+			_abuf_str(b, answer->rrs.strpair[i].array[0]);
+			_abuf_str(b, answer->rrs.strpair[i].array[1]);
+			break;
+		case adns_r_srv_raw:
+			{
+				adns_rr_srvraw *v = td ? NULL : answer->rrs.srvraw+i;
+				adns_rr_srvha *h = td ? answer->rrs.srvha+i : NULL;
+				_abuf_u32(b, td ? h->priority : v->priority);
+				_abuf_u32(b, td ? h->weight : v->weight);
+				_abuf_u32(b, td ? h->port : v->port);
+				if (td) _abuf_hostaddr(b, &h->ha);
+				else _abuf_str(b, v->host);
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	if (b->failed) {
+		b->len = start;
+		b->failed = 0;
+		return -1;
+	}
+	b->buf[start] = b->arena >> 24;
+	b->buf[start+1] = b->arena >> 16;
+	b->buf[start+2] = b->arena >> 8;
+	b->buf[start+3] = b->arena;
+	return 0;
+}
+
+typedef struct {
+	const unsigned char *p, *end;
+	char *base;
+	size_t used, size;
+	int failed;
+} _areader;
+
+static void *
+_ar_alloc(_areader *r, size_t n)
+{
+	void *p;
+	n = _ALIGN(n);
+	if (r->failed || n > r->size - r->used) {
+		r->failed = 1;
+		return NULL;
+	}
+	p = r->base + r->used;
+	r->used += n;
+	return p;
+}
+
+static const unsigned char *
+_ar_take(_areader *r, size_t n)
+{
+	const unsigned char *p = r->p;
+	if (r->failed || (size_t) (r->end - r->p) < n) {
+		r->failed = 1;
+		return NULL;
+	}
+	r->p += n;
+	return p;
+}
+
+static unsigned long
+_ar_u32(_areader *r)
+{
+	const unsigned char *c = _ar_take(r, 4);
+	if (!c) return 0;
+	return ((unsigned long) c[0] << 24) | (c[1] << 16) | (c[2] << 8) | c[3];
+}
+
+static unsigned long long
+_ar_u64(_areader *r)
+{
+	unsigned long long hi = _ar_u32(r);
+	return hi << 32 | _ar_u32(r);
+}
+
+static unsigned
+_ar_u16(_areader *r)
+{
+	const unsigned char *c = _ar_take(r, 2);
+	if (!c) return 0;
+	return (c[0] << 8) | c[1];
+}
+
+/* Returns a NUL-terminated copy in the arena; *len_r gets its length.
+   NULL either means a NULL string or a failure (see r->failed). */
+static char *
+_ar_bytes(_areader *r, int *len_r)
+{
+	unsigned len = _ar_u16(r);
+	const unsigned char *s;
+	char *d;
+	if (len == 0xffff || r->failed) return NULL;
+	if (!(s = _ar_take(r, len)) || !(d = _ar_alloc(r, len + 1)))
+		return NULL;
+	memcpy(d, s, len);
+	d[len] = '\0';
+	if (len_r) *len_r = len;
+	return d;
+}
+
+static void
+_ar_addr(_areader *r, adns_rr_addr *v)
+{
+	const unsigned char *fam = _ar_take(r, 1), *a;
+	memset(v, 0, sizeof(*v));
+	if (!fam) return;
+	if (*fam == 4 && (a = _ar_take(r, 4))) {
+		v->len = sizeof(struct sockaddr_in);
+		v->addr.inet.sin_family = AF_INET;
+		memcpy(&v->addr.inet.sin_addr, a, 4);
+	} else if (*fam == 6 && (a = _ar_take(r, 16))) {
+		v->len = sizeof(struct sockaddr_in6);
+		v->addr.inet6.sin6_family = AF_INET6;
+		memcpy(&v->addr.inet6.sin6_addr, a, 16);
+	} else
+		r->failed = 1;
+}
+
+static void
+_ar_hostaddr(_areader *r, adns_rr_hostaddr *ha)
+{
+	int i;
+	ha->host = _ar_bytes(r, NULL);
+	ha->astatus = _ar_u32(r);
+	ha->naddrs = (int) _ar_u32(r);
+	ha->addrs = NULL;
+	if (ha->naddrs > 0) {
+		if ((size_t) ha->naddrs > (size_t) (r->end - r->p)) {
+			r->failed = 1;
+			return;
+		}
+		if (!(ha->addrs = _ar_alloc(r, ha->naddrs * sizeof(adns_rr_addr))))
+			return;
+		for (i = 0; i < ha->naddrs && !r->failed; i++)
+			_ar_addr(r, ha->addrs + i);
+	}
+}
+
+/* Rebuilds an answer from len bytes at p; returns NULL on malformed
+   input or if memory runs out.  The result must be free()d. */
+static adns_answer *
+_decode_answer(const char *p, size_t len)
+{
+	_areader r;
+	adns_answer *a;
+	adns_rrtype t, td;
+	int i, rrsz = 0;
+	const unsigned char *c;
+
+	r.p = (const unsigned char *) p;
+	r.end = r.p + len;
+	r.failed = 0;
+	r.used = 0;
+	r.size = _ar_u32(&r);
+	if (r.failed || r.size < sizeof(adns_answer) || r.size > 64 * len + 4096)
+		return NULL;
+	if (!(r.base = malloc(r.size))) return NULL;
+	a = _ar_alloc(&r, sizeof(adns_answer));
+	memset(a, 0, sizeof(*a));
+	a->status = _ar_u32(&r);
+	a->type = _ar_u32(&r);
+	a->expires = (time_t) _ar_u64(&r);
+	a->nrrs = (int) _ar_u32(&r);
+	a->cname = _ar_bytes(&r, NULL);
+	a->owner = _ar_bytes(&r, NULL);
+	t = a->type & adns_rrt_typemask;
+	td = a->type & adns__qtf_deref;
+	switch (t) {
+	case adns_r_a: rrsz = td ? sizeof(adns_rr_addr) : sizeof(struct in_addr); break;
+	case adns_r_aaaa: rrsz = td ? sizeof(adns_rr_addr) : sizeof(struct in6_addr); break;
+	case adns_r_hinfo: rrsz = sizeof(adns_rr_intstrpair); break;
+	case adns_r_mx_raw: rrsz = td ? sizeof(adns_rr_inthostaddr) : sizeof(adns_rr_intstr); break;
+	case adns_r_ptr_raw: case adns_r_cname: rrsz = sizeof(char *); break;
+	case adns_r_txt: rrsz = sizeof(adns_rr_intstr *); break;
+	case adns_r_ns_raw: rrsz = td ? sizeof(adns_rr_hostaddr) : sizeof(char *); break;
+	case adns_r_soa_raw: rrsz = sizeof(adns_rr_soa); break;
+	case adns_r_rp_raw: rrsz = sizeof(adns_rr_strpair); break;
+	case adns_r_srv_raw: rrsz = td ? sizeof(adns_rr_srvha) : sizeof(adns_rr_srvraw); break;
+	default:
+		if (a->nrrs) r.failed = 1;
+	}
+	if (a->nrrs < 0 || (size_t) a->nrrs > len) r.failed = 1;
+	a->rrsz = rrsz;
+	if (!r.failed && a->nrrs) {
+		if ((a->rrs.untyped = _ar_alloc(&r, a->nrrs * rrsz)))
+			memset(a->rrs.untyped, 0, a->nrrs * rrsz);
+	}
+	for (i = 0; i < a->nrrs && !r.failed; i++) {
+		switch (t) {
+		case adns_r_a:
+			if (td) _ar_addr(&r, a->rrs.addr+i);
+			else if ((c = _ar_take(&r, 4))) memcpy(a->rrs.inaddr+i, c, 4);
+			break;
+		case adns_r_aaaa:
+			if (td) _ar_addr(&r, a->rrs.addr+i);
+			else if ((c = _ar_take(&r, 16))) memcpy(a->rrs.in6addr+i, c, 16);
+			break;
+		case adns_r_hinfo:
+			{
+				adns_rr_intstrpair *v = a->rrs.intstrpair+i;
+				v->array[0].str = _ar_bytes(&r, &v->array[0].i);
+				v->array[1].str = _ar_bytes(&r, &v->array[1].i);
+			}
+			break;
+		case adns_r_mx_raw:
+			if (td) {
+				a->rrs.inthostaddr[i].i = (int) _ar_u32(&r);
+				_ar_hostaddr(&r, &a->rrs.inthostaddr[i].ha);
+			} else {
+				a->rrs.intstr[i].i = (int) _ar_u32(&r);
+				a->rrs.intstr[i].str = _ar_bytes(&r, NULL);
+			}
+			break;
+		case adns_r_ptr_raw:
+		case adns_r_cname:
+			a->rrs.str[i] = _ar_bytes(&r, NULL);
+			break;
+		case adns_r_txt:
+			{
+				unsigned n = _ar_u16(&r), j;
+				adns_rr_intstr *s;
+				if (!(s = _ar_alloc(&r, (n + 1) * sizeof(adns_rr_intstr))))
+					break;
+				for (j = 0; j < n; j++)
+					s[j].str = _ar_bytes(&r, &s[j].i);
+				s[n].i = -1;
+				s[n].str = NULL;
+				a->rrs.manyistr[i] = s;
+			}
+			break;
+		case adns_r_ns_raw:
+			if (td) _ar_hostaddr(&r, a->rrs.hostaddr+i);
+			else a->rrs.str[i] = _ar_bytes(&r, NULL);
+			break;
+		case adns_r_soa_raw:
+			{
+				adns_rr_soa *v = a->rrs.soa+i;
+				v->mname = _ar_bytes(&r, NULL);
+				v->rname = _ar_bytes(&r, NULL);
+				v->serial = _ar_u32(&r);
+				v->refresh = _ar_u32(&r);
+				v->retry = _ar_u32(&r);
+				v->expire = _ar_u32(&r);
+				v->minimum = _ar_u32(&r);
+			}
+			break;
+		case adns_r_rp_raw:
+			a->rrs.strpair[i].array[0] = _ar_bytes(&r, NULL);
+			a->rrs.strpair[i].array[1] = _ar_bytes(&r, NULL);
+			break;
+		case adns_r_srv_raw:
+			if (td) {
+				adns_rr_srvha *v = a->rrs.srvha+i;
+				v->priority = (int) _ar_u32(&r);
+				v->weight = (int) _ar_u32(&r);
+				v->port = (int) _ar_u32(&r);
+				_ar_hostaddr(&r, &v->ha);
+			} else {
+				adns_rr_srvraw *v = a->rrs.srvraw+i;
+				v->priority = (int) _ar_u32(&r);
+				v->weight = (int) _ar_u32(&r);
+				v->port = (int) _ar_u32(&r);
+				v->host = _ar_bytes(&r, NULL);
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	if (r.failed || r.p != r.end) {
+		free(r.base);
+		return NULL;
+	}
+	return a;
+}
+
+/* Recording and replay.  A recording is the magic string followed by
+   one record per answered query:
+
+	u32 length of the rest of the record
+	u32 latency in microseconds
+	u16 key length, key (see _make_key)
+	encoded answer (see _encode_answer)
+*/
+
+#define _REC_MAGIC "ADNSREC2"
+
+typedef struct _replay_rec {
+	_hnode h;			/* key points into the mapping */
+	const char *blob;
+	size_t bloblen;
+	unsigned long latency;		/* microseconds */
+	struct _replay_rec *next;	/* next answer for the same key */
+} _replay_rec;
+
+struct _replay {
+	char *map;
+	size_t maplen;
+	double timescale;
+	_htab index;			/* key -> cursor into its records */
+	_replay_rec *recs;
+	size_t nrecs;
+};
+
+typedef struct {
+	_hnode h;
+	_replay_rec *first, *last, *cursor;
+} _replay_key;
+
+static void
+_replay_free(struct _replay *rp)
+{
+	size_t i;
+	if (!rp) return;
+	for (i = 0; i < rp->index.nbuckets; i++) {
+		_hnode *n, *next;
+		for (n = rp->index.buckets[i]; n; n = next) {
+			next = n->next;
+			PyMem_Free(n);
+		}
+	}
+	_htab_free(&rp->index);
+	PyMem_Free(rp->recs);
+	if (rp->map) munmap(rp->map, rp->maplen);
+	PyMem_Free(rp);
+}
+
+/* Maps and indexes a recording; sets an exception and returns NULL on
+   failure. */
+static struct _replay *
+_replay_open(
+	adnsstate *m,
+	const char *filename,
+	double timescale
+	)
+{
+	struct _replay *rp;
+	struct stat st;
+	const unsigned char *p, *end;
+	size_t n;
+	int fd;
+
+	if (!(rp = PyMem_Malloc(sizeof(*rp))))
+		return (struct _replay *) PyErr_NoMemory();
+	memset(rp, 0, sizeof(*rp));
+	rp->timescale = timescale;
+	if ((fd = open(filename, O_RDONLY)) == -1) {
+		PyErr_SetFromErrnoWithFilename(m->ErrorObject, (char *) filename);
+		goto error;
+	}
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t) strlen(_REC_MAGIC)) {
+		close(fd);
+		PyErr_SetString(m->ErrorObject, "not an adns recording");
+		goto error;
+	}
+	rp->maplen = st.st_size;
+	rp->map = mmap(NULL, rp->maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (rp->map == MAP_FAILED) {
+		rp->map = NULL;
+		PyErr_SetFromErrnoWithFilename(m->ErrorObject, (char *) filename);
+		goto error;
+	}
+	if (memcmp(rp->map, _REC_MAGIC, strlen(_REC_MAGIC))) {
+		PyErr_SetString(m->ErrorObject, "not an adns recording");
+		goto error;
+	}
+	/* two passes: count records, then index them */
+	for (n = 0; n < 2; n++) {
+		p = (unsigned char *) rp->map + strlen(_REC_MAGIC);
+		end = (unsigned char *) rp->map + rp->maplen;
+		rp->nrecs = 0;
+		while (end - p >= 10) {
+			size_t reclen = ((size_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+			size_t keylen = (p[8] << 8) | p[9];
+			if (reclen > (size_t) (end - p - 4) || keylen + 6 > reclen)
+				break;	/* truncated tail, e.g. a crashed recorder */
+			if (n) {
+				_replay_rec *rec = rp->recs + rp->nrecs;
+				_replay_key *k;
+				rec->latency = ((unsigned long) p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+				rec->h.key = (const char *) p + 10;
+				rec->h.keylen = keylen;
+				rec->h.hash = _hash(rec->h.key, keylen);
+				rec->blob = rec->h.key + keylen;
+				rec->bloblen = reclen - 6 - keylen;
+				rec->next = NULL;
+				k = (_replay_key *) _htab_find(&rp->index, rec->h.key,
+							       keylen, rec->h.hash);
+				if (k) {
+					k->last->next = rec;
+					k->last = rec;
+				} else {
+					if (!(k = PyMem_Malloc(sizeof(*k)))) {
+						PyErr_NoMemory();
+						goto error;
+					}
+					k->h = rec->h;
+					k->first = k->last = k->cursor = rec;
+					if (_htab_insert(&rp->index, &k->h)) {
+						PyMem_Free(k);
+						PyErr_NoMemory();
+						goto error;
+					}
+				}
+			}
+			rp->nrecs++;
+			p += 4 + reclen;
+		}
+		if (!n && !(rp->recs = PyMem_Malloc((rp->nrecs + 1) * sizeof(_replay_rec)))) {
+			PyErr_NoMemory();
+			goto error;
+		}
+	}
+	return rp;
+  error:
+	_replay_free(rp);
+	return NULL;
+}
+
+/* Returns the next recorded answer for key, cycling through repeats,
+   or NULL if the recording has none. */
+static _replay_rec *
+_replay_lookup(struct _replay *rp, const char *key, size_t keylen)
+{
+	_replay_key *k;
+	_replay_rec *rec;
+	k = (_replay_key *) _htab_find(&rp->index, key, keylen, _hash(key, keylen));
+	if (!k) return NULL;
+	rec = k->cursor;
+	k->cursor = rec->next ? rec->next : k->first;
+	return rec;
+}
+
+static void
+_record_answer(
+	ADNS_Stateobject *s,
+	const char *key,
+	size_t keylen,
+	struct timeval *submitted,
+	adns_answer *answer
+	)
+{
+	_abuf b;
+	double latency = _elapsed(submitted);
+	if (keylen > 0xfff0) return;
+	memset(&b, 0, sizeof(b));
+	_abuf_u32(&b, 0);
+	_abuf_u32(&b, latency > 0 ? (unsigned long) (latency * 1e6) : 0);
+	_abuf_u16(&b, keylen);
+	_abuf_put(&b, key, keylen);
+	if (!b.failed && !_encode_answer(&b, answer)) {
+		size_t reclen = b.len - 4;
+		b.buf[0] = reclen >> 24;
+		b.buf[1] = reclen >> 16;
+		b.buf[2] = reclen >> 8;
+		b.buf[3] = reclen;
+		/* write errors are sticky; s.record() reports them */
+		fwrite(b.buf, 1, b.len, s->recfile);
+	}
+	PyMem_Free(b.buf);
+}
+
+/* Shared answer cache: a file that the caches of several states,
+   usually in different processes, map MAP_SHARED as a second level
+   behind their own.  It is a fixed table of slots, and a key may be
+   in any of _SHM_WAYS slots from its hash on.  A writer takes a slot
+   by making its sequence number odd with a compare-and-swap, and
+   makes it even again when done; a reader copies a slot out and uses
+   the copy only if the sequence number was even and unchanged
+   throughout (a seqlock), so reading never blocks and never writes.
+   A writer holds a slot for two short copies and notes its pid there
+   meanwhile, so one that finds a slot busy yields a few times, and if
+   it is still busy with the same sequence number takes it over only
+   once that pid is gone.  A writer that is merely stalled keeps its
+   slot; one that died before noting its pid leaves the slot busy for
+   good, which costs that slot but never tears an entry. */
+
+#define _SHM_MAGIC "ADNSSHM4"
+#define _SHM_DEFAULT (16 << 20)
+#define _SHM_SLOT 512
+#define _SHM_WAYS 4
+#define _SHM_RETRIES 100	/* yields before a busy slot's writer is checked */
+
+typedef struct {
+	char magic[8];
+	unsigned int nslots, slotsize;
+	char pad[48];
+} _shmhdr;
+
+typedef struct {
+	unsigned int seq;		/* odd while being written */
+	int pid;			/* of the writer, 0 when none */
+	unsigned long long expires;
+	unsigned int hash;
+	unsigned short keylen;
+	unsigned short pad;
+	unsigned int bloblen;
+	char data[_SHM_SLOT - 28];	/* key, then encoded answer */
+} _shmslot;
+
+struct _shm {
+	char *map;
+	size_t maplen;
+	_shmslot *slots;
+	unsigned int nslots;
+	unsigned long hits, stores;
+};
+
+/* Maps filename, creating it with room for size bytes of slots if it
+   does not exist yet. */
+static struct _shm *
+_shm_open(
+	adnsstate *m,
+	const char *filename,
+	size_t size
+	)
+{
+	struct _shm *sh;
+	struct stat st;
+	_shmhdr hdr;
+	char *map;
+	int fd;
+
+	if ((fd = open(filename, O_RDWR | O_CREAT, 0600)) == -1)
+		goto oserror;
+	/* whoever gets the lock first sets the file up */
+	if (flock(fd, LOCK_EX) || fstat(fd, &st))
+		goto oserror;
+	if (!st.st_size) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, _SHM_MAGIC, sizeof(hdr.magic));
+		hdr.nslots = size / sizeof(_shmslot);
+		hdr.slotsize = sizeof(_shmslot);
+		if (hdr.nslots < _SHM_WAYS) hdr.nslots = _SHM_WAYS;
+		st.st_size = sizeof(hdr) + (off_t) hdr.nslots * sizeof(_shmslot);
+		if (ftruncate(fd, st.st_size) ||
+		    pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+			goto oserror;
+	} else if (st.st_size < (off_t) sizeof(hdr) ||
+		   pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+		   memcmp(hdr.magic, _SHM_MAGIC, sizeof(hdr.magic)) ||
+		   hdr.slotsize != sizeof(_shmslot) || hdr.nslots < _SHM_WAYS ||
+		   st.st_size < (off_t) (sizeof(hdr) +
+					 (off_t) hdr.nslots * sizeof(_shmslot))) {
+		close(fd);
+		PyErr_SetString(m->ErrorObject, "not an adns shared cache");
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto oserror;
+	/* the mapping would keep the lock otherwise */
+	flock(fd, LOCK_UN);
+	close(fd);
+	if (!(sh = PyMem_Malloc(sizeof(*sh)))) {
+		munmap(map, st.st_size);
+		return (struct _shm *) PyErr_NoMemory();
+	}
+	memset(sh, 0, sizeof(*sh));
+	sh->map = map;
+	sh->maplen = st.st_size;
+	sh->slots = (_shmslot *) (map + sizeof(_shmhdr));
+	sh->nslots = hdr.nslots;
+	return sh;
+  oserror:
+	PyErr_SetFromErrnoWithFilename(m->ErrorObject, (char *) filename);
+	if (fd != -1) close(fd);
+	return NULL;
+}
+
+static void
+_shm_close(struct _shm *m)
+{
+	if (!m) return;
+	munmap(m->map, m->maplen);
+	PyMem_Free(m);
+}
+
+/* Copies the unexpired slot holding key into *copy.  Returns 0 if
+   there is none. */
+static int
+_shm_lookup(
+	struct _shm *m,
+	const char *key,
+	size_t keylen,
+	unsigned long hash,
+	_shmslot *copy
+	)
+{
+	unsigned int h = (unsigned int) hash, seq, w;
+	unsigned long long now = (unsigned long long) time(NULL);
+	_shmslot *slot;
+
+	for (w = 0; w < _SHM_WAYS; w++) {
+		slot = m->slots + (h + w) % m->nslots;
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1 || slot->hash != h || slot->keylen != keylen)
+			continue;
+		memcpy(copy, slot, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+		if (copy->expires > now && copy->keylen == keylen &&
+		    copy->bloblen <= sizeof(copy->data) - keylen &&
+		    !memcmp(copy->data, key, keylen))
+			return 1;
+	}
+	return 0;
+}
+
+/* Shares an answer: in the slot that has key already, else an empty
+   or expired one, else the one expiring soonest. */
+static void
+_shm_store(
+	struct _shm *m,
+	const char *key,
+	size_t keylen,
+	unsigned long hash,
+	time_t expires,
+	const char *blob,
+	size_t bloblen
+	)
+{
+	unsigned int h = (unsigned int) hash, seq, owned, w, busy;
+	unsigned long long now = (unsigned long long) time(NULL);
+	_shmslot *slot, *victim = NULL;
+	int pid;
+
+	if (keylen + bloblen > sizeof(slot->data)) return;
+	for (w = 0; w < _SHM_WAYS; w++) {
+		slot = m->slots + (h + w) % m->nslots;
+		if (slot->hash == h && slot->keylen == keylen &&
+		    !memcmp(slot->data, key, keylen)) {
+			victim = slot;
+			break;
+		}
+		if (!victim || (victim->expires > now &&
+				slot->expires < victim->expires))
+			victim = slot;
+	}
+	seq = __atomic_load_n(&victim->seq, __ATOMIC_RELAXED);
+	for (busy = 0; seq & 1 && busy < _SHM_RETRIES; busy++) {
+		sched_yield();
+		if (__atomic_load_n(&victim->seq, __ATOMIC_RELAXED) != seq)
+			return;		/* its writer is alive and done */
+	}
+	if (seq & 1) {
+		pid = __atomic_load_n(&victim->pid, __ATOMIC_RELAXED);
+		if (pid <= 0 || kill(pid, 0) == 0 || errno != ESRCH)
+			return;		/* stalled, or not known to be gone */
+	}
+	/* odd to odd when reclaiming, so readers keep away */
+	owned = seq & 1 ? seq + 2 : seq + 1;
+	if (!__atomic_compare_exchange_n(&victim->seq, &seq, owned, 0,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	pid = getpid();
+	__atomic_store_n(&victim->pid, pid, __ATOMIC_RELAXED);
+	victim->hash = h;
+	victim->expires = (unsigned long long) expires;
+	victim->keylen = keylen;
+	victim->bloblen = bloblen;
+	memcpy(victim->data, key, keylen);
+	memcpy(victim->data + keylen, blob, bloblen);
+	__atomic_compare_exchange_n(&victim->pid, &pid, 0, 0,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	/* unless it was reclaimed from us meanwhile */
+	if (__atomic_compare_exchange_n(&victim->seq, &owned, owned + 1, 0,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		m->stores++;
+}
+
+/* Answer cache.  Entries keep the encoded answer, possibly inside a
+   mapped snapshot file, and once used its interpretation; they are
+   dropped when they expire or fall off the end of the LRU list.  A
+   snapshot is the magic string followed by records of
+
+	u32 length of the rest of the record
+	u64 expires
+	u16 key length, key (see _make_key)
+	encoded answer (see _encode_answer)
+*/
+
+#define _CACHE_DEFAULT 4096
+#define _SNAP_MAGIC "ADNSCCH2"
+
+typedef struct _centry {
+	_hnode h;			/* key is stored after the entry */
+	struct _centry *prev, *next;	/* LRU list, most recent first */
+	time_t expires;
+	time_t ttl;			/* as of when it was stored */
+	const char *blob;
+	size_t bloblen;
+	int mapped;			/* blob lives in the snapshot mapping */
+	PyObject *answer;		/* interpretation, or NULL */
+	unsigned long hits;
+	int refreshing;			/* background refresh in flight */
+} _centry;
+
+struct _cache {
+	_htab index;
+	_centry *head, *tail;
+	size_t maxentries;
+	time_t maxstale;		/* see s.set_serve_stale() */
+	char *map;			/* snapshot mapping, or NULL */
+	size_t maplen;
+	unsigned long hits, misses, stale;
+	int txtmode;			/* answers are interpreted with */
+	struct _shm *shm;		/* shared second level, or NULL */
+};
+
+static struct _cache *
+_cache_new(size_t maxentries)
+{
+	struct _cache *c;
+	if (!(c = PyMem_Malloc(sizeof(*c))))
+		return (struct _cache *) PyErr_NoMemory();
+	memset(c, 0, sizeof(*c));
+	c->maxentries = maxentries;
+	return c;
+}
+
+static void
+_cache_unlink(struct _cache *c, _centry *e)
+{
+	if (e->prev) e->prev->next = e->next;
+	else c->head = e->next;
+	if (e->next) e->next->prev = e->prev;
+	else c->tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void
+_cache_push(struct _cache *c, _centry *e)
+{
+	e->prev = NULL;
+	e->next = c->head;
+	if (c->head) c->head->prev = e;
+	else c->tail = e;
+	c->head = e;
+}
+
+static void
+_cache_drop(struct _cache *c, _centry *e)
+{
+	_cache_unlink(c, e);
+	_htab_remove(&c->index, &e->h);
+	Py_XDECREF(e->answer);
+	if (!e->mapped) PyMem_Free((char *) e->blob);
+	PyMem_Free(e);
+}
+
+static void
+_cache_free(struct _cache *c)
+{
+	if (!c) return;
+	while (c->head)
+		_cache_drop(c, c->head);
+	_htab_free(&c->index);
+	if (c->map) munmap(c->map, c->maplen);
+	_shm_close(c->shm);
+	PyMem_Free(c);
+}
+
+/* Stores a copy of blob (or blob itself, if mapped) under key, with
+   answer as its interpretation if already known, and returns the
+   entry.  Failures just leave the answer uncached. */
+static _centry *
+_cache_store(
+	struct _cache *c,
+	const char *key,
+	size_t keylen,
+	time_t expires,
+	const char *blob,
+	size_t bloblen,
+	int mapped,
+	PyObject *answer
+	)
+{
+	unsigned long hash = _hash(key, keylen), hits = 0;
+	_centry *e;
+	char *copy = NULL;
+
+	if ((e = (_centry *) _htab_find(&c->index, key, keylen, hash))) {
+		hits = e->hits;
+		_cache_drop(c, e);
+	}
+	if (!mapped) {
+		if (!(copy = PyMem_Malloc(bloblen))) return NULL;
+		memcpy(copy, blob, bloblen);
+		blob = copy;
+	}
+	if (!(e = PyMem_Malloc(sizeof(_centry) + keylen))) {
+		PyMem_Free(copy);
+		return NULL;
+	}
+	memcpy((char *) (e + 1), key, keylen);
+	e->h.key = (char *) (e + 1);
+	e->h.keylen = keylen;
+	e->h.hash = hash;
+	e->expires = expires;
+	e->ttl = expires - time(NULL);
+	e->hits = hits;
+	e->refreshing = 0;
+	e->blob = blob;
+	e->bloblen = bloblen;
+	e->mapped = mapped;
+	Py_XINCREF(answer);
+	e->answer = answer;
+	if (_htab_insert(&c->index, &e->h)) {
+		Py_XDECREF(answer);
+		PyMem_Free(copy);
+		PyMem_Free(e);
+		return NULL;
+	}
+	_cache_push(c, e);
+	while (c->index.count > c->maxentries && c->tail != e)
+		_cache_drop(c, c->tail);
+	return e;
+}
+
+/* Makes sure e->answer is set, dropping e if it cannot be decoded. */
+static int
+_centry_decode(
+	struct _cache *c,
+	_centry *e
+	)
+{
+	adns_answer *a;
+	if (e->answer) return 0;
+	if ((a = _decode_answer(e->blob, e->bloblen))) {
+		e->answer = interpret_answer(a, c->txtmode);
+		free(a);
+	}
+	if (!e->answer) {
+		PyErr_Clear();
+		_cache_drop(c, e);
+		return -1;
+	}
+	return 0;
+}
+
+/* Returns a new reference to the cached answer for key, or NULL (with
+   no exception set) if there is no usable entry.  *e_r gets the entry.
+   Expired entries are kept for up to maxstale seconds for
+   _cache_stale(). */
+static PyObject *
+_cache_lookup(
+	struct _cache *c,
+	const char *key,
+	size_t keylen,
+	_centry **e_r
+	)
+{
+	_centry *e;
+	_shmslot copy;
+	time_t now = time(NULL);
+	unsigned long hash = _hash(key, keylen);
+
+	e = (_centry *) _htab_find(&c->index, key, keylen, hash);
+	if (e && e->expires <= now) {
+		if (e->expires + c->maxstale <= now)
+			_cache_drop(c, e);
+		e = NULL;
+	}
+	if (!e && c->shm && _shm_lookup(c->shm, key, keylen, hash, &copy) &&
+	    (e = _cache_store(c, key, keylen, copy.expires,
+			      copy.data + keylen, copy.bloblen, 0, NULL)))
+		c->shm->hits++;
+	if (!e || _centry_decode(c, e)) {
+		c->misses++;
+		return NULL;
+	}
+	_cache_unlink(c, e);
+	_cache_push(c, e);
+	c->hits++;
+	e->hits++;
+	*e_r = e;
+	Py_INCREF(e->answer);
+	return e->answer;
+}
+
+/* Returns a new reference to the last good answer for key if it
+   expired less than maxstale seconds ago, or NULL. */
+static PyObject *
+_cache_stale(
+	struct _cache *c,
+	const char *key,
+	size_t keylen
+	)
+{
+	_centry *e;
+	e = (_centry *) _htab_find(&c->index, key, keylen, _hash(key, keylen));
+	if (!e || e->expires + c->maxstale <= time(NULL) ||
+	    _centry_decode(c, e))
+		return NULL;
+	c->stale++;
+	Py_INCREF(e->answer);
+	return e->answer;
+}
+
+/* Caches answer_r, whose interpretation is answer, if it is worth it:
+   successes and authoritative negative answers that have not expired. */
+static void
+_cache_answer(
+	struct _cache *c,
+	const char *key,
+	size_t keylen,
+	adns_answer *answer_r,
+	PyObject *answer
+	)
+{
+	_abuf b;
+	if (answer_r->status != adns_s_ok &&
+	    answer_r->status != adns_s_nxdomain &&
+	    answer_r->status != adns_s_nodata)
+		return;
+	if (answer_r->expires <= time(NULL))
+		return;
+	memset(&b, 0, sizeof(b));
+	if (!_encode_answer(&b, answer_r)) {
+		_cache_store(c, key, keylen, answer_r->expires,
+			     b.buf, b.len, 0, answer);
+		if (c->shm)
+			_shm_store(c->shm, key, keylen, _hash(key, keylen),
+				   answer_r->expires, b.buf, b.len);
+	}
+	PyMem_Free(b.buf);
+}
+
+/* Writes all live entries, least recently used first, to filename.
+   The file is replaced atomically. */
+static int
+_cache_dump(
+	adnsstate *m,
+	struct _cache *c,
+	const char *filename
+	)
+{
+	char *tmpname;
+	FILE *f;
+	_centry *e;
+	_abuf b;
+	time_t now = time(NULL);
+	int failed;
+
+	if (!(tmpname = PyMem_Malloc(strlen(filename) + 5))) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	sprintf(tmpname, "%s.tmp", filename);
+	if (!(f = fopen(tmpname, "wb"))) {
+		PyErr_SetFromErrnoWithFilename(m->ErrorObject, tmpname);
+		PyMem_Free(tmpname);
+		return -1;
+	}
+	fwrite(_SNAP_MAGIC, 1, strlen(_SNAP_MAGIC), f);
+	memset(&b, 0, sizeof(b));
+	for (e = c->tail; e; e = e->prev) {
+		if (e->expires <= now || e->h.keylen > 0xfff0) continue;
+		b.len = 0;
+		_abuf_u32(&b, 10 + e->h.keylen + e->bloblen);
+		_abuf_u64(&b, (unsigned long long) e->expires);
+		_abuf_u16(&b, e->h.keylen);
+		_abuf_put(&b, e->h.key, e->h.keylen);
+		_abuf_put(&b, e->blob, e->bloblen);
+		if (b.failed) break;
+		fwrite(b.buf, 1, b.len, f);
+	}
+	PyMem_Free(b.buf);
+	failed = b.failed || ferror(f);
+	if (fclose(f)) failed = 1;
+	if (failed || rename(tmpname, filename)) {
+		if (b.failed) PyErr_NoMemory();
+		else PyErr_SetFromErrnoWithFilename(m->ErrorObject, tmpname);
+		unlink(tmpname);
+		PyMem_Free(tmpname);
+		return -1;
+	}
+	PyMem_Free(tmpname);
+	return 0;
+}
+
+/* Maps a snapshot written by _cache_dump() and enters its unexpired
+   records into the cache; their answers are decoded on first use. */
+static int
+_cache_load(
+	adnsstate *m,
+	struct _cache *c,
+	const char *filename
+	)
+{
+	struct stat st;
+	const unsigned char *p, *end;
+	time_t now = time(NULL);
+	char *map;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) == -1) {
+		PyErr_SetFromErrnoWithFilename(m->ErrorObject, (char *) filename);
+		return -1;
+	}
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t) strlen(_SNAP_MAGIC)) {
+		close(fd);
+		PyErr_SetString(m->ErrorObject, "not an adns cache snapshot");
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		PyErr_SetFromErrnoWithFilename(m->ErrorObject, (char *) filename);
+		return -1;
+	}
+	if (memcmp(map, _SNAP_MAGIC, strlen(_SNAP_MAGIC))) {
+		munmap(map, st.st_size);
+		PyErr_SetString(m->ErrorObject, "not an adns cache snapshot");
+		return -1;
+	}
+	if (c->map) munmap(c->map, c->maplen);
+	c->map = map;
+	c->maplen = st.st_size;
+	p = (unsigned char *) map + strlen(_SNAP_MAGIC);
+	end = (unsigned char *) map + st.st_size;
+	while (end - p >= 14) {
+		_areader r;
+		size_t reclen, keylen;
+		time_t expires;
+		r.p = p;
+		r.end = end;
+		r.failed = 0;
+		reclen = _ar_u32(&r);
+		expires = (time_t) _ar_u64(&r);
+		keylen = _ar_u16(&r);
+		if (reclen > (size_t) (end - p - 4) || keylen + 10 > reclen)
+			break;
+		if (expires > now)
+			_cache_store(c, (const char *) p + 14, keylen, expires,
+				     (const char *) p + 14 + keylen,
+				     reclen - 10 - keylen, 1, NULL);
+		p += 4 + reclen;
+	}
+	return 0;
+}
+
+static int
+_dict_setnum(
+	PyObject *d,
+	char *name,
+	double v
+	)
+{
+	PyObject *o;
+	int r;
+	if (v == (long) v) o = PyLong_FromLong((long) v);
+	else o = PyFloat_FromDouble(v);
+	if (!o) return -1;
+	r = PyDict_SetItemString(d, name, o);
+	Py_DECREF(o);
+	return r;
+}
+
+/* Raises the exception for status, or returns None if it is ok. */
+static PyObject *
+_status_error(
+	adnsstate *m,
+	adns_status status
+	)
+{
+	PyObject *e, *v;
+	switch (status) {
+	case adns_s_ok:
+		Py_INCREF(Py_None);
+		return Py_None;
+	case adns_s_nomemory:
+		return PyErr_NoMemory();
+	case adns_s_unknownrrtype:
+	case adns_s_systemfail:
+		e = m->LocalError;
+		break;
+	case adns_s_timeout:
+	case adns_s_allservfail:
+	case adns_s_norecurse:
+	case adns_s_invalidresponse:
+	case adns_s_unknownformat:
+		e = m->RemoteFailureError;
+		break;
+	case adns_s_rcodeservfail:
+	case adns_s_rcodeformaterror:
+	case adns_s_rcodenotimplemented:
+	case adns_s_rcoderefused:
+	case adns_s_rcodeunknown:
+		e = m->RemoteTempError;
+		break;
+	case adns_s_inconsistent:
+	case adns_s_prohibitedcname:
+	case adns_s_answerdomaininvalid:
+	case adns_s_invaliddata:
+		e = m->RemoteConfigError;
+	case adns_s_querydomainwrong:
+	case adns_s_querydomaininvalid:
+	case adns_s_querydomaintoolong:
+		e = m->QueryError;
+		break;
+	case adns_s_nxdomain:
+		e = m->NXDomainError;
+		break;
+	case adns_s_nodata:
+		e = m->NoDataError;
+		break;
+	default:
+		e = m->ErrorObject;
+	}
+	if (!(v=Py_BuildValue("is", status,
+				 adns_strerror((adns_status) status))))
+		return NULL;
+	PyErr_SetObject(e, v);
+	Py_DECREF(v);
+	return NULL;
+}
+
+static char adns_exception__doc__[] = \
+"exception(s)\n\
+\n\
+Checks the status code of an answer and raises an exception if necessary.\n";
+
+static PyObject*
+adns_exception(
+	PyObject *self,
+	PyObject *args
+	)
+{
+	adns_status status;
+	if (!PyArg_ParseTuple(args, "i", &status))
+		return NULL;
+	return _status_error(PyModule_GetState(self), status);
+}
+
+/* ---------------------------------------------------------------- */
+
+static ADNS_Queryobject *newADNS_Queryobject(ADNS_Stateobject *state);
+static PyObject *_query_wait(ADNS_Queryobject *self);
+
+static void
+_qlist_push(
+	_qlist *l,
+	ADNS_Queryobject *o
+	)
+{
+	o->list = l;
+	o->next = NULL;
+	o->prev = l->tail;
+	if (l->tail) l->tail->next = o;
+	else l->head = o;
+	l->tail = o;
+	l->count++;
+}
+
+static void
+_qlist_unlink(ADNS_Queryobject *o)
+{
+	_qlist *l = o->list;
+	if (!l) return;
+	if (o->prev) o->prev->next = o->next;
+	else l->head = o->next;
+	if (o->next) o->next->prev = o->prev;
+	else l->tail = o->prev;
+	o->prev = o->next = NULL;
+	o->list = NULL;
+	l->count--;
+}
+
+/* The ready list holds queries that were answered without going
+   through adns, or collected from it early; s.completed() delivers
+   them once due. */
+/* Memory accounting: s->answer_bytes is about what the answers that
+   queries hold take, as sys.getsizeof() would count it, from when the
+   query gets its answer until it is deallocated. */
+static size_t
+_answer_bytes(PyObject *o)
+{
+	PyTypeObject *t = Py_TYPE(o);
+	size_t n = t->tp_basicsize;
+	Py_ssize_t i;
+
+	if (PyTuple_Check(o)) {
+		n += PyTuple_GET_SIZE(o) * sizeof(PyObject *);
+		for (i = 0; i < PyTuple_GET_SIZE(o); i++)
+			if (PyTuple_GET_ITEM(o, i) != Py_None)
+				n += _answer_bytes(PyTuple_GET_ITEM(o, i));
+	} else if (PyUnicode_Check(o))
+		n += PyUnicode_GET_LENGTH(o) * PyUnicode_KIND(o);
+	else if (PyBytes_Check(o))
+		n += PyBytes_GET_SIZE(o);
+	else if (PyMemoryView_Check(o))
+		/* its share of the bytes object behind it */
+		n += PyMemoryView_GET_BUFFER(o)->len;
+	return n;
+}
+
+static void
+_query_charge(ADNS_Queryobject *o)
+{
+	if (o->charged || !o->answer || o->background || o->batched)
+		return;
+	o->charged = _answer_bytes(o->answer);
+	o->s->answer_bytes += o->charged;
+}
+
+static void
+_query_uncharge(ADNS_Queryobject *o)
+{
+	o->s->answer_bytes -= o->charged;
+	o->charged = 0;
+}
+
+static void
+_ready_push(
+	ADNS_Stateobject *s,
+	ADNS_Queryobject *o,
+	double due
+	)
+{
+	o->due = due;
+	_qlist_push(&s->ready, o);
+	_query_charge(o);
+}
+
+/* o's hedge has been answered or cancelled; like the query itself,
+   it held an in-flight slot until now. */
+static void
+_hedge_gone(ADNS_Queryobject *o)
+{
+	o->hedge = NULL;
+	o->s->inflight--;
+}
+
+/* Marks o as no longer known to adns. */
+static void
+_query_done(ADNS_Queryobject *o)
+{
+	ADNS_Stateobject *s = o->s;
+	if (o->hedge) {
+		adns_cancel(o->hedge);
+		_hedge_gone(o);
+	}
+	o->query = NULL;
+	if (o->inflight) {
+		o->inflight = 0;
+		s->inflight--;
+		if (o->sent_prev) o->sent_prev->sent_next = o->sent_next;
+		else s->sent_first = o->sent_next;
+		if (o->sent_next) o->sent_next->sent_prev = o->sent_prev;
+		else s->sent_last = o->sent_prev;
+		o->sent_prev = o->sent_next = NULL;
+	}
+}
+
+/* The registry: the queries the submit methods have handed out, from
+   then until the caller is done with them, i.e. s.completed() returned
+   them or their check(), wait() or cancel() finished them.  It holds a
+   reference to each, so a query cannot go away while adns still has
+   it, and s.allqueries() need not ask adns. */
+static void
+_live_add(ADNS_Queryobject *o)
+{
+	ADNS_Stateobject *s = o->s;
+	Py_INCREF(o);
+	o->live = 1;
+	o->live_next = NULL;
+	o->live_prev = s->live_last;
+	if (s->live_last) s->live_last->live_next = o;
+	else s->live_first = o;
+	s->live_last = o;
+}
+
+/* Takes o out of the registry, which may deallocate it. */
+static void
+_live_drop(ADNS_Queryobject *o)
+{
+	ADNS_Stateobject *s = o->s;
+	if (!o->live) return;
+	o->live = 0;
+	if (o->live_prev) o->live_prev->live_next = o->live_next;
+	else s->live_first = o->live_next;
+	if (o->live_next) o->live_next->live_prev = o->live_prev;
+	else s->live_last = o->live_prev;
+	o->live_prev = o->live_next = NULL;
+	Py_DECREF(o);
+}
+
+/* Drops o from the registry if it is neither waiting nor in adns. */
+static void
+_live_done(ADNS_Queryobject *o)
+{
+	if (!o->list && !o->query) _live_drop(o);
+}
+
+static int
+_query_setkey(
+	ADNS_Queryobject *o,
+	int kind,
+	const char *owner,
+	const char *zone,
+	adns_rrtype type,
+	adns_queryflags flags
+	)
+{
+	if (!(o->key = _make_key(kind, owner, zone, type, flags, &o->keylen)))
+		return -1;
+	gettimeofday(&o->submitted, NULL);
+	return 0;
+}
+
+/* Upstream health: EWMAs of latency and failure, and a histogram of
+   latencies in quarter-octave buckets from 0.1ms for percentiles.  The
+   histogram is halved every _LAT_WINDOW answers so it follows recent
+   behaviour. */
+
+#define _LAT_MIN 1e-4
+#define _LAT_STEP 1.189207115002721	/* 2 ** 0.25 */
+#define _LAT_WINDOW 4096
+#define _EWMA_ALPHA 0.1
+
+static void
+_latency_note(
+	ADNS_Stateobject *s,
+	double t,
+	int status
+	)
+{
+	double bound = _LAT_MIN;
+	int i, failed = status > adns_s_max_localfail &&
+			status <= adns_s_max_tempfail;
+
+	s->answers++;
+	s->failrate += _EWMA_ALPHA * (failed - s->failrate);
+	if (failed) {
+		s->failures++;
+		return;
+	}
+	s->rtt = s->answers == s->failures + 1 ? t :
+		 s->rtt + _EWMA_ALPHA * (t - s->rtt);
+	for (i = 0; t > bound && i < _LAT_BUCKETS - 1; i++)
+		bound *= _LAT_STEP;
+	s->lat_hist[i]++;
+	if (++s->lat_count >= _LAT_WINDOW) {
+		s->lat_count = 0;
+		for (i = 0; i < _LAT_BUCKETS; i++)
+			s->lat_count += s->lat_hist[i] /= 2;
+	}
+}
+
+/* Large answers: adns asks without EDNS0, so an answer that does not
+   fit in 512 bytes is truncated over UDP and adns asks again over TCP.
+   Types in s->tcp go over TCP from the start instead, on the one
+   connection adns keeps to its nameserver and sends its queries down
+   back to back; until -1 means always, otherwise the type was learnt
+   from a fallback and goes back to UDP once tcp_idle seconds pass
+   without a query of that type. */
+
+/* A lower bound on the size of the message that brought answer. */
+static size_t
+_wire_size(adns_answer *a)
+{
+	size_t n = 12 + 4 + (a->owner ? strlen(a->owner) + 2 : 1);
+	adns_rr_intstr *v;
+	int i, j;
+
+	for (i = 0; i < a->nrrs; i++) {
+		n += 2 + 10;		/* compressed owner, fixed fields */
+		switch (a->type & adns_rrt_typemask) {
+		case adns_r_a:
+			n += 4;
+			break;
+		case adns_r_aaaa:
+			n += 16;
+			break;
+		case adns_r_txt:
+			for (v = a->rrs.manyistr[i]; v->i != -1; v++)
+				n += v->i + 1;
+			break;
+		case adns_r_hinfo:
+			for (j = 0; j < 2; j++)
+				n += a->rrs.intstrpair[i].array[j].i + 1;
+			break;
+		default:
+			break;
+		}
+	}
+	return n;
+}
+
+static int
+_tcp_find(
+	ADNS_Stateobject *s,
+	adns_rrtype type
+	)
+{
+	int i;
+	for (i = 0; i < s->ntcp; i++)
+		if (s->tcp[i].type == type) return i;
+	return -1;
+}
+
+/* Whether a query of type goes over TCP; one that does keeps a learnt
+   type there for another tcp_idle seconds. */
+static int
+_tcp_preferred(
+	ADNS_Stateobject *s,
+	adns_rrtype type
+	)
+{
+	int i = _tcp_find(s, type);
+	double now;
+	if (i < 0) return 0;
+	if (s->tcp[i].until < 0) return 1;
+	if (s->tcp[i].until > (now = _now())) {
+		s->tcp[i].until = now + s->tcp_idle;
+		return 1;
+	}
+	s->tcp[i] = s->tcp[--s->ntcp];
+	return 0;
+}
+
+/* Counts answers that must have come over TCP after all, and learns
+   their type.  Those of queries sent over TCP in the first place,
+   asked for or learnt, did not fall back. */
+static void
+_tcp_note(
+	ADNS_Stateobject *s,
+	int usevc,
+	adns_answer *a
+	)
+{
+	int i;
+	if (usevc || _wire_size(a) <= 512)
+		return;
+	i = _tcp_find(s, a->type);
+	if (i >= 0 && s->tcp[i].until < 0) return;
+	s->tcp_fallbacks++;
+	if (!s->tcp_idle) return;
+	if (i < 0) {
+		if (s->ntcp == _TCP_TYPES) return;
+		i = s->ntcp++;
+		s->tcp[i].type = a->type;
+	}
+	s->tcp[i].until = _now() + s->tcp_idle;
+}
+
+/* The latency below which fraction p of answers arrived, or 0 if
+   there have been none. */
+static double
+_latency_percentile(
+	ADNS_Stateobject *s,
+	double p
+	)
+{
+	unsigned long n = 0;
+	double bound = _LAT_MIN;
+	int i;
+
+	if (!s->lat_count) return 0;
+	for (i = 0; i < _LAT_BUCKETS - 1; i++, bound *= _LAT_STEP)
+		if ((n += s->lat_hist[i]) >= p * s->lat_count)
+			break;
+	return bound;
+}
+
+/* Common handling of an answer from adns: recording, caching and
+   interpretation.  If the upstream failed and the cache has a
+   recently expired answer, that is used instead and *stale_r set.
+   usevc says whether the query was sent over TCP.  Releases answer_r. */
+static PyObject *
+_answer_arrived(
+	ADNS_Stateobject *s,
+	const char *key,
+	size_t keylen,
+	struct timeval *submitted,
+	int usevc,
+	adns_answer *answer_r,
+	int *stale_r
+	)
+{
+	PyObject *o;
+	_latency_note(s, _elapsed(submitted), answer_r->status);
+	if (answer_r->status == adns_s_ok)
+		_tcp_note(s, usevc, answer_r);
+	if (s->recfile)
+		_record_answer(s, key, keylen, submitted, answer_r);
+	*stale_r = 0;
+	if (s->cache && s->cache->maxstale &&
+	    answer_r->status > adns_s_max_localfail &&
+	    answer_r->status <= adns_s_max_tempfail &&
+	    (o = _cache_stale(s->cache, key, keylen))) {
+		free(answer_r);
+		*stale_r = 1;
+		return o;
+	}
+	o = interpret_answer(answer_r, s->txtmode);
+	if (o && s->cache)
+		_cache_answer(s->cache, key, keylen, answer_r, o);
+	free(answer_r);
+	return o;
+}
+
+/* Stores the interpretation of answer_r in o and releases answer_r. */
+static int
+_query_answered(
+	ADNS_Queryobject *o,
+	adns_answer *answer_r
+	)
+{
+	o->answer = _answer_arrived(o->s, o->key, o->keylen, &o->submitted,
+				    o->usevc, answer_r, &o->stale);
+	_query_done(o);
+	if (!o->answer) return -1;
+	_query_charge(o);
+	return 0;
+}
+
+/* In replay mode, answers o from the recording instead of adns. */
+static int
+_replay_submit(
+	ADNS_Stateobject *self,
+	ADNS_Queryobject *o
+	)
+{
+	_replay_rec *rec;
+	adns_answer *answer;
+	if (!(rec = _replay_lookup(self->replay, o->key, o->keylen))) {
+		PyErr_SetString(self->m->ErrorObject, "no recorded answer");
+		return -1;
+	}
+	if (!(answer = _decode_answer(rec->blob, rec->bloblen))) {
+		PyErr_SetString(self->m->ErrorObject, "corrupt recording");
+		return -1;
+	}
+	o->answer = interpret_answer(answer, self->txtmode);
+	free(answer);
+	if (!o->answer) return -1;
+	_ready_push(self, o, _now() + rec->latency / 1e6 * self->replay->timescale);
+	return 0;
+}
+
+/* Submits o to adns as described by its key, into *qr. */
+static int
+_adns_submit(
+	ADNS_Stateobject *self,
+	ADNS_Queryobject *o,
+	adns_query *qr
+	)
+{
+	const char *owner = o->key + _QK_HDR;
+	const char *zone = owner + strlen(owner) + 1;
+	adns_rrtype type = _key_type(o->key);
+	adns_queryflags flags = _key_flags(o->key);
+	int kind = o->key[0];
+	struct sockaddr_in addr;
+	int r;
+
+	if (self->ntcp && !(flags & adns_qf_usevc) &&
+	    _tcp_preferred(self, type)) {
+		flags |= adns_qf_usevc;
+		self->tcp_queries++;
+	}
+	o->usevc = (flags & adns_qf_usevc) != 0;
+
+	if (kind != _qk_forward) {
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		if (!inet_aton(owner, &addr.sin_addr)) {
+			PyErr_SetString(self->m->ErrorObject, "invalid IP address");
+			return -1;
+		}
+	}
+	Py_BEGIN_ALLOW_THREADS;
+	if (kind == _qk_forward)
+		r = adns_submit(self->state, owner, type, flags, o, qr);
+	else if (kind == _qk_reverse)
+		r = adns_submit_reverse(self->state, (struct sockaddr *)&addr,
+					type, flags, o, qr);
+	else
+		r = adns_submit_reverse_any(self->state, (struct sockaddr *)&addr,
+					    zone, type, flags, o, qr);
+	Py_END_ALLOW_THREADS;
+	if (r) {
+		PyErr_SetString(self->m->ErrorObject, strerror(r));
+		return -1;
+	}
+	/* the thread in select() has to let adns send it */
+	if (self->polling) (void) !write(self->wake[1], "", 1);
+	return 0;
+}
+
+/* Hands o to adns. */
+static int
+_query_dispatch(
+	ADNS_Stateobject *self,
+	ADNS_Queryobject *o
+	)
+{
+	if (_adns_submit(self, o, &o->query))
+		return -1;
+	gettimeofday(&o->submitted, NULL);
+	o->inflight = 1;
+	self->inflight++;
+	o->sent_prev = self->sent_last;
+	if (self->sent_last) self->sent_last->sent_next = o;
+	else self->sent_first = o;
+	self->sent_last = o;
+	if (self->rl_qps) self->rl_tokens -= 1;
+	return 0;
+}
+
+/* Rate limiting: a token bucket of rl_qps tokens per second holding at
+   most rl_burst, and at most rl_maxinflight queries in adns at once.
+   Queries over the limits wait on the queue, or bulk queries on the
+   bulk queue, which is only served when the other is empty and which
+   may not use the last rl_reserve in-flight slots. */
+
+static int
+_may_dispatch(
+	ADNS_Stateobject *self,
+	int bulk
+	)
+{
+	if (self->rl_maxinflight && self->inflight >=
+	    self->rl_maxinflight - (bulk ? self->rl_reserve : 0))
+		return 0;
+	if (self->rl_qps) {
+		double now = _now();
+		self->rl_tokens += (now - self->rl_stamp) * self->rl_qps;
+		if (self->rl_tokens > self->rl_burst)
+			self->rl_tokens = self->rl_burst;
+		self->rl_stamp = now;
+		if (self->rl_tokens < 1) return 0;
+	}
+	return 1;
+}
+
+/* How long until the token bucket lets the next query through. */
+static double
+_throttle_delay(ADNS_Stateobject *self)
+{
+	if (!self->rl_qps || self->rl_tokens >= 1) return 1.0;
+	return (1 - self->rl_tokens) / self->rl_qps;
+}
+
+static int _state_select(ADNS_Stateobject *self, double ft);
+static void _collect(ADNS_Stateobject *self);
+
+/* Queries outstanding, as s.set_limits() counts them. */
+static int
+_pending(ADNS_Stateobject *self)
+{
+	return self->inflight + (int) (self->queue.count + self->bulk.count);
+}
+
+/* Gives up on o, the oldest outstanding query, to make room: s.completed()
+   delivers it and its check() raises LimitError. */
+static void
+_query_shed(ADNS_Queryobject *o)
+{
+	ADNS_Stateobject *s = o->s;
+	if (o->list)
+		_qlist_unlink(o);
+	else {
+		Py_BEGIN_ALLOW_THREADS;
+		adns_cancel(o->query);
+		Py_END_ALLOW_THREADS;
+		_query_done(o);
+	}
+	PyErr_SetString(s->m->LimitError, "shed to make room");
+	PyErr_Fetch(&o->exc_type, &o->exc_value, &o->exc_traceback);
+	_ready_push(s, o, 0);
+	s->lim_shed++;
+}
+
+/* Makes room for another query as s.set_limits() says, or raises
+   LimitError.  Only the pending limit sheds or blocks: the answers held
+   go only when their queries are let go, which neither brings about. */
+static int
+_admit(ADNS_Stateobject *self)
+{
+	ADNS_Queryobject *o;
+	double end = 0, now;
+
+	if (self->lim_bytes && self->answer_bytes >= self->lim_bytes)
+		goto reject;
+	while (self->lim_pending && _pending(self) >= self->lim_pending) {
+		if (self->lim_policy == _lim_shed) {
+			/* bulk first; then answers in adns, which are
+			   about to take more memory */
+			if (!(o = self->bulk.head)) {
+				for (o = self->sent_first; o; o = o->sent_next)
+					if (!o->background && !o->batched) break;
+			}
+			if (!o) o = self->queue.head;
+			if (o) {
+				_query_shed(o);
+				continue;
+			}
+		} else if (self->lim_policy == _lim_block) {
+			now = _now();
+			if (!end) end = now + self->lim_wait;
+			if (now < end) {
+				if (_state_select(self, end - now < 1.0 ?
+						  end - now : 1.0))
+					return -1;
+				_collect(self);
+				continue;
+			}
+		}
+		goto reject;
+	}
+	return 0;
+  reject:
+	self->lim_rejected++;
+	PyErr_Format(self->m->LimitError,
+		     "%d queries pending, %zu bytes of answers held",
+		     _pending(self), self->answer_bytes);
+	return -1;
+}
+
+/* Dispatches o now, or queues it if the limits say so. */
+static int
+_query_submit(
+	ADNS_Stateobject *self,
+	ADNS_Queryobject *o
+	)
+{
+	/* a batch holds its answers only until it returns */
+	if ((self->lim_pending || self->lim_bytes) && !o->batched &&
+	    _admit(self))
+		return -1;
+	if ((self->rl_qps || self->rl_maxinflight) &&
+	    (self->queue.head || (o->bulk && self->bulk.head) ||
+	     !_may_dispatch(self, o->bulk))) {
+		_qlist_push(o->bulk ? &self->bulk : &self->queue, o);
+		self->throttled++;
+		return 0;
+	}
+	return _query_dispatch(self, o);
+}
+
+/* Whether o waits on either queue. */
+static int
+_queued(ADNS_Queryobject *o)
+{
+	return o->list == &o->s->queue || o->list == &o->s->bulk;
+}
+
+/* Dispatches queued queries while the limits allow, bulk ones once
+   there are no others. */
+static void
+_pump(ADNS_Stateobject *self)
+{
+	ADNS_Queryobject *o;
+	for (;;) {
+		if ((o = self->queue.head)) {
+			if (!_may_dispatch(self, 0)) break;
+		} else if (!(o = self->bulk.head) || !_may_dispatch(self, 1))
+			break;
+		_qlist_unlink(o);
+		if (_query_dispatch(self, o)) {
+			PyErr_Fetch(&o->exc_type, &o->exc_value, &o->exc_traceback);
+			_ready_push(self, o, 0);
+		}
+	}
+}
+
+/* Hedging: a query that has taken longer than the hedge_p percentile
+   of recent answers is submitted a second time, and whichever copy
+   answers first is used.  Sends the hedges that are due and returns
+   how long until the next one may be. */
+
+#define _HEDGE_MINSAMPLES 20
+#define _HEDGE_BATCH 32
+
+static double
+_hedge_due(ADNS_Stateobject *self)
+{
+	ADNS_Queryobject *o, *due[_HEDGE_BATCH];
+	double delay, left, wait = 1.0;
+	int i, n = 0;
+
+	if (!self->hedge_p || self->lat_count < _HEDGE_MINSAMPLES)
+		return wait;
+	delay = _latency_percentile(self, self->hedge_p);
+	if (delay < self->hedge_min) delay = self->hedge_min;
+	/* oldest first, so the first not yet due ends the search */
+	for (o = self->sent_first; o; o = o->sent_next) {
+		if (o->background || o->hedged) continue;
+		if ((left = delay - _elapsed(&o->submitted)) > 0) {
+			if (left < wait) wait = left;
+			break;
+		} else if (n < _HEDGE_BATCH)
+			due[n++] = o;
+		else
+			wait = 0;
+	}
+	for (i = 0; i < n; i++) {
+		o = due[i];
+		if ((self->rl_qps || self->rl_maxinflight) &&
+		    !_may_dispatch(self, o->bulk))
+			break;
+		o->hedged = 1;
+		if (_adns_submit(self, o, &o->hedge)) {
+			PyErr_Clear();
+			o->hedge = NULL;
+			continue;
+		}
+		self->inflight++;
+		if (self->rl_qps) self->rl_tokens -= 1;
+		self->hedges++;
+	}
+	return wait;
+}
+
+/* adns_check() on o and its hedge, if any: the first to finish wins
+   and the other is cancelled. */
+static int
+_query_check(
+	ADNS_Queryobject *o,
+	adns_answer **answer_r
+	)
+{
+	adns_state state = o->s->state;
+	adns_query q;
+	void *ctx;
+	int r;
+
+	if ((q = o->hedge) && !adns_check(state, &q, answer_r, &ctx)) {
+		_hedge_gone(o);
+		adns_cancel(o->query);
+		o->s->hedge_wins++;
+		return 0;
+	}
+	r = adns_check(state, &o->query, answer_r, &ctx);
+	if (r != EWOULDBLOCK && o->hedge) {
+		adns_cancel(o->hedge);
+		_hedge_gone(o);
+	}
+	return r;
+}
+
+/* Background queries refresh cache entries.  They hold no reference
+   to the state; the state holds the only reference to them until
+   they complete or it goes away. */
+
+static void
+_cache_refresh(
+	ADNS_Stateobject *self,
+	_centry *e
+	)
+{
+	ADNS_Queryobject *o;
+	if ((self->rl_qps || self->rl_maxinflight) && !_may_dispatch(self, 1))
+		return;
+	if (!(o = newADNS_Queryobject(self)))
+		goto error;
+	o->background = 1;
+	Py_DECREF(self);
+	if (!(o->key = PyMem_Malloc(e->h.keylen))) {
+		Py_DECREF(o);
+		goto error;
+	}
+	memcpy(o->key, e->h.key, e->h.keylen);
+	o->keylen = e->h.keylen;
+	gettimeofday(&o->submitted, NULL);
+	if (_query_dispatch(self, o)) {
+		Py_DECREF(o);
+		goto error;
+	}
+	e->refreshing = 1;
+	self->refreshes++;
+	return;
+  error:
+	PyErr_Clear();
+}
+
+static void
+_background_done(
+	ADNS_Stateobject *self,
+	ADNS_Queryobject *o,
+	adns_answer *answer_r
+	)
+{
+	_centry *e;
+	if (answer_r && _query_answered(o, answer_r))
+		PyErr_Clear();
+	_query_done(o);
+	if (self->cache &&
+	    (e = (_centry *) _htab_find(&self->cache->index, o->key, o->keylen,
+					_hash(o->key, o->keylen))))
+		e->refreshing = 0;
+	Py_DECREF(o);
+}
+
+/* Collects finished background queries, leaving any exception the
+   caller is about to raise in place. */
+static void
+_reap_background(ADNS_Stateobject *self)
+{
+	ADNS_Queryobject *o, *next;
+	adns_answer *answer_r;
+	PyObject *et, *ev, *tb;
+	int r;
+
+	PyErr_Fetch(&et, &ev, &tb);
+	for (o = self->sent_first; o; o = next) {
+		next = o->sent_next;
+		if (!o->background) continue;
+		r = _query_check(o, &answer_r);
+		if (r == EWOULDBLOCK) continue;
+		_background_done(self, o, r ? NULL : answer_r);
+	}
+	PyErr_Restore(et, ev, tb);
+}
+
+/* Collects every answer adns has finished, freeing their slots; the
+   queries go on the ready list for s.completed(). */
+static void
+_collect(ADNS_Stateobject *self)
+{
+	ADNS_Queryobject *o, *next;
+	adns_answer *answer_r;
+	int r;
+
+	/* the in-flight list rather than adns_forallqueries(), which
+	   would not let the losers of hedges be cancelled on the way */
+	for (o = self->sent_first; o; o = next) {
+		next = o->sent_next;
+		/* a batch running in another thread polls its own */
+		if (o->batched) continue;
+		r = _query_check(o, &answer_r);
+		if (r == EWOULDBLOCK) continue;
+		if (o->background) {
+			_background_done(self, o, r ? NULL : answer_r);
+			continue;
+		}
+		if (r) {
+			PyErr_SetString(self->m->ErrorObject, strerror(r));
+			_query_done(o);
+		} else
+			_query_answered(o, answer_r);
+		if (PyErr_Occurred())
+			PyErr_Fetch(&(o->exc_type),
+				    &(o->exc_value),
+				    &(o->exc_traceback));
+		_ready_push(self, o, 0);
+	}
+}
+
+/* Looks key up in the cache, refreshing hot entries close to expiry. */
+static PyObject *
+_state_cached(
+	ADNS_Stateobject *self,
+	const char *key,
+	size_t keylen
+	)
+{
+	_centry *e;
+	PyObject *o = _cache_lookup(self->cache, key, keylen, &e);
+	if (o && self->refresh_hits && !e->refreshing &&
+	    e->hits >= self->refresh_hits &&
+	    e->expires - time(NULL) <= self->refresh_fraction * e->ttl)
+		_cache_refresh(self, e);
+	return o;
+}
+
+/* Answers o without adns if possible, from the recording being
+   replayed or the cache.  Returns 1 if it did, 0 if adns has to be
+   asked, or -1 on error. */
+static int
+_query_local(
+	ADNS_Stateobject *self,
+	ADNS_Queryobject *o
+	)
+{
+	if (self->replay)
+		return _replay_submit(self, o) ? -1 : 1;
+	if (self->cache &&
+	    (o->answer = _state_cached(self, o->key, o->keylen))) {
+		_ready_push(self, o, 0);
+		return 1;
+	}
+	return 0;
+}
+
+/* s.submit_addr() races an A and an AAAA query (its kids) and sits on
+   the racing list until _race_update() decides: as soon as the
+   preferred family has addresses, or grace seconds after the other
+   one had, or when both have failed.  Kids are ordinary queries whose
+   answers are taken off the ready list here instead of being handed
+   out by s.completed(). */
+
+/* Forgets about o wherever it is. */
+static void
+_query_abandon(ADNS_Queryobject *o)
+{
+	if (o->list)
+		_qlist_unlink(o);
+	else if (o->query) {
+		Py_BEGIN_ALLOW_THREADS;
+		adns_cancel(o->query);
+		Py_END_ALLOW_THREADS;
+		_query_done(o);
+	}
+}
+
+static void
+_race_drop(ADNS_Queryobject *p)
+{
+	Py_ssize_t i;
+	PyObject *k;
+	for (i = 0; i < 2; i++) {
+		if (!p->kids[i]) continue;
+		_query_abandon(p->kids[i]);
+		Py_CLEAR(p->kids[i]);
+	}
+	if (p->parts) {
+		for (i = 0; i < PyList_GET_SIZE(p->parts); i++)
+			if ((k = PyList_GET_ITEM(p->parts, i)) != Py_None)
+				_query_abandon((ADNS_Queryobject *) k);
+		Py_CLEAR(p->parts);
+	}
+}
+
+/* Cancels o for the caller, answered or not; it leaves the registry,
+   which may deallocate it. */
+static void
+_query_cancel(ADNS_Queryobject *o)
+{
+	_race_drop(o);
+	_query_abandon(o);
+	_query_uncharge(o);
+	Py_CLEAR(o->answer);
+	_live_drop(o);
+}
+
+static void
+_cancel_all(ADNS_Stateobject *self)
+{
+	while (self->live_first)
+		_query_cancel(self->live_first);
+}
+
+/* 1 if kid k has arrived with addresses, -1 if it has failed, 0 if it
+   is still out. */
+static int
+_race_kid(
+	ADNS_Queryobject *k,
+	double now
+	)
+{
+	if (k->list == &k->s->ready && k->due <= now)
+		_qlist_unlink(k);
+	if (k->list || k->query) return 0;
+	if (k->exc_type || !k->answer) return -1;
+	if (PyLong_AsLong(PyTuple_GET_ITEM(k->answer, 0)) != adns_s_ok ||
+	    !PyTuple_GET_SIZE(PyTuple_GET_ITEM(k->answer, 3)))
+		return -1;
+	return 1;
+}
+
+/* Merges the addresses of the kids that have them into an rr.ADDR
+   style answer. */
+static PyObject *
+_race_answer(
+	ADNS_Queryobject *p,
+	int *ok
+	)
+{
+	PyObject *rrs, *a, *cname = NULL;
+	long expires = 0, e;
+	Py_ssize_t n = 0, i, j = 0;
+	int k, family;
+
+	for (k = 0; k < 2; k++)
+		if (ok[k] > 0)
+			n += PyTuple_GET_SIZE(PyTuple_GET_ITEM(p->kids[k]->answer, 3));
+	if (!(rrs = PyTuple_New(n))) return NULL;
+	for (k = 0; k < 2; k++) {
+		if (ok[k] <= 0) continue;
+		a = p->kids[k]->answer;
+		family = _key_type(p->kids[k]->key) == adns_r_a ? AF_INET : AF_INET6;
+		e = PyLong_AsLong(PyTuple_GET_ITEM(a, 2));
+		if (!cname) {
+			cname = PyTuple_GET_ITEM(a, 1);
+			expires = e;
+		} else if (e < expires)
+			expires = e;
+		for (i = 0; i < PyTuple_GET_SIZE(PyTuple_GET_ITEM(a, 3)); i++) {
+			PyObject *v = Py_BuildValue("iO", family,
+				PyTuple_GET_ITEM(PyTuple_GET_ITEM(a, 3), i));
+			if (!v) {
+				Py_DECREF(rrs);
+				return NULL;
+			}
+			PyTuple_SET_ITEM(rrs, j++, v);
+		}
+	}
+	a = Py_BuildValue("iOlO", (int) adns_s_ok, cname, expires, rrs);
+	Py_DECREF(rrs);
+	return a;
+}
+
+static int _partial_update(ADNS_Queryobject *p, double now);
+
+/* Settles p if its kids allow; returns 1 if it did. */
+static int
+_race_update(
+	ADNS_Queryobject *p,
+	double now
+	)
+{
+	ADNS_Queryobject *k;
+	int ok[2];
+
+	if (p->parts) return _partial_update(p, now);
+
+	ok[0] = _race_kid(p->kids[0], now);
+	ok[1] = _race_kid(p->kids[1], now);
+	if (ok[0] > 0 || (ok[1] > 0 && ok[0] < 0) ||
+	    (ok[1] > 0 && p->due && p->due <= now)) {
+		if (!(p->answer = _race_answer(p, ok)))
+			PyErr_Fetch(&p->exc_type, &p->exc_value, &p->exc_traceback);
+		p->stale = (ok[0] > 0 && p->kids[0]->stale) ||
+			   (ok[1] > 0 && p->kids[1]->stale);
+	} else if (ok[1] > 0) {
+		if (!p->due) p->due = now + p->grace;
+		return 0;
+	} else if (ok[0] < 0 && ok[1] < 0) {
+		/* both failed: pass on the preferred family's failure */
+		k = p->kids[p->kids[0]->answer || !p->kids[1]->answer ? 0 : 1];
+		p->answer = k->answer;
+		p->exc_type = k->exc_type;
+		p->exc_value = k->exc_value;
+		p->exc_traceback = k->exc_traceback;
+		_query_uncharge(k);
+		k->answer = k->exc_type = k->exc_value = k->exc_traceback = NULL;
+	} else
+		return 0;
+	_race_drop(p);
+	_qlist_unlink(p);
+	_ready_push(p->s, p, 0);
+	return 1;
+}
+
+static void
+_race_all(
+	ADNS_Stateobject *self,
+	double now
+	)
+{
+	ADNS_Queryobject *p, *next;
+	/* s.submit_partial() callbacks may drop or cancel queries, the
+	   next one too, in which case this starts over */
+	if ((p = self->racing.head)) Py_INCREF(p);
+	while (p) {
+		if (p->list != &self->racing) {
+			Py_DECREF(p);
+			if ((p = self->racing.head)) Py_INCREF(p);
+			continue;
+		}
+		if ((next = p->next)) Py_INCREF(next);
+		_race_update(p, now);
+		Py_DECREF(p);
+		p = next;
+	}
+}
+
+/* Shortens timeout ft to when a race might next be decided. */
+static double
+_race_timeout(
+	ADNS_Queryobject *p,
+	double now,
+	double ft
+	)
+{
+	Py_ssize_t i;
+	ADNS_Queryobject *k;
+	if (p->due && p->due - now < ft) ft = p->due - now;
+	for (i = 0; i < 2; i++) {
+		if (!(k = p->kids[i])) continue;
+		if (k->list == &k->s->ready && k->due - now < ft)
+			ft = k->due - now;
+	}
+	for (i = 0; p->parts && i < PyList_GET_SIZE(p->parts); i++) {
+		k = (ADNS_Queryobject *) PyList_GET_ITEM(p->parts, i);
+		if ((PyObject *) k != Py_None &&
+		    k->list == &k->s->ready && k->due - now < ft)
+			ft = k->due - now;
+	}
+	return ft > 0 ? ft : 0;
+}
+
+/* s.submit_partial() asks for the _raw form of an MX, NS or SRV query
+   (parts[0]) and, once that is in, for the addresses of each host in
+   it (parts[1 + i] for RR i), instead of leaving it to adns, which
+   only answers once it has them all.  Meanwhile p->answer is the
+   deref form of the answer, each host as (host, None, None) until its
+   addresses arrive; p is settled once all have. */
+
+/* The host of an RR: the RR itself for NS (whole), else its last
+   item; in the deref form, a (host, status, addrs) tuple. */
+static PyObject *
+_partial_host(
+	PyObject *rr,
+	int whole
+	)
+{
+	if (whole) return rr;
+	return PyTuple_GET_ITEM(rr, PyTuple_GET_SIZE(rr) - 1);
+}
+
+/* rr with its host replaced by hostaddr. */
+static PyObject *
+_partial_rr(
+	PyObject *rr,
+	PyObject *hostaddr,
+	int whole
+	)
+{
+	PyObject *n;
+	Py_ssize_t i, last;
+	if (whole) {
+		Py_INCREF(hostaddr);
+		return hostaddr;
+	}
+	last = PyTuple_GET_SIZE(rr) - 1;
+	if (!(n = PyTuple_New(last + 1))) return NULL;
+	for (i = 0; i < last; i++) {
+		Py_INCREF(PyTuple_GET_ITEM(rr, i));
+		PyTuple_SET_ITEM(n, i, PyTuple_GET_ITEM(rr, i));
+	}
+	Py_INCREF(hostaddr);
+	PyTuple_SET_ITEM(n, last, hostaddr);
+	return n;
+}
+
+/* p->answer with RR i replaced by rr, and expires no later than
+   expires. */
+static int
+_partial_set(
+	ADNS_Queryobject *p,
+	Py_ssize_t i,
+	PyObject *rr,
+	long expires
+	)
+{
+	PyObject *a = p->answer, *old = PyTuple_GET_ITEM(a, 3), *rrs, *n;
+	long e = PyLong_AsLong(PyTuple_GET_ITEM(a, 2));
+	Py_ssize_t j;
+
+	/* a new tuple: q.partial() may have handed out the old one */
+	if (!(rrs = PyTuple_New(PyTuple_GET_SIZE(old)))) return -1;
+	for (j = 0; j < PyTuple_GET_SIZE(old); j++) {
+		n = j == i ? rr : PyTuple_GET_ITEM(old, j);
+		Py_INCREF(n);
+		PyTuple_SET_ITEM(rrs, j, n);
+	}
+	n = Py_BuildValue("OOlN", PyTuple_GET_ITEM(a, 0), PyTuple_GET_ITEM(a, 1),
+			  expires < e ? expires : e, rrs);
+	if (!n) return -1;
+	Py_SETREF(p->answer, n);
+	return 0;
+}
+
+/* Starts the address queries for the hosts of raw answer a. */
+static int
+_partial_expand(
+	ADNS_Queryobject *p,
+	PyObject *a
+	)
+{
+	ADNS_Stateobject *s = p->s;
+	ADNS_Queryobject *raw = (ADNS_Queryobject *) PyList_GET_ITEM(p->parts, 0);
+	PyObject *raws = PyTuple_GET_ITEM(a, 3), *rrs, *rr, *ha;
+	Py_ssize_t i, n = PyTuple_GET_SIZE(raws);
+	int whole = _key_type(raw->key) == adns_r_ns_raw;
+	ADNS_Queryobject *k;
+	const char *host;
+
+	if (!(rrs = PyTuple_New(n))) return -1;
+	for (i = 0; i < n; i++) {
+		rr = PyTuple_GET_ITEM(raws, i);
+		if (!(ha = Py_BuildValue("OOO", _partial_host(rr, whole),
+					 Py_None, Py_None)))
+			goto error;
+		rr = _partial_rr(rr, ha, whole);
+		Py_DECREF(ha);
+		if (!rr) goto error;
+		PyTuple_SET_ITEM(rrs, i, rr);
+	}
+	p->answer = Py_BuildValue("OOON", PyTuple_GET_ITEM(a, 0),
+				  PyTuple_GET_ITEM(a, 1), PyTuple_GET_ITEM(a, 2),
+				  rrs);
+	if (!p->answer) return -1;
+	for (i = 0; i < n; i++) {
+		host = PyUnicode_AsUTF8(_partial_host(PyTuple_GET_ITEM(raws, i),
+						      whole));
+		if (!host ||
+		    !(k = newADNS_Queryobject(s)))
+			return -1;
+		k->parent = p;
+		k->bulk = p->bulk;
+		if (PyList_Append(p->parts, (PyObject *) k)) {
+			Py_DECREF(k);
+			return -1;
+		}
+		Py_DECREF(k);
+		if (_query_setkey(k, _qk_forward, host, NULL, adns_r_addr,
+				  _key_flags(raw->key)))
+			return -1;
+		switch (_query_local(s, k)) {
+		case -1: return -1;
+		case 1: continue;
+		}
+		if (_query_submit(s, k)) {
+			/* say so for this host alone */
+			PyErr_Fetch(&k->exc_type, &k->exc_value, &k->exc_traceback);
+			_ready_push(s, k, 0);
+		}
+	}
+	return 0;
+  error:
+	Py_DECREF(rrs);
+	return -1;
+}
+
+/* The (host, status, addrs) that kid k, which is done, found for
+   host. */
+static PyObject *
+_partial_hostaddr(
+	ADNS_Queryobject *k,
+	PyObject *host,
+	long *expires
+	)
+{
+	PyObject *a = k->answer;
+	int status;
+	if (k->exc_type || !a) {
+		*expires = LONG_MAX;
+		return Py_BuildValue("OiO", host, (int) adns_s_systemfail, Py_None);
+	}
+	status = PyLong_AsLong(PyTuple_GET_ITEM(a, 0));
+	*expires = PyLong_AsLong(PyTuple_GET_ITEM(a, 2));
+	return Py_BuildValue("OiO", host, status,
+			     status == adns_s_ok ? PyTuple_GET_ITEM(a, 3) : Py_None);
+}
+
+static int
+_partial_update(
+	ADNS_Queryobject *p,
+	double now
+	)
+{
+	ADNS_Queryobject *raw = (ADNS_Queryobject *) PyList_GET_ITEM(p->parts, 0);
+	ADNS_Queryobject *k;
+	PyObject *parts = p->parts, *done = NULL, *rr, *ha, *cb, *r;
+	Py_ssize_t i, n, left = 0;
+	int whole = _key_type(raw->key) == adns_r_ns_raw;
+	long expires;
+
+	if (!p->answer) {
+		if (!_race_kid(raw, now)) return 0;
+		if (raw->exc_type || !raw->answer ||
+		    PyLong_AsLong(PyTuple_GET_ITEM(raw->answer, 0)) != adns_s_ok ||
+		    !PyTuple_GET_SIZE(PyTuple_GET_ITEM(raw->answer, 3))) {
+			/* nothing to expand: pass on the raw answer */
+			_query_uncharge(raw);
+			p->answer = raw->answer;
+			p->exc_type = raw->exc_type;
+			p->exc_value = raw->exc_value;
+			p->exc_traceback = raw->exc_traceback;
+			raw->answer = raw->exc_type = raw->exc_value =
+				raw->exc_traceback = NULL;
+			goto settled;
+		}
+		if (_partial_expand(p, raw->answer))
+			goto error;
+	}
+	n = PyList_GET_SIZE(parts) - 1;
+	for (i = 0; i < n; i++) {
+		k = (ADNS_Queryobject *) PyList_GET_ITEM(parts, i + 1);
+		if ((PyObject *) k == Py_None) continue;
+		if (!_race_kid(k, now)) {
+			left++;
+			continue;
+		}
+		rr = PyTuple_GET_ITEM(PyTuple_GET_ITEM(p->answer, 3), i);
+		if (!(ha = _partial_hostaddr(k, PyTuple_GET_ITEM(
+				_partial_host(rr, whole), 0), &expires)))
+			goto error;
+		rr = _partial_rr(rr, ha, whole);
+		Py_DECREF(ha);
+		if (!rr || _partial_set(p, i, rr, expires)) {
+			Py_XDECREF(rr);
+			goto error;
+		}
+		Py_DECREF(rr);
+		Py_INCREF(Py_None);
+		PyList_SetItem(parts, i + 1, Py_None);
+		if (p->callback) {
+			if (!done && !(done = PyList_New(0))) goto error;
+			if (PyList_Append(done, PyTuple_GET_ITEM(
+				    PyTuple_GET_ITEM(p->answer, 3), i)))
+				goto error;
+		}
+	}
+	if (left) goto notify;
+	goto settled;
+  error:
+	PyErr_Fetch(&p->exc_type, &p->exc_value, &p->exc_traceback);
+  settled:
+	_race_drop(p);
+	_qlist_unlink(p);
+	_ready_push(p->s, p, 0);
+	left = 0;
+  notify:
+	/* last, as the callback may do anything to p */
+	if (done) {
+		cb = p->callback;
+		Py_INCREF(cb);
+		for (i = 0; i < PyList_GET_SIZE(done); i++) {
+			r = PyObject_CallFunctionObjArgs(
+				cb, (PyObject *) p, PyList_GET_ITEM(done, i), NULL);
+			if (!r) PyErr_WriteUnraisable(cb);
+			Py_XDECREF(r);
+		}
+		Py_DECREF(cb);
+		Py_DECREF(done);
+	}
+	return !left;
+}
+
+/* Sleeps t seconds without the GIL or the state lock. */
+static void
+_state_sleep(
+	ADNS_Stateobject *self,
+	double t
+	)
+{
+	struct timeval tv;
+	unsigned long depth;
+	if (t <= 0) return;
+	tv.tv_sec = (long) t;
+	tv.tv_usec = (long) ((t - tv.tv_sec) * 1e6);
+	Py_BEGIN_ALLOW_THREADS;
+	depth = _lock_drop(&self->lock);
+	select(0, NULL, NULL, NULL, &tv);
+	_lock_take(&self->lock, depth);
+	Py_END_ALLOW_THREADS;
+}
+
+/* Waits up to ft seconds for adns' sockets and processes what came;
+   called with the state lock but not the GIL.  Threads sharing the
+   state take turns: one at a time selects, with the lock let go so
+   that the others can submit and check meanwhile, and the others wait
+   for its round to end, since it may well bring their answers.  A
+   query submitted meanwhile cuts the round short through self->wake,
+   so that adns gets to set its timers.  Returns -1 with errno set if
+   select() fails. */
+static int
+_state_io(
+	ADNS_Stateobject *self,
+	double ft
+	)
+{
+	fd_set rfds, wfds, efds;
+	struct timeval tv, tv_buf, *tv_mod = &tv, now;
+	struct timespec until;
+	unsigned long depth;
+	int r, err, maxfd = 0;
+	char buf[64];
+
+	if (ft < 0) ft = 0;
+	if (self->polling) {
+		if (!ft) return 0;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += (time_t) ft;
+		until.tv_nsec += (long) ((ft - (time_t) ft) * 1e9);
+		if (until.tv_nsec >= 1000000000) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+		depth = self->lock.depth;
+		self->lock.depth = 0;
+		__atomic_store_n(&self->lock.owner, 0, __ATOMIC_RELAXED);
+		pthread_cond_timedwait(&self->polled, &self->lock.mutex, &until);
+		__atomic_store_n(&self->lock.owner, PyThread_get_thread_ident(),
+				 __ATOMIC_RELAXED);
+		self->lock.depth = depth;
+		return 0;
+	}
+	tv.tv_sec = (long) ft;
+	tv.tv_usec = (long) ((ft - tv.tv_sec) * 1e6);
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+	FD_ZERO(&efds);
+	gettimeofday(&now, NULL);
+	adns_beforeselect(self->state, &maxfd, &rfds, &wfds, &efds,
+			  &tv_mod, &tv_buf, &now);
+	FD_SET(self->wake[0], &rfds);
+	if (self->wake[0] >= maxfd) maxfd = self->wake[0] + 1;
+	self->polling = 1;
+	depth = _lock_drop(&self->lock);
+	r = select(maxfd, &rfds, &wfds, &efds, tv_mod);
+	err = errno;
+	_lock_take(&self->lock, depth);
+	self->polling = 0;
+	if (r > 0 && FD_ISSET(self->wake[0], &rfds))
+		while (read(self->wake[0], buf, sizeof(buf)) > 0)
+			;
+	if (r != -1) {
+		/* adns ignores sockets it no longer has */
+		gettimeofday(&now, NULL);
+		adns_afterselect(self->state, maxfd, &rfds, &wfds, &efds, &now);
+	}
+	pthread_cond_broadcast(&self->polled);
+	errno = err;
+	return r == -1 ? -1 : 0;
+}
+
+/* Batches back s.resolve_all() and s.resolve_routes(): a growing set
+   of queries driven together, with the GIL released while waiting. */
+typedef struct {
+	ADNS_Queryobject *o;
+	adns_query query;		/* as handed to adns, or NULL */
+	adns_query hedge;
+	adns_answer *answer;
+	int err;
+	int won;			/* answered by the hedge */
+	int waiting;			/* not answered yet */
+	int announced;			/* passed to the arrival callback */
+} _bitem;
+
+typedef struct _batch {
+	_bitem *items;
+	Py_ssize_t n, size;
+	size_t pending;
+	double due;			/* latest replayed answer */
+} _batch;
+
+typedef int (*_batch_arrived)(ADNS_Stateobject *, struct _batch *,
+			      Py_ssize_t, void *);
+
+/* Runs adns without touching Python objects (so the GIL may be
+   released) until one of the n queries in items finishes or timeout
+   seconds pass, or after one round of I/O if none of them has been
+   sent yet.  Returns the number that finished. */
+static int
+_batch_poll(
+	ADNS_Stateobject *self,
+	_bitem *items,
+	size_t n,
+	double timeout
+	)
+{
+	adns_state state = self->state;
+	adns_answer *answer_r;
+	adns_query q;
+	void *ctx;
+	double end = _now() + timeout, left;
+	int r, done, polled;
+	size_t i;
+
+	for (;;) {
+		done = polled = 0;
+		for (i = 0; i < n; i++) {
+			if (!(q = items[i].query)) continue;
+			polled++;
+			if ((q = items[i].hedge) &&
+			    !adns_check(state, &q, &answer_r, &ctx)) {
+				adns_cancel(items[i].query);
+				items[i].query = items[i].hedge = NULL;
+				items[i].answer = answer_r;
+				items[i].won = 1;
+				done++;
+				continue;
+			}
+			q = items[i].query;
+			r = adns_check(state, &q, &answer_r, &ctx);
+			if (r == EWOULDBLOCK) continue;
+			if (items[i].hedge) {
+				adns_cancel(items[i].hedge);
+				items[i].hedge = NULL;
+			}
+			items[i].query = NULL;
+			if (r) items[i].err = r;
+			else items[i].answer = answer_r;
+			done++;
+		}
+		if (done) return done;
+		if ((left = end - _now()) <= 0) return 0;
+		if (_state_io(self, left) && errno != EINTR)
+			return 0;
+		/* still queued: the answers to other queries make room */
+		if (!polled) return 0;
+	}
+}
+
+/* Adds a forward query to b, answering it locally if possible.
+   Returns its index, or -1 on error. */
+static Py_ssize_t
+_batch_add(
+	ADNS_Stateobject *self,
+	_batch *b,
+	const char *owner,
+	adns_rrtype type,
+	adns_queryflags flags
+	)
+{
+	_bitem *it;
+	ADNS_Queryobject *o;
+
+	if (b->n == b->size) {
+		Py_ssize_t size = b->size ? 2 * b->size : 16;
+		if (!(it = PyMem_Realloc(b->items, size * sizeof(*it)))) {
+			PyErr_NoMemory();
+			return -1;
+		}
+		b->items = it;
+		b->size = size;
+	}
+	it = b->items + b->n;
+	memset(it, 0, sizeof(*it));
+	if (!(o = it->o = newADNS_Queryobject(self)))
+		return -1;
+	o->batched = 1;
+	b->n++;
+	if (_query_setkey(o, _qk_forward, owner, NULL, type, flags))
+		return -1;
+	switch (_query_local(self, o)) {
+	case -1: return -1;
+	case 1:
+		if (o->due > b->due) b->due = o->due;
+		_qlist_unlink(o);
+		return b->n - 1;
+	}
+	if (_query_submit(self, o)) return -1;
+	it->query = o->query;
+	it->waiting = 1;
+	b->pending++;
+	return b->n - 1;
+}
+
+/* Moves what _batch_poll() found into the query objects. */
+static void
+_batch_harvest(_batch *b)
+{
+	ADNS_Queryobject *o;
+	Py_ssize_t i;
+
+	for (i = 0; i < b->n; i++) {
+		o = b->items[i].o;
+		if (b->items[i].answer || b->items[i].err) {
+			/* _batch_poll() has dealt with the hedge */
+			if (o->hedge) _hedge_gone(o);
+			if (b->items[i].won) o->s->hedge_wins++;
+			b->items[i].won = 0;
+		}
+		if (b->items[i].answer) {
+			if (_query_answered(o, b->items[i].answer))
+				PyErr_Fetch(&o->exc_type, &o->exc_value,
+					    &o->exc_traceback);
+		} else if (b->items[i].err) {
+			PyErr_SetString(o->s->m->ErrorObject, strerror(b->items[i].err));
+			PyErr_Fetch(&o->exc_type, &o->exc_value,
+				    &o->exc_traceback);
+			_query_done(o);
+		} else
+			continue;
+		b->items[i].answer = NULL;
+		b->items[i].err = 0;
+		b->items[i].waiting = 0;
+		b->pending--;
+	}
+}
+
+/* Drives b until every query is answered or deadline (if set) passes,
+   calling arrived, which may add queries, as each one is answered. */
+static int
+_batch_run(
+	ADNS_Stateobject *self,
+	_batch *b,
+	double deadline,
+	_batch_arrived arrived,
+	void *arg
+	)
+{
+	ADNS_Queryobject *o;
+	Py_ssize_t i;
+	double wait, hedge;
+
+	for (;;) {
+		for (i = 0; i < b->n; i++) {
+			if (b->items[i].waiting || b->items[i].announced)
+				continue;
+			b->items[i].announced = 1;
+			if (arrived && arrived(self, b, i, arg))
+				return -1;
+		}
+		if (!b->pending) break;
+		/* ordinary queries may hold the in-flight slots */
+		_collect(self);
+		_pump(self);
+		hedge = _hedge_due(self);
+		for (i = 0; i < b->n; i++) {
+			o = b->items[i].o;
+			if (b->items[i].waiting && !b->items[i].hedge)
+				b->items[i].hedge = o->hedge;
+			if (!b->items[i].waiting || b->items[i].query) continue;
+			if (o->query)
+				b->items[i].query = o->query;
+			else if (o->list == &self->ready) {
+				/* failed on its way out of the queue */
+				_qlist_unlink(o);
+				b->items[i].waiting = 0;
+				b->pending--;
+			}
+		}
+		wait = deadline ? deadline - _now() : 60;
+		if (deadline && wait <= 0) break;
+		if ((self->queue.head || self->bulk.head) &&
+		    _throttle_delay(self) < wait)
+			wait = _throttle_delay(self);
+		if (self->hedge_p && hedge < wait)
+			wait = hedge;
+		Py_BEGIN_ALLOW_THREADS;
+		_batch_poll(self, b->items, b->n, wait);
+		Py_END_ALLOW_THREADS;
+		_batch_harvest(b);
+		if (self->refreshes) _reap_background(self);
+	}
+	if (b->due) _state_sleep(self, b->due - _now());
+	return 0;
+}
+
+/* Cancels whatever is still outstanding and releases b. */
+static void
+_batch_free(
+	ADNS_Stateobject *self,
+	_batch *b
+	)
+{
+	ADNS_Queryobject *o;
+	Py_ssize_t i;
+
+	for (i = 0; i < b->n; i++) {
+		o = b->items[i].o;
+		if (o->query) {
+			adns_cancel(o->query);
+			_query_done(o);
+		}
+		Py_DECREF(o);
+	}
+	if (self->refreshes) _reap_background(self);
+	PyMem_Free(b->items);
+}
+
+/* The answer to item i of b: None if it was not answered in time. */
+static PyObject *
+_batch_answer(
+	_batch *b,
+	Py_ssize_t i
+	)
+{
+	ADNS_Queryobject *o = b->items[i].o;
+	PyObject *answer;
+	if (o->exc_type) {
+		PyErr_Restore(o->exc_type, o->exc_value, o->exc_traceback);
+		o->exc_type = o->exc_value = o->exc_traceback = NULL;
+		return NULL;
+	}
+	answer = o->answer ? o->answer : Py_None;
+	Py_INCREF(answer);
+	return answer;
+}
+
+static char ADNS_State_synchronous__doc__[] = 
+"s.synchronous(name,type[,flags]\n\
+\n\
+Perform a query on name synchronously for RR type, returning the answer.\n\
+Answers returned as (status, cname, expires, rrs).\n\
+rrs is an n-tuple, each element is a RR. Format varies by\n\
+RR and query.\n"
+;
+
+static PyObject *
+ADNS_State_synchronous(
+	ADNS_Stateobject *self,
+	PyObject *args
+	)
+{
+	char *owner, *key = NULL;
+	size_t keylen = 0;
+	adns_rrtype type = 0;
+	adns_queryflags flags = 0;
+	adns_answer *answer_r;
+	ADNS_Queryobject *q;
+	PyObject *o;
+	if (!PyArg_ParseTuple(args, "si|i", &owner, &type, &flags))
+		return NULL;
+	if ((self->recfile || self->replay || self->cache) &&
+	    !(key = _make_key(_qk_forward, owner, NULL, type, flags, &keylen)))
+		return NULL;
+	if (self->replay) {
+		_replay_rec *rec = _replay_lookup(self->replay, key, keylen);
+		PyMem_Free(key);
+		if (!rec) {
+			PyErr_SetString(self->m->ErrorObject, "no recorded answer");
+			return NULL;
+		}
+		if (!(answer_r = _decode_answer(rec->blob, rec->bloblen))) {
+			PyErr_SetString(self->m->ErrorObject, "corrupt recording");
+			return NULL;
+		}
+		_state_sleep(self, rec->latency / 1e6 * self->replay->timescale);
+		o = interpret_answer(answer_r, self->txtmode);
+		free(answer_r);
+		return o;
+	}
+	if (self->cache && (o = _state_cached(self, key, keylen))) {
+		PyMem_Free(key);
+		return o;
+	}
+	/* Not adns_synchronous(), which would keep the state to itself
+	   until the answer came; other threads may be sharing it. */
+	PyMem_Free(key);
+	if (!(q = newADNS_Queryobject(self))) return NULL;
+	if (_query_setkey(q, _qk_forward, owner, NULL, type, flags) ||
+	    _query_submit(self, q)) {
+		Py_DECREF(q);
+		return NULL;
+	}
+	o = _query_wait(q);
+	Py_DECREF(q);
+	if (self->refreshes) _reap_background(self);
+	return o;
+}
+
+
+static char ADNS_State_resolve_all__doc__[] = 
+"s.resolve_all(names,type[,flags[,timeout]])\n\
+\n\
+Resolve every name in names for RR type at once and return a list of\n\
+their answers in the same order, as s.synchronous() would. The GIL is\n\
+released while waiting. Names not answered within timeout seconds\n\
+(default: no limit) are cancelled and given as None.\n"
+;
+
+static PyObject *
+ADNS_State_resolve_all(
+	ADNS_Stateobject *self,
+	PyObject *args
+	)
+{
+	PyObject *names, *seq, *answer, *l = NULL;
+	adns_rrtype type = 0;
+	adns_queryflags flags = 0;
+	double timeout = 0;
+	_batch b;
+	Py_ssize_t n, i;
+
+	if (!PyArg_ParseTuple(args, "Oi|id", &names, &type, &flags, &timeout))
+		return NULL;
+	if (!(seq = PySequence_Fast(names, "names must be a sequence")))
+		return NULL;
+	memset(&b, 0, sizeof(b));
+	n = PySequence_Fast_GET_SIZE(seq);
+	for (i = 0; i < n; i++) {
+		const char *owner = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(seq, i));
+		if (!owner || _batch_add(self, &b, owner, type, flags) < 0)
+			goto done;
+	}
+	if (_batch_run(self, &b, timeout > 0 ? _now() + timeout : 0,
+		       NULL, NULL))
+		goto done;
+	if (!(l = PyList_New(n))) goto done;
+	for (i = 0; i < n; i++) {
+		if (!(answer = _batch_answer(&b, i))) {
+			Py_CLEAR(l);
+			goto done;
+		}
+		PyList_SET_ITEM(l, i, answer);
+	}
+  done:
+	_batch_free(self, &b);
+	Py_DECREF(seq);
+	return l;
+}
+
+
+static char ADNS_State_resolve_routes__doc__[] = 
+"s.resolve_routes(domains[,flags[,timeout]])\n\
+\n\
+Find the mail routes for every domain in domains. Returns a list with,\n\
+for each domain, (status, routes), where routes is a tuple of\n\
+(prio, host, status, addrs) ordered by priority and addrs a tuple of\n\
+(family, address). MX hosts without glue are looked up concurrently,\n\
+once per call however many domains share them; a domain without MX\n\
+records is its own route. Domains not answered within timeout seconds\n\
+are given as None.\n"
+;
+
+typedef struct {
+	Py_ssize_t ndomains;
+	PyObject *hosts;		/* host -> index of its address query */
+	adns_queryflags flags;
+} _routes;
+
+/* Makes sure host has an address query in b. */
+static int
+_routes_lookup(
+	ADNS_Stateobject *self,
+	_batch *b,
+	_routes *rt,
+	PyObject *host
+	)
+{
+	PyObject *i;
+	Py_ssize_t n;
+	int r;
+
+	if (PyDict_GetItem(rt->hosts, host)) return 0;
+	if ((n = _batch_add(self, b, PyUnicode_AsUTF8(host),
+			    adns_r_addr, rt->flags)) < 0)
+		return -1;
+	if (!(i = PyLong_FromSsize_t(n))) return -1;
+	r = PyDict_SetItem(rt->hosts, host, i);
+	Py_DECREF(i);
+	return r;
+}
+
+static int
+_routes_arrived(
+	ADNS_Stateobject *self,
+	_batch *b,
+	Py_ssize_t i,
+	void *arg
+	)
+{
+	_routes *rt = arg;
+	PyObject *answer = b->items[i].o->answer, *rrs, *ha, *host;
+	Py_ssize_t j;
+	int status, r;
+
+	if (i >= rt->ndomains || !answer) return 0;
+	status = PyLong_AsLong(PyTuple_GET_ITEM(answer, 0));
+	if (status == adns_s_nodata) {
+		/* the domain is its own mail exchanger */
+		if (!(host = PyUnicode_FromString(b->items[i].o->key + _QK_HDR)))
+			return -1;
+		r = _routes_lookup(self, b, rt, host);
+		Py_DECREF(host);
+		return r;
+	}
+	if (status != adns_s_ok) return 0;
+	rrs = PyTuple_GET_ITEM(answer, 3);
+	for (j = 0; j < PyTuple_GET_SIZE(rrs); j++) {
+		ha = PyTuple_GET_ITEM(PyTuple_GET_ITEM(rrs, j), 1);
+		if (PyTuple_GET_ITEM(ha, 2) == Py_None &&
+		    _routes_lookup(self, b, rt, PyTuple_GET_ITEM(ha, 0)))
+			return -1;
+	}
+	return 0;
+}
+
+/* (prio, host, status, addrs) for host, taking the addresses from its
+   own query if the MX answer had none. */
+static PyObject *
+_routes_entry(
+	_batch *b,
+	_routes *rt,
+	long prio,
+	PyObject *host,
+	long status,
+	PyObject *addrs
+	)
+{
+	PyObject *i, *a, *entry;
+
+	if (addrs != Py_None)
+		return Py_BuildValue("lOlO", prio, host, status, addrs);
+	if (!(i = PyDict_GetItem(rt->hosts, host)))
+		a = Py_None, Py_INCREF(a);
+	else if (!(a = _batch_answer(b, PyLong_AsSsize_t(i))))
+		return NULL;
+	if (a == Py_None)
+		entry = Py_BuildValue("lOl()", prio, host, (long) adns_s_timeout);
+	else
+		entry = Py_BuildValue("lOOO", prio, host, PyTuple_GET_ITEM(a, 0),
+				      PyTuple_GET_ITEM(a, 3));
+	Py_DECREF(a);
+	return entry;
+}
+
+/* (status, routes) for domain i. */
+static PyObject *
+_routes_domain(
+	_batch *b,
+	_routes *rt,
+	Py_ssize_t i
+	)
+{
+	PyObject *answer, *rrs, *routes, *mx, *ha, *e, *r = NULL;
+	Py_ssize_t j, k, n;
+	long status;
+
+	if (!(answer = _batch_answer(b, i)) || answer == Py_None)
+		return answer;
+	status = PyLong_AsLong(PyTuple_GET_ITEM(answer, 0));
+	rrs = PyTuple_GET_ITEM(answer, 3);
+	n = status == adns_s_nodata ? 1 : PyTuple_GET_SIZE(rrs);
+	if (!(routes = PyTuple_New(n))) goto done;
+	if (status == adns_s_nodata) {
+		if (!(ha = PyUnicode_FromString(b->items[i].o->key + _QK_HDR)))
+			goto done;
+		e = _routes_entry(b, rt, 0, ha, adns_s_ok, Py_None);
+		Py_DECREF(ha);
+		if (!e) goto done;
+		PyTuple_SET_ITEM(routes, 0, e);
+		status = adns_s_ok;
+	} else for (j = 0; j < n; j++) {
+		mx = PyTuple_GET_ITEM(rrs, j);
+		ha = PyTuple_GET_ITEM(mx, 1);
+		if (!(e = _routes_entry(b, rt,
+					PyLong_AsLong(PyTuple_GET_ITEM(mx, 0)),
+					PyTuple_GET_ITEM(ha, 0),
+					PyLong_AsLong(PyTuple_GET_ITEM(ha, 1)),
+					PyTuple_GET_ITEM(ha, 2))))
+			goto done;
+		/* insertion sort by priority, keeping adns' order of equals */
+		for (k = j; k > 0 &&
+			     PyLong_AsLong(PyTuple_GET_ITEM(
+				PyTuple_GET_ITEM(routes, k - 1), 0)) >
+			     PyLong_AsLong(PyTuple_GET_ITEM(e, 0)); k--)
+			PyTuple_SET_ITEM(routes, k, PyTuple_GET_ITEM(routes, k - 1));
+		PyTuple_SET_ITEM(routes, k, e);
+	}
+	r = Py_BuildValue("lO", status, routes);
+  done:
+	Py_XDECREF(routes);
+	Py_DECREF(answer);
+	return r;
+}
+
+static PyObject *
+ADNS_State_resolve_routes(
+	ADNS_Stateobject *self,
+	PyObject *args
+	)
+{
+	PyObject *domains, *seq, *r, *l = NULL;
+	double timeout = 0;
+	_routes rt;
+	_batch b;
+	Py_ssize_t i;
+
+	rt.flags = 0;
+	if (!PyArg_ParseTuple(args, "O|id", &domains, &rt.flags, &timeout))
+		return NULL;
+	if (!(seq = PySequence_Fast(domains, "domains must be a sequence")))
+		return NULL;
+	if (!(rt.hosts = PyDict_New())) {
+		Py_DECREF(seq);
+		return NULL;
+	}
+	memset(&b, 0, sizeof(b));
+	rt.ndomains = PySequence_Fast_GET_SIZE(seq);
+	for (i = 0; i < rt.ndomains; i++) {
+		const char *owner = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(seq, i));
+		if (!owner || _batch_add(self, &b, owner, adns_r_mx, rt.flags) < 0)
+			goto done;
+	}
+	if (_batch_run(self, &b, timeout > 0 ? _now() + timeout : 0,
+		       _routes_arrived, &rt))
+		goto done;
+	if (!(l = PyList_New(rt.ndomains))) goto done;
+	for (i = 0; i < rt.ndomains; i++) {
+		if (!(r = _routes_domain(&b, &rt, i))) {
+			Py_CLEAR(l);
+			goto done;
+		}
+		PyList_SET_ITEM(l, i, r);
+	}
+  done:
+	_batch_free(self, &b);
+	Py_DECREF(rt.hosts);
+	Py_DECREF(seq);
+	return l;
+}
+
+
+/* s.endpoints() keeps SRV answers digested into targets in priority
+   order, each with its (addr, port) endpoints built, until they
+   expire; each call only has to shuffle them by weight. */
+
+typedef struct {
+	long prio, weight;
+	PyObject *endpoints;
+} _srvtarget;
+
+typedef struct _srvset {
+	_hnode h;
+	struct _srvset *prev, *next;	/* see srv_first */
+	time_t expires;
+	int n;
+	_srvtarget t[1];
+} _srvset;
+
+#define _SRV_MAXSETS 4096
+
+static void
+_srvset_free(_srvset *set)
+{
+	int i;
+	for (i = 0; i < set->n; i++)
+		Py_XDECREF(set->t[i].endpoints);
+	PyMem_Free(set);
+}
+
+static void
+_srvsets_clear(_htab *sets)
+{
+	_hnode *n, *next;
+	size_t i;
+	for (i = 0; i < sets->nbuckets; i++)
+		for (n = sets->buckets[i]; n; n = next) {
+			next = n->next;
+			_srvset_free((_srvset *) n);
+		}
+	_htab_free(sets);
+}
+
+static void
+_srvset_unlink(
+	ADNS_Stateobject *self,
+	_srvset *set
+	)
+{
+	if (set->prev) set->prev->next = set->next;
+	else self->srv_first = set->next;
+	if (set->next) set->next->prev = set->prev;
+	else self->srv_last = set->prev;
+}
+
+static void
+_srvset_link(
+	ADNS_Stateobject *self,
+	_srvset *set
+	)
+{
+	set->prev = NULL;
+	set->next = self->srv_first;
+	if (set->next) set->next->prev = set;
+	else self->srv_last = set;
+	self->srv_first = set;
+}
+
+static void
+_srvset_touch(
+	ADNS_Stateobject *self,
+	_srvset *set
+	)
+{
+	if (self->srv_first == set) return;
+	_srvset_unlink(self, set);
+	_srvset_link(self, set);
+}
+
+static void
+_srvset_drop(
+	ADNS_Stateobject *self,
+	_srvset *set
+	)
+{
+	_htab_remove(&self->srvsets, &set->h);
+	_srvset_unlink(self, set);
+	_srvset_free(set);
+}
+
+/* xorshift64*, good enough for spreading load. */
+static unsigned long
+_random(ADNS_Stateobject *self)
+{
+	unsigned long long x = self->rnd;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	self->rnd = x;
+	return (unsigned long) ((x * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+/* Digests an rr.SRV answer into a new _srvset for key, taking the
+   addresses of targets that came without any from their own queries
+   in b, and keeping the set no longer than those answers. */
+static _srvset *
+_srvset_new(
+	PyObject *answer,
+	const char *key,
+	size_t keylen,
+	_batch *b,
+	_routes *rt
+	)
+{
+	PyObject *rrs = PyTuple_GET_ITEM(answer, 3), *rr, *ha, *addrs, *e;
+	PyObject *idx, *own = NULL;
+	Py_ssize_t i, j, nrrs = PyTuple_GET_SIZE(rrs);
+	_srvset *set;
+	_srvtarget tg;
+	long expires;
+	int k;
+
+	if (!(set = PyMem_Malloc(sizeof(_srvset) + keylen +
+				 nrrs * sizeof(_srvtarget)))) {
+		PyErr_NoMemory();
+		return NULL;
+	}
+	set->n = 0;
+	set->expires = PyLong_AsLong(PyTuple_GET_ITEM(answer, 2));
+	set->h.keylen = keylen;
+	set->h.hash = _hash(key, keylen);
+	set->h.key = (char *) (set->t + (nrrs ? nrrs : 1));
+	memcpy((char *) set->h.key, key, keylen);
+	for (i = 0; i < nrrs; i++) {
+		rr = PyTuple_GET_ITEM(rrs, i);
+		ha = PyTuple_GET_ITEM(rr, 3);
+		addrs = PyTuple_GET_ITEM(ha, 2);
+		Py_CLEAR(own);
+		if (addrs == Py_None &&
+		    (idx = PyDict_GetItem(rt->hosts, PyTuple_GET_ITEM(ha, 0)))) {
+			if (!(own = _batch_answer(b, PyLong_AsSsize_t(idx))))
+				goto error;
+			if (own != Py_None &&
+			    PyLong_AsLong(PyTuple_GET_ITEM(own, 0)) == adns_s_ok) {
+				addrs = PyTuple_GET_ITEM(own, 3);
+				expires = PyLong_AsLong(PyTuple_GET_ITEM(own, 2));
+				if (expires < set->expires) set->expires = expires;
+			}
+		}
+		/* "." means the service is not available there */
+		if (addrs == Py_None || !PyTuple_GET_SIZE(addrs) ||
+		    !strcmp(PyUnicode_AsUTF8(PyTuple_GET_ITEM(ha, 0)), "."))
+			continue;
+		tg.prio = PyLong_AsLong(PyTuple_GET_ITEM(rr, 0));
+		tg.weight = PyLong_AsLong(PyTuple_GET_ITEM(rr, 1));
+		if (!(tg.endpoints = PyTuple_New(PyTuple_GET_SIZE(addrs))))
+			goto error;
+		for (j = 0; j < PyTuple_GET_SIZE(addrs); j++) {
+			if (!(e = Py_BuildValue("OO",
+				PyTuple_GET_ITEM(PyTuple_GET_ITEM(addrs, j), 1),
+				PyTuple_GET_ITEM(rr, 2)))) {
+				Py_DECREF(tg.endpoints);
+				goto error;
+			}
+			PyTuple_SET_ITEM(tg.endpoints, j, e);
+		}
+		for (k = set->n; k > 0 && set->t[k - 1].prio > tg.prio; k--)
+			set->t[k] = set->t[k - 1];
+		set->t[k] = tg;
+		set->n++;
+	}
+	Py_XDECREF(own);
+	return set;
+  error:
+	Py_XDECREF(own);
+	_srvset_free(set);
+	return NULL;
+}
+
+/* Looks up the addresses of SRV targets that came without any, the
+   way resolve_routes() does for MX hosts. */
+static int
+_endpoints_arrived(
+	ADNS_Stateobject *self,
+	_batch *b,
+	Py_ssize_t i,
+	void *arg
+	)
+{
+	_routes *rt = arg;
+	PyObject *answer = b->items[i].o->answer, *rrs, *ha;
+	Py_ssize_t j;
+
+	if (i >= rt->ndomains || !answer ||
+	    PyLong_AsLong(PyTuple_GET_ITEM(answer, 0)) != adns_s_ok)
+		return 0;
+	rrs = PyTuple_GET_ITEM(answer, 3);
+	for (j = 0; j < PyTuple_GET_SIZE(rrs); j++) {
+		ha = PyTuple_GET_ITEM(PyTuple_GET_ITEM(rrs, j), 3);
+		if (PyTuple_GET_ITEM(ha, 2) == Py_None &&
+		    strcmp(PyUnicode_AsUTF8(PyTuple_GET_ITEM(ha, 0)), ".") &&
+		    _routes_lookup(self, b, rt, PyTuple_GET_ITEM(ha, 0)))
+			return -1;
+	}
+	return 0;
+}
+
+/* The endpoints of set in RFC 2782 order: by priority, and by a
+   weighted random draw among targets of equal priority. */
+static PyObject *
+_srvset_order(
+	ADNS_Stateobject *self,
+	_srvset *set
+	)
+{
+	PyObject *l, *eps;
+	int *idx, g, end, i, j, m;
+	unsigned long total, run, r;
+
+	if (!(l = PyList_New(0))) return NULL;
+	if (!(idx = PyMem_Malloc((set->n ? set->n : 1) * sizeof(int)))) {
+		Py_DECREF(l);
+		return PyErr_NoMemory();
+	}
+	for (g = 0; g < set->n; g = end) {
+		for (end = g; end < set->n && set->t[end].prio == set->t[g].prio;
+		     end++)
+			;
+		/* zero weights first, so they have a small chance too */
+		m = 0;
+		for (i = g; i < end; i++)
+			if (!set->t[i].weight) idx[m++] = i;
+		for (i = g; i < end; i++)
+			if (set->t[i].weight) idx[m++] = i;
+		while (m) {
+			for (total = 0, j = 0; j < m; j++)
+				total += set->t[idx[j]].weight;
+			r = total ? _random(self) % (total + 1) : 0;
+			for (run = 0, j = 0; j < m - 1; j++)
+				if ((run += set->t[idx[j]].weight) >= r)
+					break;
+			eps = set->t[idx[j]].endpoints;
+			for (i = 0; i < PyTuple_GET_SIZE(eps); i++)
+				if (PyList_Append(l, PyTuple_GET_ITEM(eps, i))) {
+					PyMem_Free(idx);
+					Py_DECREF(l);
+					return NULL;
+				}
+			memmove(idx + j, idx + j + 1, (m - j - 1) * sizeof(int));
+			m--;
+		}
+	}
+	PyMem_Free(idx);
+	return l;
+}
+
+static char ADNS_State_endpoints__doc__[] = 
+"s.endpoints(service[,flags])\n\
+\n\
+Look up the SRV records of service (e.g. '_ldap._tcp.example.com') and\n\
+return a list of (address, port) to try in turn, ordered as RFC 2782\n\
+says: by priority, and randomly by weight within a priority. Targets\n\
+without addresses in the answer are looked up. The records are kept\n\
+until they expire, and reshuffled on every call.\n"
+;
+
+static PyObject *
+ADNS_State_endpoints(
+	ADNS_Stateobject *self,
+	PyObject *args
+	)
+{
+	char *service, *key;
+	size_t keylen;
+	adns_queryflags flags = 0;
+	_srvset *set;
+	_batch b;
+	_routes rt;
+	PyObject *answer, *r = NULL;
+	int status;
+
+	if (!PyArg_ParseTuple(args, "s|i", &service, &flags))
+		return NULL;
+	if (!(key = _make_key(_qk_forward, service, NULL, adns_r_srv, flags,
+			      &keylen)))
+		return NULL;
+	set = (_srvset *) _htab_find(&self->srvsets, key, keylen,
+				     _hash(key, keylen));
+	if (set && set->expires <= time(NULL)) {
+		_srvset_drop(self, set);
+		set = NULL;
+	}
+	if (set) {
+		PyMem_Free(key);
+		_srvset_touch(self, set);
+		return _srvset_order(self, set);
+	}
+	if (!(rt.hosts = PyDict_New())) {
+		PyMem_Free(key);
+		return NULL;
+	}
+	rt.ndomains = 1;
+	rt.flags = flags;
+	memset(&b, 0, sizeof(b));
+	if (_batch_add(self, &b, service, adns_r_srv, flags) < 0 ||
+	    _batch_run(self, &b, 0, _endpoints_arrived, &rt) ||
+	    !(answer = _batch_answer(&b, 0)))
+		goto done;
+	status = PyLong_AsLong(PyTuple_GET_ITEM(answer, 0));
+	if (status != adns_s_ok)
+		_status_error(self->m, status);
+	else if ((set = _srvset_new(answer, key, keylen, &b, &rt))) {
+		if (self->srvsets.count >= _SRV_MAXSETS)
+			_srvset_drop(self, self->srv_last);
+		if (_htab_insert(&self->srvsets, &set->h)) {
+			r = PyErr_NoMemory();
+			_srvset_free(set);
+		} else {
+			_srvset_link(self, set);
+			r = _srvset_order(self, set);
+		}
+	}
+	Py_DECREF(answer);
+  done:
+	_batch_free(self, &b);
+	Py_DECREF(rt.hosts);
+	PyMem_Free(key);
+	return r;
+}
+
+
+/* s.spf() evaluates SPF policies (RFC 7208).  Evaluation is cheap to
+   redo, so each pass starts from the top, and when it meets a lookup
+   that has not been answered yet, the lookup is added to the batch
+   and the pass abandoned until the batch has run.  Meanwhile every
+   SPF record that arrives has the lookups its terms name added at
+   once, so a whole policy tree is fetched a level at a time rather
+   than one lookup at a time, and most passes never have to wait. */
+
+enum {
+	_spf_ok,			/* no result yet */
+	_spf_none, _spf_neutral, _spf_pass, _spf_fail, _spf_softfail,
+	_spf_temperror, _spf_permerror,
+	_spf_pending			/* waiting for a lookup */
+};
+
+static char *_spf_results[] = {
+	NULL, "none", "neutral", "pass", "fail", "softfail",
+	"temperror", "permerror"
+};
+
+enum {
+	_sm_all, _sm_include, _sm_a, _sm_mx, _sm_ptr, _sm_ip4, _sm_ip6,
+	_sm_exists, _sm_redirect, _sm_modifier
+};
+
+static struct {
+	char *name;
+	int mech;
+	int arg;			/* 0 none, 1 optional, 2 required */
+	int cidr;			/* may take a dual-cidr-length */
+} _spf_mechs[] = {
+	{ "all", _sm_all, 0, 0 },
+	{ "include", _sm_include, 2, 0 },
+	{ "a", _sm_a, 1, 1 },
+	{ "mx", _sm_mx, 1, 1 },
+	{ "ptr", _sm_ptr, 1, 0 },
+	{ "ip4", _sm_ip4, 2, 0 },
+	{ "ip6", _sm_ip6, 2, 0 },
+	{ "exists", _sm_exists, 2, 0 },
+	{ NULL, 0, 0, 0 }
+};
+
+#define _SPF_MAXLOOKUPS 10	/* RFC 7208 4.6.4 */
+#define _SPF_MAXVOID 2
+#define _SPF_MAXMX 10
+#define _SPF_PREFETCH 64	/* lookups added ahead of evaluation */
+
+typedef struct {
+	int qual;			/* result if it matches */
+	int mech;
+	int cidr4, cidr6;
+	int needip;			/* target depends on the address */
+	unsigned char addr[16];		/* of ip4: and ip6: */
+	char target[256];		/* expanded domain-spec */
+} _spfterm;
+
+typedef struct {
+	_batch b;
+	PyObject *lookups;		/* "type name" -> index in b */
+	adns_queryflags flags;
+	int family;			/* of ip, or 0 to flatten */
+	unsigned char ip[16];
+	char ipstr[INET6_ADDRSTRLEN];
+	const char *sender;
+	const char *helo;		/* or NULL */
+	int expired;			/* deadline passed */
+	int nlookups, nvoid;		/* in this pass */
+	PyObject *networks;		/* when flattening */
+} _spf;
+
+/* Finds the lookup of name for type, adding it if need be.  Returns
+   _spf_ok with *rrs_r the RRs of its answer (empty for a void one),
+   _spf_pending, _spf_temperror, _spf_permerror if it makes too many
+   void lookups, or -1 on error. */
+static int
+_spf_fetch(
+	ADNS_Stateobject *self,
+	_spf *sp,
+	adns_rrtype type,
+	const char *name,
+	int countvoid,
+	PyObject **rrs_r
+	)
+{
+	PyObject *key, *i, *answer;
+	Py_ssize_t n;
+	int status;
+
+	if (!(key = PyUnicode_FromFormat("%d %s", (int) type, name)))
+		return -1;
+	if ((i = PyDict_GetItem(sp->lookups, key)))
+		n = PyLong_AsSsize_t(i);
+	else if (sp->expired) {
+		Py_DECREF(key);
+		return _spf_temperror;
+	} else {
+		if ((n = _batch_add(self, &sp->b, name, type, sp->flags)) < 0 ||
+		    !(i = PyLong_FromSsize_t(n))) {
+			Py_DECREF(key);
+			return -1;
+		}
+		status = PyDict_SetItem(sp->lookups, key, i);
+		Py_DECREF(i);
+		if (status) {
+			Py_DECREF(key);
+			return -1;
+		}
+	}
+	Py_DECREF(key);
+	if (sp->b.items[n].waiting)
+		return sp->expired ? _spf_temperror : _spf_pending;
+	if (!(answer = sp->b.items[n].o->answer))
+		return _spf_temperror;
+	status = PyLong_AsLong(PyTuple_GET_ITEM(answer, 0));
+	*rrs_r = PyTuple_GET_ITEM(answer, 3);
+	if (status == adns_s_ok && PyTuple_GET_SIZE(*rrs_r))
+		return _spf_ok;
+	if (status != adns_s_ok && status <= adns_s_max_tempfail)
+		return _spf_temperror;
+	/* NXDOMAIN, or no RRs however it came: a void lookup */
+	if (countvoid && ++sp->nvoid > _SPF_MAXVOID)
+		return _spf_permerror;
+	return _spf_ok;
+}
+
+/* The text of TXT RR rr, whichever s.set_txtmode() it came in. */
+static PyObject *
+_spf_txt(PyObject *rr)
+{
+	PyObject *empty, *s;
+	if (!PyTuple_Check(rr))
+		return PyBytes_FromObject(rr);
+	if (!(empty = PyBytes_FromStringAndSize(NULL, 0))) return NULL;
+	s = PyObject_CallMethod(empty, "join", "(O)", rr);
+	Py_DECREF(empty);
+	return s;
+}
+
+/* Finds the SPF record of domain.  Returns _spf_ok with *text_r a new
+   reference to it, or a result or -1 as _spf_fetch(). */
+static int
+_spf_record(
+	ADNS_Stateobject *self,
+	_spf *sp,
+	const char *domain,
+	PyObject **text_r
+	)
+{
+	PyObject *rrs, *s;
+	Py_ssize_t i;
+	int r;
+
+	if ((r = _spf_fetch(self, sp, adns_r_txt, domain, 0, &rrs)))
+		return r;
+	*text_r = NULL;
+	for (i = 0; i < PyTuple_GET_SIZE(rrs); i++) {
+		if (!(s = _spf_txt(PyTuple_GET_ITEM(rrs, i)))) {
+			Py_XDECREF(*text_r);
+			return -1;
+		}
+		if (PyBytes_GET_SIZE(s) < 6 ||
+		    strncasecmp(PyBytes_AS_STRING(s), "v=spf1", 6) ||
+		    (PyBytes_AS_STRING(s)[6] && PyBytes_AS_STRING(s)[6] != ' ')) {
+			Py_DECREF(s);
+			continue;
+		}
+		if (*text_r) {
+			Py_DECREF(s);
+			Py_DECREF(*text_r);
+			return _spf_permerror;
+		}
+		*text_r = s;
+	}
+	return *text_r ? _spf_ok : _spf_none;
+}
+
+/* Writes the value of macro letter c to v (of 320 bytes).  Returns 0,
+   1 if it depends on the address and there is none, or -1. */
+static int
+_spf_macro(
+	_spf *sp,
+	const char *domain,
+	int c,
+	char *v
+	)
+{
+	const char *at = strrchr(sp->sender, '@');
+	int i;
+
+	switch (c) {
+	case 's':
+		snprintf(v, 320, "%s", sp->sender);
+		return 0;
+	case 'l':
+		if (!at || at == sp->sender) strcpy(v, "postmaster");
+		else snprintf(v, 320, "%.*s", (int) (at - sp->sender), sp->sender);
+		return 0;
+	case 'o':
+		snprintf(v, 320, "%s", at ? at + 1 : sp->sender);
+		return 0;
+	case 'h':
+		snprintf(v, 320, "%s", sp->helo ? sp->helo : "unknown");
+		return 0;
+	case 'd':
+		snprintf(v, 320, "%s", domain);
+		return 0;
+	case 'r':
+		strcpy(v, "unknown");
+		return 0;
+	case 't':
+		sprintf(v, "%lu", (unsigned long) time(NULL));
+		return 0;
+	case 'i':
+	case 'c':
+	case 'p':
+	case 'v':
+		if (!sp->family) return 1;
+		if (c == 'p') strcpy(v, "unknown");
+		else if (c == 'v')
+			strcpy(v, sp->family == AF_INET ? "in-addr" : "ip6");
+		else if (c == 'c' || sp->family == AF_INET)
+			strcpy(v, sp->ipstr);
+		else for (i = 0; i < 32; i++) {
+			/* dotted nibbles */
+			v[2 * i] = "0123456789abcdef"[(sp->ip[i / 2] >> (i % 2 ? 0 : 4)) & 15];
+			v[2 * i + 1] = i < 31 ? '.' : 0;
+		}
+		return 0;
+	}
+	return -1;
+}
+
+/* Expands the macros in domain-spec s[0:n] (RFC 7208 7) into out, of
+   256 bytes, dropping labels from the left if it is too long.
+   Returns 0, 1 if it needs the address and there is none, or -1 if
+   it is malformed. */
+static int
+_spf_expand(
+	_spf *sp,
+	const char *domain,
+	const char *s,
+	size_t n,
+	char *out
+	)
+{
+	char buf[1024], v[320], *parts[160], *p;
+	const char *e = s + n, *delims;
+	size_t len = 0, dlen;
+	int c, digits, reverse, nparts, i, r;
+
+	while (s < e) {
+		if (*s != '%') {
+			if (len < sizeof(buf) - 1) buf[len++] = *s;
+			s++;
+			continue;
+		}
+		if (++s == e) return -1;
+		switch (c = *s++) {
+		case '%':
+		case '_':
+		case '-':
+			p = c == '%' ? "%" : c == '_' ? " " : "%20";
+			for (; *p && len < sizeof(buf) - 1; p++)
+				buf[len++] = *p;
+			continue;
+		case '{':
+			break;
+		default:
+			return -1;
+		}
+		if (s == e) return -1;
+		if ((r = _spf_macro(sp, domain, tolower((unsigned char) *s++), v)))
+			return r;
+		for (digits = 0; s < e && isdigit((unsigned char) *s); s++)
+			if (digits < 1000) digits = digits * 10 + (*s - '0');
+		if ((reverse = s < e && (*s == 'r' || *s == 'R'))) s++;
+		for (delims = s; s < e && strchr(".-+,/_=", *s); s++) ;
+		if (s == e || *s++ != '}') return -1;
+		if (!(dlen = s - 1 - delims)) {
+			delims = ".";
+			dlen = 1;
+		}
+		/* split, reverse and keep the rightmost digits parts */
+		nparts = 0;
+		for (p = v; nparts < 160; p++) {
+			parts[nparts++] = p;
+			while (*p && !memchr(delims, *p, dlen))
+				p++;
+			if (!*p) break;
+			*p = 0;
+		}
+		if (reverse)
+			for (i = 0; i < nparts / 2; i++) {
+				p = parts[i];
+				parts[i] = parts[nparts - 1 - i];
+				parts[nparts - 1 - i] = p;
+			}
+		for (i = digits && digits < nparts ? nparts - digits : 0;
+		     i < nparts; i++) {
+			for (p = parts[i]; *p && len < sizeof(buf) - 1; p++)
+				buf[len++] = *p;
+			if (i < nparts - 1 && len < sizeof(buf) - 1)
+				buf[len++] = '.';
+		}
+	}
+	if (len && buf[len - 1] == '.') len--;
+	buf[len] = 0;
+	for (p = buf; strlen(p) > 253 && strchr(p, '.'); p = strchr(p, '.') + 1) ;
+	snprintf(out, 256, "%s", p);
+	return 0;
+}
+
+/* Reads "/n" or "//n" prefix lengths from s[0:n] into t. */
+static int
+_spf_cidrs(
+	const char *s,
+	size_t n,
+	_spfterm *t
+	)
+{
+	const char *e = s + n;
+	int six, v;
+
+	while (s < e) {
+		if (*s++ != '/') return -1;
+		if ((six = s < e && *s == '/')) s++;
+		if (s == e || !isdigit((unsigned char) *s)) return -1;
+		for (v = 0; s < e && isdigit((unsigned char) *s); s++)
+			if ((v = v * 10 + (*s - '0')) > 128) return -1;
+		if (six)
+			t->cidr6 = v;
+		else if (t->cidr6 != 128 || v > 32)
+			return -1;
+		else
+			t->cidr4 = v;
+	}
+	return 0;
+}
+
+/* Parses the next term of record text at *p into t.  Returns 1, 0 at
+   the end, or -1 on a syntax error. */
+static int
+_spf_term(
+	_spf *sp,
+	const char *domain,
+	const char **p,
+	_spfterm *t
+	)
+{
+	const char *s = *p, *e, *name, *arg, *slash;
+	size_t n;
+	int i, r, qualified = 1;
+
+	while (*s == ' ') s++;
+	if (!*s) return 0;
+	for (e = s; *e && *e != ' '; e++) ;
+	*p = e;
+	memset(t, 0, sizeof(*t));
+	t->cidr4 = 32;
+	t->cidr6 = 128;
+	switch (*s) {
+	case '-': t->qual = _spf_fail; s++; break;
+	case '~': t->qual = _spf_softfail; s++; break;
+	case '?': t->qual = _spf_neutral; s++; break;
+	case '+': t->qual = _spf_pass; s++; break;
+	default: t->qual = _spf_pass; qualified = 0;
+	}
+	for (name = s; s < e && (isalnum((unsigned char) *s) || *s == '-' ||
+				 *s == '_' || *s == '.'); s++) ;
+	n = s - name;
+	if (!n) return -1;
+	if (s < e && *s == '=') {
+		if (qualified) return -1;
+		if (n == 8 && !strncasecmp(name, "redirect", 8)) {
+			t->mech = _sm_redirect;
+			r = _spf_expand(sp, domain, s + 1, e - s - 1, t->target);
+			if (r < 0) return -1;
+			t->needip = r;
+		} else
+			t->mech = _sm_modifier;
+		return 1;
+	}
+	for (i = 0; _spf_mechs[i].name; i++)
+		if (strlen(_spf_mechs[i].name) == n &&
+		    !strncasecmp(_spf_mechs[i].name, name, n))
+			break;
+	if (!_spf_mechs[i].name) return -1;
+	t->mech = _spf_mechs[i].mech;
+	if (s < e && *s == ':') {
+		if (!_spf_mechs[i].arg) return -1;
+		arg = ++s;
+	} else if (_spf_mechs[i].arg == 2)
+		return -1;
+	else
+		arg = NULL;
+	slash = s;
+	if (t->mech == _sm_ip4 || t->mech == _sm_ip6 || _spf_mechs[i].cidr)
+		for (; slash < e && *slash != '/'; slash++) ;
+	else
+		slash = e;
+	if (!arg && slash != s) return -1;
+	if (t->mech == _sm_ip4 || t->mech == _sm_ip6) {
+		char addr[INET6_ADDRSTRLEN];
+		int max = t->mech == _sm_ip4 ? 32 : 128, v = max;
+		if (slash - arg >= (int) sizeof(addr)) return -1;
+		memcpy(addr, arg, slash - arg);
+		addr[slash - arg] = 0;
+		if (slash < e) {
+			/* a single prefix length */
+			if (++slash == e) return -1;
+			for (v = 0; slash < e; slash++)
+				if (!isdigit((unsigned char) *slash) ||
+				    (v = v * 10 + (*slash - '0')) > max)
+					return -1;
+		}
+		if (inet_pton(t->mech == _sm_ip4 ? AF_INET : AF_INET6, addr,
+			      t->addr) != 1)
+			return -1;
+		if (t->mech == _sm_ip4) t->cidr4 = v;
+		else t->cidr6 = v;
+		return 1;
+	}
+	if (slash < e && _spf_cidrs(slash, e - slash, t)) return -1;
+	if (!arg) {
+		snprintf(t->target, sizeof(t->target), "%s", domain);
+		return 1;
+	}
+	if ((r = _spf_expand(sp, domain, arg, slash - arg, t->target)) < 0)
+		return -1;
+	t->needip = r;
+	return 1;
+}
+
+/* Whether the first bits of a and b agree. */
+static int
+_spf_prefix(
+	const unsigned char *a,
+	const unsigned char *b,
+	int bits
+	)
+{
+	int n = bits / 8;
+	if (memcmp(a, b, n)) return 0;
+	return !(bits % 8) || !((a[n] ^ b[n]) & (0xff00 >> (bits % 8)) & 0xff);
+}
+
+/* Matches address addr of family against the client, or, when
+   flattening, adds its network to sp->networks. */
+static int
+_spf_addr(
+	_spf *sp,
+	int family,
+	const unsigned char *addr,
+	int cidr4,
+	int cidr6
+	)
+{
+	unsigned char net[16];
+	char buf[INET6_ADDRSTRLEN + 4];
+	int bits = family == AF_INET ? cidr4 : cidr6, i;
+	PyObject *s;
+
+	if (sp->family)
+		return family == sp->family && _spf_prefix(addr, sp->ip, bits);
+	memset(net, 0, sizeof(net));
+	memcpy(net, addr, family == AF_INET ? 4 : 16);
+	for (i = bits; i < 128; i++)
+		net[i / 8] &= ~(0x80 >> (i % 8));
+	inet_ntop(family, net, buf, INET6_ADDRSTRLEN);
+	sprintf(buf + strlen(buf), "/%d", bits);
+	if (!(s = PyUnicode_FromString(buf))) return -1;
+	i = PyDict_SetItem(sp->networks, s, Py_None);
+	Py_DECREF(s);
+	return i;
+}
+
+/* Matches the (family, address) RRs of an rr.ADDR answer. */
+static int
+_spf_addrs(
+	_spf *sp,
+	PyObject *rrs,
+	_spfterm *t
+	)
+{
+	unsigned char addr[16];
+	PyObject *rr;
+	Py_ssize_t i;
+	int family, r;
+
+	for (i = 0; i < PyTuple_GET_SIZE(rrs); i++) {
+		rr = PyTuple_GET_ITEM(rrs, i);
+		family = PyLong_AsLong(PyTuple_GET_ITEM(rr, 0));
+		if (inet_pton(family, PyUnicode_AsUTF8(PyTuple_GET_ITEM(rr, 1)),
+			      addr) != 1)
+			continue;
+		if ((r = _spf_addr(sp, family, addr, t->cidr4, t->cidr6)))
+			return r;
+	}
+	return 0;
+}
+
+/* The name whose PTR records name the client. */
+static void
+_spf_revname(
+	_spf *sp,
+	char *name
+	)
+{
+	int i;
+	if (sp->family == AF_INET) {
+		sprintf(name, "%d.%d.%d.%d.in-addr.arpa",
+			sp->ip[3], sp->ip[2], sp->ip[1], sp->ip[0]);
+		return;
+	}
+	for (i = 31; i >= 0; i--) {
+		*name++ = "0123456789abcdef"[(sp->ip[i / 2] >> (i % 2 ? 0 : 4)) & 15];
+		*name++ = '.';
+	}
+	strcpy(name, "ip6.arpa");
+}
+
+static int _spf_check(ADNS_Stateobject *, _spf *, const char *);
+
+/* Whether term t matches: 0 or 1, a result that ends the evaluation
+   (_spf_temperror, _spf_permerror, _spf_pending), or -1 on error. */
+static int
+_spf_match(
+	ADNS_Stateobject *self,
+	_spf *sp,
+	_spfterm *t
+	)
+{
+	PyObject *rrs, *ha;
+	char name[80];
+	const char *host;
+	size_t hlen, tlen;
+	Py_ssize_t i;
+	int r, pending = 0;
+
+	switch (t->mech) {
+	case _sm_all:
+		return 1;
+	case _sm_ip4:
+		return _spf_addr(sp, AF_INET, t->addr, t->cidr4, 128);
+	case _sm_ip6:
+		return _spf_addr(sp, AF_INET6, t->addr, 32, t->cidr6);
+	case _sm_include:
+		switch (r = _spf_check(self, sp, t->target)) {
+		case _spf_pass: return 1;
+		case _spf_fail:
+		case _spf_softfail:
+		case _spf_neutral: return 0;
+		case _spf_none: return _spf_permerror;
+		}
+		return r;
+	case _sm_a:
+		if ((r = _spf_fetch(self, sp, adns_r_addr, t->target, 1, &rrs)))
+			return r;
+		return _spf_addrs(sp, rrs, t);
+	case _sm_exists:
+		if ((r = _spf_fetch(self, sp, adns_r_a, t->target, 1, &rrs)))
+			return r;
+		return PyTuple_GET_SIZE(rrs) > 0;
+	case _sm_mx:
+		if ((r = _spf_fetch(self, sp, adns_r_mx, t->target, 1, &rrs)))
+			return r;
+		if (PyTuple_GET_SIZE(rrs) > _SPF_MAXMX)
+			return _spf_permerror;
+		for (i = 0; i < PyTuple_GET_SIZE(rrs); i++) {
+			PyObject *addrs;
+			ha = PyTuple_GET_ITEM(PyTuple_GET_ITEM(rrs, i), 1);
+			addrs = PyTuple_GET_ITEM(ha, 2);
+			if (addrs == Py_None) {
+				/* no glue: look the host up */
+				r = _spf_fetch(self, sp, adns_r_addr,
+					       PyUnicode_AsUTF8(PyTuple_GET_ITEM(ha, 0)),
+					       0, &addrs);
+				if (r == _spf_pending) {
+					pending = 1;
+					continue;
+				}
+				if (r == _spf_temperror) continue;
+				if (r) return r;
+			}
+			if ((r = _spf_addrs(sp, addrs, t)))
+				return r;
+		}
+		return pending ? _spf_pending : 0;
+	case _sm_ptr:
+		/* adns only returns names that map back to the address */
+		_spf_revname(sp, name);
+		r = _spf_fetch(self, sp, adns_r_ptr, name, 1, &rrs);
+		if (r == _spf_temperror) return 0;
+		if (r) return r;
+		tlen = strlen(t->target);
+		for (i = 0; i < PyTuple_GET_SIZE(rrs); i++) {
+			host = PyUnicode_AsUTF8(PyTuple_GET_ITEM(rrs, i));
+			hlen = strlen(host);
+			if (hlen >= tlen && !strcasecmp(host + hlen - tlen, t->target) &&
+			    (hlen == tlen || host[hlen - tlen - 1] == '.'))
+				return 1;
+		}
+		return 0;
+	}
+	return 0;
+}
+
+/* Evaluates the policy of domain for the client (RFC 7208 4), or,
+   when flattening, collects the networks its + mechanisms match and
+   returns _spf_neutral. */
+static int
+_spf_check(
+	ADNS_Stateobject *self,
+	_spf *sp,
+	const char *domain
+	)
+{
+	PyObject *text;
+	const char *p;
+	char redirect[256];
+	_spfterm t;
+	int r, all = 0, redirects = 0;
+
+	if ((r = _spf_record(self, sp, domain, &text)))
+		return r;
+	/* a record with a syntax error anywhere fails as a whole */
+	redirect[0] = 0;
+	p = PyBytes_AS_STRING(text) + 6;
+	while ((r = _spf_term(sp, domain, &p, &t)) > 0) {
+		if (t.mech == _sm_all) all = 1;
+		if (t.mech != _sm_redirect) continue;
+		if (redirects++) break;
+		/* when flattening, a redirect= to %{i} leads nowhere */
+		strcpy(redirect, t.needip ? "" : t.target);
+	}
+	if (r) {
+		Py_DECREF(text);
+		return _spf_permerror;
+	}
+	p = PyBytes_AS_STRING(text) + 6;
+	while ((r = _spf_term(sp, domain, &p, &t)) > 0) {
+		if (t.mech == _sm_redirect || t.mech == _sm_modifier)
+			continue;
+		if (t.mech != _sm_all && t.mech != _sm_ip4 && t.mech != _sm_ip6 &&
+		    ++sp->nlookups > _SPF_MAXLOOKUPS) {
+			r = _spf_permerror;
+			break;
+		}
+		if (!sp->family) {
+			/* only + mechanisms add networks, and only those
+			   that do not depend on the client */
+			if (t.mech == _sm_all) {
+				unsigned char any[16];
+				memset(any, 0, sizeof(any));
+				r = t.qual == _spf_pass &&
+				    (_spf_addr(sp, AF_INET, any, 0, 0) ||
+				     _spf_addr(sp, AF_INET6, any, 0, 0)) ? -1 : 0;
+				break;
+			}
+			if (t.qual != _spf_pass || t.needip ||
+			    t.mech == _sm_ptr || t.mech == _sm_exists)
+				continue;
+		}
+		if ((r = _spf_match(self, sp, &t)) == 1) {
+			r = t.qual;
+			break;
+		}
+		if (r) break;
+	}
+	Py_DECREF(text);
+	if (r)
+		return r;
+	if (all || !redirect[0])
+		return _spf_neutral;
+	if (++sp->nlookups > _SPF_MAXLOOKUPS)
+		return _spf_permerror;
+	r = _spf_check(self, sp, redirect);
+	return r == _spf_none ? _spf_permerror : r;
+}
+
+/* Adds the lookups of each SPF record as it arrives, and of the
+   hosts of MX answers without glue. */
+static int
+_spf_arrived(
+	ADNS_Stateobject *self,
+	_batch *b,
+	Py_ssize_t i,
+	void *arg
+	)
+{
+	_spf *sp = arg;
+	ADNS_Queryobject *o = b->items[i].o;
+	const char *domain = o->key + _QK_HDR, *p;
+	PyObject *text, *rrs, *ha, *ignored;
+	_spfterm t;
+	Py_ssize_t j;
+	int r = 0;
+
+	if (!o->answer || sp->b.n >= _SPF_PREFETCH) return 0;
+	rrs = PyTuple_GET_ITEM(o->answer, 3);
+	if (_key_type(o->key) == adns_r_mx) {
+		for (j = 0; j < PyTuple_GET_SIZE(rrs) && j < _SPF_MAXMX; j++) {
+			ha = PyTuple_GET_ITEM(PyTuple_GET_ITEM(rrs, j), 1);
+			if (PyTuple_GET_ITEM(ha, 2) == Py_None &&
+			    _spf_fetch(self, sp, adns_r_addr,
+				       PyUnicode_AsUTF8(PyTuple_GET_ITEM(ha, 0)),
+				       0, &ignored) < 0)
+				return -1;
+		}
+		return 0;
+	}
+	if (_key_type(o->key) != adns_r_txt) return 0;
+	if ((r = _spf_record(self, sp, domain, &text)))
+		return r < 0 ? -1 : 0;
+	p = PyBytes_AS_STRING(text) + 6;
+	while (sp->b.n < _SPF_PREFETCH && _spf_term(sp, domain, &p, &t) > 0) {
+		if (t.needip) continue;
+		r = 0;
+		switch (t.mech) {
+		case _sm_include:
+		case _sm_redirect:
+			r = _spf_fetch(self, sp, adns_r_txt, t.target, 0, &ignored);
+			break;
+		case _sm_a:
+			r = _spf_fetch(self, sp, adns_r_addr, t.target, 0, &ignored);
+			break;
+		case _sm_mx:
+			r = _spf_fetch(self, sp, adns_r_mx, t.target, 0, &ignored);
+			break;
+		case _sm_exists:
+			if (sp->family)
+				r = _spf_fetch(self, sp, adns_r_a, t.target, 0, &ignored);
+			break;
+		}
+		if (r < 0) break;
+	}
+	Py_DECREF(text);
+	return r < 0 ? -1 : 0;
+}
+
+static char ADNS_State_spf__doc__[] =
+"s.spf(domain[,ip[,sender[,timeout[,helo]]]])\n\
+\n\
+Evaluate the SPF policy of domain (RFC 7208) for a client at address\n\
+ip, returning 'pass', 'fail', 'softfail', 'neutral', 'none',\n\
+'temperror' or 'permerror'. sender is the envelope sender (default\n\
+postmaster@domain) and helo the HELO identity that %{h} expands to\n\
+(default 'unknown'). Without ip, returns a sorted list of the networks\n\
+('192.0.2.0/24') that the policy's + mechanisms allow, leaving out\n\
+those that depend on the client; a policy that cannot be evaluated\n\
+raises PermanentError or RemoteTempError. The records and addresses\n\
+are fetched concurrently, at most 10 lookups per evaluation, of which\n\
+at most 2 may find nothing; with adns.init(cache=n) they are also kept\n\
+for later calls. Lookups not answered within timeout seconds\n\
+(default: no limit) give temperror.\n"
+;
+
+static PyObject *
+ADNS_State_spf(
+	ADNS_Stateobject *self,
+	PyObject *args
+	)
+{
+	const char *domain, *ip = NULL, *sender = NULL, *helo = NULL;
+	double timeout = 0, deadline;
+	PyObject *s = NULL, *l = NULL;
+	_spf sp;
+	int r;
+
+	if (!PyArg_ParseTuple(args, "s|zzdz", &domain, &ip, &sender, &timeout,
+			      &helo))
+		return NULL;
+	memset(&sp, 0, sizeof(sp));
+	if (ip) {
+		sp.family = strchr(ip, ':') ? AF_INET6 : AF_INET;
+		if (inet_pton(sp.family, ip, sp.ip) != 1) {
+			PyErr_SetString(self->m->ErrorObject, "invalid IP address");
+			return NULL;
+		}
+		inet_ntop(sp.family, sp.ip, sp.ipstr, sizeof(sp.ipstr));
+	}
+	if (!sender) {
+		if (!(s = PyUnicode_FromFormat("postmaster@%s", domain)))
+			return NULL;
+		sender = PyUnicode_AsUTF8(s);
+	}
+	sp.sender = sender;
+	sp.helo = helo;
+	if (!(sp.lookups = PyDict_New()) ||
+	    (!ip && !(sp.networks = PyDict_New())))
+		goto done;
+	deadline = timeout > 0 ? _now() + timeout : 0;
+	for (;;) {
+		sp.nlookups = sp.nvoid = 0;
+		if (sp.networks) PyDict_Clear(sp.networks);
+		if ((r = _spf_check(self, &sp, domain)) != _spf_pending)
+			break;
+		if (_batch_run(self, &sp.b, deadline, _spf_arrived, &sp)) {
+			r = -1;
+			break;
+		}
+		if (deadline && _now() >= deadline) sp.expired = 1;
+	}
+	if (r < 0)
+		;
+	else if (ip)
+		l = PyUnicode_FromString(_spf_results[r]);
+	else if (r == _spf_temperror || r == _spf_none || r == _spf_permerror)
+		PyErr_SetString(r == _spf_temperror ? self->m->RemoteTempError
+				: self->m->PermanentError, _spf_results[r]);
+	else if ((l = PyDict_Keys(sp.networks)) && PyList_Sort(l))
+		Py_CLEAR(l);
+  done:
+	_batch_free(self, &sp.b);
+	Py_XDECREF(sp.lookups);
+	Py_XDECREF(sp.networks);
+	Py_XDECREF(s);
+	return l;
+}
+
+/* Parses the (name, type[, flags[, priority]]) arguments of
+   s.submit() and s.submit_reverse() straight from the vector they are
+   called with. */
+static int
+_submit_args(
+	const char *fname,
+	PyObject *const *args,
+	Py_ssize_t nargs,
+	const char **owner,
+	adns_rrtype *type,
+	adns_queryflags *flags,
+	int *bulk
+	)
+{
+	Py_ssize_t len;
+	long v;
+
+	if (nargs < 2 || nargs > 4) {
+		PyErr_Format(PyExc_TypeError,
+			     "%s() takes 2 to 4 arguments (%zd given)",
+			     fname, nargs);
+		return -1;
+	}
+	if (!(*owner = PyUnicode_AsUTF8AndSize(args[0], &len)))
+		return -1;
+	if (strlen(*owner) != (size_t) len) {
+		PyErr_SetString(PyExc_ValueError, "embedded null character");
+		return -1;
+	}
+	if ((v = PyLong_AsLong(args[1])) == -1 && PyErr_Occurred())
+		return -1;
+	*type = (adns_rrtype) v;
+	*flags = 0;
+	if (nargs > 2) {
+		if ((v = PyLong_AsLong(args[2])) == -1 && PyErr_Occurred())
+			return -1;
+		*flags = (adns_queryflags) v;
+	}
+	*bulk = 0;
+	if (nargs > 3) {
+		if ((v = PyLong_AsLong(args[3])) == -1 && PyErr_Occurred())
+			return -1;
+		if (v != _prio_interactive && v != _prio_bulk) {
+			PyErr_SetString(PyExc_ValueError, "unknown priority");
+			return -1;
+		}
+		*bulk = v == _prio_bulk;
+	}
+	return 0;
+}
+
+static char ADNS_State_submit__doc__[] = 
+"s.submit(name,type[,flags[,priority]])\n\
+\n\
+Submit a query. Returns a ADNS_Query object. priority is\n\
+adns.priority.interactive (the default) or adns.priority.bulk, see\n\
+s.set_ratelimit().\n"
+;
+
+static PyObject *
+ADNS_State_submit(
+	ADNS_Stateobject *self,
+	PyObject *const *args,
+	Py_ssize_t nargs
+	)
+{
+	const char *owner;
+	adns_rrtype type;
+	adns_queryflags flags;
+	int bulk;
+	ADNS_Queryobject *o;
+	if (_submit_args("submit", args, nargs, &owner, &type, &flags, &bulk))
+		return NULL;
+	if (!(o = newADNS_Queryobject(self))) return NULL;
+	o->bulk = bulk;
+	if (_query_setkey(o, _qk_forward, owner, NULL, type, flags))
+		goto error;
+	switch (_query_local(self, o)) {
+	case -1: goto error;
+	case 0:
+		if (_query_submit(self, o)) goto error;
+	}
+	_live_add(o);
+	return (PyObject *) o;
+  error:
+	Py_DECREF(o);
+	return NULL;
+}
+
+
+static char ADNS_State_submit_reverse__doc__[] = 
+"s.submit_reverse(name,type[,flags[,priority]])\n\
+\n\
+Submit a query. Returns a ADNS_Query object.\n\
+flags must specify some kind of PTR query."
+;
+
+
+static PyObject *
+ADNS_State_submit_reverse(
+	ADNS_Stateobject *self,
+	PyObject *const *args,
+	Py_ssize_t nargs
+	)
+{
+	const char *owner;
+	struct in_addr addr;
+	adns_rrtype type;
+	adns_queryflags flags;
+	int r, bulk;
+	ADNS_Queryobject *o;
+	if (_submit_args("submit_reverse", args, nargs, &owner, &type, &flags,
+			 &bulk))
+		return NULL;
+        r = inet_aton(owner, &addr);
+        if (!r) {
+                PyErr_SetString(self->m->ErrorObject, "invalid IP address");
+                return NULL;
+        }
+	if (!(o = newADNS_Queryobject(self))) return NULL;
+	o->bulk = bulk;
+	if (_query_setkey(o, _qk_reverse, owner, NULL, type, flags))
+		goto error;
+	switch (_query_local(self, o)) {
+	case -1: goto error;
+	case 0:
+		if (_query_submit(self, o)) goto error;
+	}
+	_live_add(o);
+	return (PyObject *) o;
+  error:
+	Py_DECREF(o);
+	return NULL;
+}
+
+static char ADNS_State_submit_reverse_any__doc__[] = 
+"s.submit_reverse_any(name,zone,type[,flags[,priority]])\n\
+\n\
+Submit a query. Returns a ADNS_Query object.\n\
+zone is in-addr.arpa., etc.\n\
+flags must specify some kind of PTR query."
+;
+
+
+static PyObject *
+ADNS_State_submit_reverse_any(
+	ADNS_Stateobject *self,
+	PyObject *args
+	)
+{
+	char *owner, *zone;
+	struct in_addr addr;
+	adns_rrtype type = 0;
+	adns_queryflags flags = 0;
+	int r, priority = _prio_interactive;
+	ADNS_Queryobject *o;
+	if (!PyArg_ParseTuple(args, "ssi|ii", &owner, &zone, &type, &flags,
+			      &priority))
+		return NULL;
+	if (priority != _prio_interactive && priority != _prio_bulk) {
+		PyErr_SetString(PyExc_ValueError, "unknown priority");
+		return NULL;
+	}
+        r = inet_aton(owner, &addr);
+        if (!r) {
+                PyErr_SetString(self->m->ErrorObject, "invalid IP address");
+                return NULL;
+        }
+	if (!(o = newADNS_Queryobject(self))) return NULL;
+	o->bulk = priority == _prio_bulk;
+	if (_query_setkey(o, _qk_reverse_any, owner, zone, type, flags))
+		goto error;
+	switch (_query_local(self, o)) {
+	case -1: goto error;
+	case 0:
+		if (_query_submit(self, o)) goto error;
+	}
+	_live_add(o);
+	return (PyObject *) o;
+  error:
+	Py_DECREF(o);
+	return NULL;
+}
+
+
+static char ADNS_State_submit_addr__doc__[] = 
+"s.submit_addr(name[,flags[,grace[,prefer]]])\n\
+\n\
+Submit A and AAAA queries for name at once. Returns a ADNS_Query object\n\
+whose answer looks like that of an rr.ADDR query. It is ready as soon as\n\
+the preferred family (socket.AF_INET6 by default) has addresses, or\n\
+grace seconds (default 0.05) after the other family had.\n"
+;
+
+static PyObject *
+ADNS_State_submit_addr(
+	ADNS_Stateobject *self,
+	PyObject *args
+	)
+{
+	char *owner;
+	adns_queryflags flags = 0;
+	double grace = 0.05;
+	int prefer = AF_INET6, i;
+	ADNS_Queryobject *o, *k;
+	if (!PyArg_ParseTuple(args, "s|idi", &owner, &flags, &grace, &prefer))
+		return NULL;
+	if (prefer != AF_INET && prefer != AF_INET6) {
+		PyErr_SetString(PyExc_ValueError,
+				"prefer must be AF_INET or AF_INET6");
+		return NULL;
+	}
+	if (!(o = newADNS_Queryobject(self))) return NULL;
+	o->grace = grace;
+	_qlist_push(&self->racing, o);
+	for (i = 0; i < 2; i++) {
+		if (!(k = o->kids[i] = newADNS_Queryobject(self)))
+			goto error;
+		k->parent = o;
+		if (_query_setkey(k, _qk_forward, owner, NULL,
+				  (prefer == AF_INET) == (i == 0) ?
+				  adns_r_a : adns_r_aaaa, flags))
+			goto error;
+		switch (_query_local(self, k)) {
+		case -1: goto error;
+		case 1: continue;
+		}
+		if (_query_submit(self, k)) goto error;
+	}
+	_live_add(o);
+	_race_update(o, _now());
+	return (PyObject *) o;
+  error:
+	Py_DECREF(o);
+	return NULL;
+}
+
+
+static char ADNS_State_submit_partial__doc__[] = 
+"s.submit_partial(name,type[,flags[,callback]])\n\
+\n\
+Submit an adns.rr.MX, NS or SRV query whose answer is filled in as it\n\
+arrives rather than all at once: first the records, with each host as\n\
+(host, None, None), then the addresses of each host as soon as they\n\
+are in. q.partial() returns what is known so far, callback(q, rr) is\n\
+called with each RR once its host has its addresses, and q.check() and\n\
+s.completed() treat q as ready once all have.\n"
+;
+
+static PyObject *
+ADNS_State_submit_partial(
+	ADNS_Stateobject *self,
+	PyObject *args
+	)
+{
+	char *owner;
+	int type;
+	adns_rrtype raw;
+	adns_queryflags flags = 0;
+	PyObject *callback = Py_None;
+	ADNS_Queryobject *o, *k;
+	if (!PyArg_ParseTuple(args, "si|iO", &owner, &type, &flags, &callback))
+		return NULL;
+	raw = type & ~adns__qtf_deref;
+	if (!(type & adns__qtf_deref) || (raw != adns_r_mx_raw &&
+	    raw != adns_r_ns_raw && raw != adns_r_srv_raw)) {
+		PyErr_SetString(PyExc_ValueError,
+				"type must be rr.MX, rr.NS or rr.SRV");
+		return NULL;
+	}
+	if (callback != Py_None && !PyCallable_Check(callback)) {
+		PyErr_SetString(PyExc_TypeError, "callback must be callable");
+		return NULL;
+	}
+	if (!(o = newADNS_Queryobject(self))) return NULL;
+	if (!(o->parts = PyList_New(0))) goto error;
+	if (callback != Py_None) {
+		Py_INCREF(callback);
+		o->callback = callback;
+	}
+	_qlist_push(&self->racing, o);
+	if (!(k = newADNS_Queryobject(self))) goto error;
+	k->parent = o;
+	if (PyList_Append(o->parts, (PyObject *) k)) {
+		Py_DECREF(k);
+		goto error;
+	}
+	Py_DECREF(k);
+	if (_query_setkey(k, _qk_forward, owner, NULL, raw, flags))
+		goto error;
+	switch (_query_local(self, k)) {
+	case -1: goto error;
+	case 0:
+		if (_query_submit(self, k)) goto error;
+	}
+	_live_add(o);
+	_race_update(o, _now());
+	return (PyObject *) o;
+  error:
+	Py_DECREF(o);
+	return NULL;
 }
 
 
 static char ADNS_State_allqueries__doc__[] = 
 "s.allqueries()\n\
 \n\
-Returns a list of all pending queries.\n"
+Returns a list of all pending queries.\n"
+;
+
+
+static PyObject *
+ADNS_State_allqueries(
+	ADNS_Stateobject *self,
+	PyObject *unused
+	)
+{
+	ADNS_Queryobject *o;
+	PyObject *l;
+
+	if (!(l = PyList_New(0))) return NULL;
+	for (o = self->live_first; o; o = o->live_next) {
+		if (!o->list && !o->query) continue;
+		if (PyList_Append(l, (PyObject *) o)) {
+			Py_DECREF(l);
+			return NULL;
+		}
+	}
+	return l;
+}
+
+
+
+static char ADNS_State_cancel_all__doc__[] = 
+"s.cancel_all()\n\
+\n\
+Cancel every pending query, as q.cancel() would.\n"
+;
+
+static PyObject *
+ADNS_State_cancel_all(
+	ADNS_Stateobject *self,
+	PyObject *unused
+	)
+{
+	_cancel_all(self);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+static char ADNS_State_select__doc__[] = 
+"s.select(timeout=0)\n\
+\n\
+Like the select() system call, except it works only on\n\
+pending queries, i.e. internally it does:\n\
+1) adns_beforeselect\n\
+2) select\n\
+3) adns_afterselect\n"
+;
+
+
+static int
+_state_select(
+	ADNS_Stateobject *self,
+	double ft
+	)
+{
+	int r;
+
+	Py_BEGIN_ALLOW_THREADS;
+	r = _state_io(self, ft);
+	Py_END_ALLOW_THREADS;
+	if (r) {
+		PyErr_SetFromErrno(self->m->ErrorObject);
+		return -1;
+	}
+	return 0;
+}
+
+/* Sends hedges that are due, and shortens timeout ft so as not to
+   sleep past what the state has to do itself: deliver ready answers,
+   decide races, send queued queries and hedges. */
+static double
+_state_timeout(
+	ADNS_Stateobject *self,
+	double ft
+	)
+{
+	ADNS_Queryobject *o;
+	double now = _now(), hedge = _hedge_due(self);
+	if (self->hedge_p && hedge < ft)
+		ft = hedge;
+	for (o = self->ready.head; o; o = o->next)
+		if (o->due - now < ft)
+			ft = o->due > now ? o->due - now : 0;
+	for (o = self->racing.head; o; o = o->next)
+		ft = _race_timeout(o, now, ft);
+	if ((self->queue.head || self->bulk.head) &&
+	    _throttle_delay(self) < ft)
+		ft = _throttle_delay(self);
+	return ft;
+}
+
+static PyObject *
+ADNS_State_select(
+	ADNS_Stateobject *self,
+	PyObject *args
+	)
+{
+	double ft = 0;
+
+	if (!PyArg_ParseTuple(args, "|d", &ft))
+		return NULL;
+	if (_state_select(self, ft)) return NULL;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+static char ADNS_State_completed__doc__[] = 
+"s.completed(timeout=0)\n\
+\n\
+Returns a list of all completed queries.\n"
+;
+
+
+static PyObject *
+ADNS_State_completed(
+	ADNS_Stateobject *self,
+	PyObject *const *args,
+	Py_ssize_t nargs
+	)
+{
+	double ft = 0, now;
+	ADNS_Queryobject *o, *next;
+	PyObject *l;
+	int r;
+
+	if (nargs > 1) {
+		PyErr_Format(PyExc_TypeError,
+			     "completed() takes at most 1 argument (%zd given)",
+			     nargs);
+		return NULL;
+	}
+	if (nargs && (ft = PyFloat_AsDouble(args[0])) == -1 && PyErr_Occurred())
+		return NULL;
+	_pump(self);
+	_race_all(self, _now());
+	if (_state_select(self, _state_timeout(self, ft))) return NULL;
+	_collect(self);
+	_pump(self);
+	if (!(l = PyList_New(0))) return NULL;
+	now = _now();
+	_race_all(self, now);
+	for (o = self->ready.head; o; o = next) {
+		next = o->next;
+		if (o->due > now || o->parent || o->batched) continue;
+		_qlist_unlink(o);
+		r = PyList_Append(l, (PyObject *) o);
+		_live_drop(o);
+		if (r) {
+			Py_DECREF(l);
+			return NULL;
+		}
+	}
+	return l;
+}
+
+
+static char ADNS_State_record__doc__[] = 
+"s.record(filename)\n\
+\n\
+Append every answer this state receives to the recording in filename\n\
+(created if needed), for later use with s.replay(). s.record(None)\n\
+stops recording, raising an exception if any write failed.\n"
+;
+
+static PyObject *
+ADNS_State_record(
+	ADNS_Stateobject *self,
+	PyObject *args
+	)
+{
+	char *filename;
+	FILE *f;
+	int failed;
+
+	if (!PyArg_ParseTuple(args, "z", &filename))
+		return NULL;
+	if (self->recfile) {
+		failed = ferror(self->recfile);
+		if (fclose(self->recfile)) failed = 1;
+		self->recfile = NULL;
+		if (failed) {
+			PyErr_SetString(self->m->ErrorObject, "error writing recording");
+			return NULL;
+		}
+	}
+	if (filename) {
+		if (!(f = fopen(filename, "ab")))
+			return PyErr_SetFromErrnoWithFilename(self->m->ErrorObject, filename);
+		if (fseek(f, 0, SEEK_END) == 0 && ftell(f) == 0)
+			fwrite(_REC_MAGIC, 1, strlen(_REC_MAGIC), f);
+		self->recfile = f;
+	}
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+static char ADNS_State_replay__doc__[] = 
+"s.replay(filename[,timescale=0.0])\n\
+\n\
+Answer all further queries from a recording made by s.record()\n\
+instead of the network. Each answer is delivered after its recorded\n\
+latency multiplied by timescale: 1.0 keeps the original timing, 0.0\n\
+answers immediately. Repeated queries cycle through the recorded\n\
+answers; queries that were never recorded raise adns.Error.\n\
+s.replay(None) goes back to using the network.\n"
+;
+
+static PyObject *
+ADNS_State_replay(
+	ADNS_Stateobject *self,
+	PyObject *args
+	)
+{
+	char *filename;
+	double timescale = 0.0;
+	struct _replay *rp = NULL;
+
+	if (!PyArg_ParseTuple(args, "z|d", &filename, &timescale))
+		return NULL;
+	if (filename && !(rp = _replay_open(self->m, filename, timescale)))
+		return NULL;
+	_replay_free(self->replay);
+	self->replay = rp;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+static char ADNS_State_dump_cache__doc__[] = 
+"s.dump_cache(filename)\n\
+\n\
+Write the unexpired cache entries to a snapshot file, which\n\
+adns.init(snapshot=filename) can load to start with a warm cache.\n"
+;
+
+static PyObject *
+ADNS_State_dump_cache(
+	ADNS_Stateobject *self,
+	PyObject *args
+	)
+{
+	char *filename;
+
+	if (!PyArg_ParseTuple(args, "s", &filename))
+		return NULL;
+	if (!self->cache) {
+		PyErr_SetString(self->m->ErrorObject, "caching is not enabled");
+		return NULL;
+	}
+	if (_cache_dump(self->m, self->cache, filename)) return NULL;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+static char ADNS_State_set_refresh__doc__[] = 
+"s.set_refresh(hits[,fraction=0.1])\n\
+\n\
+Refresh cached answers ahead of expiry: once an entry has been used\n\
+at least hits times and less than fraction of its TTL remains, the\n\
+next use submits a background query for it while still returning\n\
+the cached answer. hits=0 turns refreshing off.\n"
+;
+
+static PyObject *
+ADNS_State_set_refresh(
+	ADNS_Stateobject *self,
+	PyObject *args
+	)
+{
+	int hits;
+	double fraction = 0.1;
+
+	if (!PyArg_ParseTuple(args, "i|d", &hits, &fraction))
+		return NULL;
+	if (hits < 0 || fraction < 0 || fraction > 1) {
+		PyErr_SetString(PyExc_ValueError, "invalid refresh policy");
+		return NULL;
+	}
+	self->refresh_hits = hits;
+	self->refresh_fraction = fraction;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+static char ADNS_State_set_serve_stale__doc__[] = 
+"s.set_serve_stale(maxstale)\n\
+\n\
+Keep cache entries for up to maxstale seconds past their expiry, and\n\
+answer with them when the upstream times out or fails (the\n\
+RemoteFailureError and RemoteTempError statuses). Such answers keep\n\
+their original, past, expiry time and q.stale is true for them.\n\
+maxstale=0 turns this off.\n"
+;
+
+static PyObject *
+ADNS_State_set_serve_stale(
+	ADNS_Stateobject *self,
+	PyObject *args
+	)
+{
+	int maxstale;
+
+	if (!PyArg_ParseTuple(args, "i", &maxstale))
+		return NULL;
+	if (maxstale < 0) {
+		PyErr_SetString(PyExc_ValueError, "maxstale must not be negative");
+		return NULL;
+	}
+	if (!self->cache) {
+		PyErr_SetString(self->m->ErrorObject, "caching is not enabled");
+		return NULL;
+	}
+	self->cache->maxstale = maxstale;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+static char ADNS_State_set_ratelimit__doc__[] = 
+"s.set_ratelimit(qps[,burst[,maxinflight[,reserve]]])\n\
+\n\
+Limit the queries sent upstream to qps per second on average and burst\n\
+at once (default: qps, at least 1), and to maxinflight outstanding at\n\
+any time. Submissions over the limits wait in a FIFO and are sent as\n\
+s.completed() or q.wait() make room; cached answers are not limited.\n\
+A limit of 0 turns it off. Queries submitted with adns.priority.bulk\n\
+wait in a FIFO of their own, which is only served when the other is\n\
+empty, and never take the last reserve of the maxinflight slots.\n"
+;
+
+static PyObject *
+ADNS_State_set_ratelimit(
+	ADNS_Stateobject *self,
+	PyObject *args
+	)
+{
+	double qps, burst = 0;
+	int maxinflight = 0, reserve = 0;
+
+	if (!PyArg_ParseTuple(args, "d|dii", &qps, &burst, &maxinflight,
+			      &reserve))
+		return NULL;
+	if (qps < 0 || burst < 0 || maxinflight < 0 || reserve < 0) {
+		PyErr_SetString(PyExc_ValueError, "limits must not be negative");
+		return NULL;
+	}
+	if (!burst) burst = qps < 1 ? 1 : qps;
+	self->rl_qps = qps;
+	self->rl_burst = burst;
+	self->rl_tokens = burst;
+	self->rl_stamp = _now();
+	self->rl_maxinflight = maxinflight;
+	/* bulk queries get one slot at least */
+	if (maxinflight && reserve >= maxinflight) reserve = maxinflight - 1;
+	self->rl_reserve = reserve;
+	_pump(self);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+static char ADNS_State_set_limits__doc__[] = 
+"s.set_limits(maxpending[,maxbytes[,policy[,timeout]]])\n\
+\n\
+Bound the memory the state uses: at most maxpending queries outstanding\n\
+(in adns or waiting for s.set_ratelimit()), and no new ones while the\n\
+answers that queries hold take maxbytes or more (see s.stats()\n\
+answer_bytes; a query holds its answer until it is deallocated). A\n\
+submission over maxpending raises adns.LimitError if policy is\n\
+adns.limit.reject (the default), waits up to timeout seconds (default\n\
+5) for room if it is adns.limit.block, and if it is adns.limit.shed,\n\
+cancels the oldest outstanding query, whose check() then raises\n\
+LimitError. One over maxbytes always raises LimitError. Cached\n\
+answers and s.resolve_all() are not limited. A limit of 0 turns it\n\
+off.\n"
+;
+
+static PyObject *
+ADNS_State_set_limits(
+	ADNS_Stateobject *self,
+	PyObject *args
+	)
+{
+	int maxpending, policy = _lim_reject;
+	Py_ssize_t maxbytes = 0;
+	double timeout = 5.0;
+
+	if (!PyArg_ParseTuple(args, "i|nid", &maxpending, &maxbytes, &policy,
+			      &timeout))
+		return NULL;
+	if (maxpending < 0 || maxbytes < 0 || timeout < 0) {
+		PyErr_SetString(PyExc_ValueError, "limits must not be negative");
+		return NULL;
+	}
+	if (policy != _lim_reject && policy != _lim_block &&
+	    policy != _lim_shed) {
+		PyErr_SetString(PyExc_ValueError, "unknown limit policy");
+		return NULL;
+	}
+	self->lim_pending = maxpending;
+	self->lim_bytes = maxbytes;
+	self->lim_policy = policy;
+	self->lim_wait = timeout;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+static char ADNS_State_set_tcp__doc__[] = 
+"s.set_tcp(types[,idle=0])\n\
+\n\
+Send queries for the RR types in types (e.g. (adns.rr.TXT,)) over TCP\n\
+from the start, as if with adns.qflags.usevc, rather than have them\n\
+truncated over UDP first. adns keeps a single TCP connection to its\n\
+nameserver and sends the queries down it back to back; it closes it\n\
+after 30 seconds without any. With idle, a type whose answers came\n\
+over TCP anyway is sent over TCP too, until idle seconds pass without\n\
+a query of that type. s.stats() counts tcp_queries and tcp_fallbacks,\n\
+the answers too large for UDP that were asked for over it.\n"
+;
+
+static PyObject *
+ADNS_State_set_tcp(
+	ADNS_Stateobject *self,
+	PyObject *args
+	)
+{
+	PyObject *types, *seq;
+	double idle = 0;
+	Py_ssize_t i, n;
+	long t;
+
+	if (!PyArg_ParseTuple(args, "O|d", &types, &idle))
+		return NULL;
+	if (idle < 0) {
+		PyErr_SetString(PyExc_ValueError, "idle must not be negative");
+		return NULL;
+	}
+	if (!(seq = PySequence_Fast(types, "types must be a sequence")))
+		return NULL;
+	n = PySequence_Fast_GET_SIZE(seq);
+	if (n > _TCP_TYPES) {
+		PyErr_Format(PyExc_ValueError, "at most %d types", _TCP_TYPES);
+		Py_DECREF(seq);
+		return NULL;
+	}
+	self->ntcp = 0;
+	for (i = 0; i < n; i++) {
+		t = PyLong_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+		if (t == -1 && PyErr_Occurred()) {
+			self->ntcp = 0;
+			Py_DECREF(seq);
+			return NULL;
+		}
+		if (_tcp_find(self, (adns_rrtype) t) >= 0) continue;
+		self->tcp[self->ntcp].type = (adns_rrtype) t;
+		self->tcp[self->ntcp++].until = -1;
+	}
+	Py_DECREF(seq);
+	self->tcp_idle = idle;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+static char ADNS_State_set_hedge__doc__[] = 
+"s.set_hedge(p[,mindelay=0.005])\n\
+\n\
+Submit a second copy of any query that has taken longer than fraction\n\
+p (e.g. 0.95) of recent answers, but at least mindelay seconds, and\n\
+use whichever copy answers first. This cuts the delay caused by a lost\n\
+packet from adns' retry interval to about the p percentile. Second\n\
+copies count against s.set_ratelimit() like other queries, and wait\n\
+for room rather than queueing. A p of 0 turns it off. s.stats() counts\n\
+hedges and hedge_wins.\n"
+;
+
+static PyObject *
+ADNS_State_set_hedge(
+	ADNS_Stateobject *self,
+	PyObject *args
+	)
+{
+	double p, mindelay = 0.005;
+
+	if (!PyArg_ParseTuple(args, "d|d", &p, &mindelay))
+		return NULL;
+	if (p < 0 || p >= 1) {
+		PyErr_SetString(PyExc_ValueError, "p must be between 0 and 1");
+		return NULL;
+	}
+	self->hedge_p = p;
+	self->hedge_min = mindelay;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+static char ADNS_State_set_txtmode__doc__[] = 
+"s.set_txtmode(mode)\n\
+\n\
+Choose how TXT RRs are returned: adns.txtmode.tuple (the default) gives\n\
+a tuple of the character-strings, joined a single bytes of them all,\n\
+and buffer a read-only memoryview of the joined text; the memoryviews\n\
+of an answer share one bytes object.\n"
+;
+
+static PyObject *
+ADNS_State_set_txtmode(
+	ADNS_Stateobject *self,
+	PyObject *args
+	)
+{
+	int mode;
+	_centry *e;
+
+	if (!PyArg_ParseTuple(args, "i", &mode))
+		return NULL;
+	if (mode != _txt_tuple && mode != _txt_joined && mode != _txt_buffer) {
+		PyErr_SetString(PyExc_ValueError, "unknown TXT mode");
+		return NULL;
+	}
+	self->txtmode = mode;
+	if (self->cache && self->cache->txtmode != mode) {
+		/* cached answers are interpreted again as they are used */
+		self->cache->txtmode = mode;
+		for (e = self->cache->head; e; e = e->next)
+			Py_CLEAR(e->answer);
+	}
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+static char ADNS_State_stats__doc__[] = 
+"s.stats()\n\
+\n\
+Returns a dictionary of counters describing this state.\n"
+;
+
+static PyObject *
+ADNS_State_stats(
+	ADNS_Stateobject *self,
+	PyObject *unused
+	)
+{
+	PyObject *d;
+	struct _cache *c = self->cache;
+
+	if (!(d = PyDict_New())) return NULL;
+	if (_dict_setnum(d, "cache_entries", c ? c->index.count : 0) ||
+	    _dict_setnum(d, "cache_hits", c ? c->hits : 0) ||
+	    _dict_setnum(d, "cache_misses", c ? c->misses : 0) ||
+	    _dict_setnum(d, "cache_refreshes", self->refreshes) ||
+	    _dict_setnum(d, "cache_stale", c ? c->stale : 0) ||
+	    _dict_setnum(d, "shared_hits", c && c->shm ? c->shm->hits : 0) ||
+	    _dict_setnum(d, "shared_stores", c && c->shm ? c->shm->stores : 0) ||
+	    _dict_setnum(d, "inflight", self->inflight) ||
+	    _dict_setnum(d, "queued", self->queue.count + self->bulk.count) ||
+	    _dict_setnum(d, "queued_bulk", self->bulk.count) ||
+	    _dict_setnum(d, "throttled", self->throttled) ||
+	    _dict_setnum(d, "answer_bytes", self->answer_bytes) ||
+	    _dict_setnum(d, "limit_rejected", self->lim_rejected) ||
+	    _dict_setnum(d, "limit_shed", self->lim_shed) ||
+	    _dict_setnum(d, "tcp_queries", self->tcp_queries) ||
+	    _dict_setnum(d, "tcp_fallbacks", self->tcp_fallbacks) ||
+	    _dict_setnum(d, "answers", self->answers) ||
+	    _dict_setnum(d, "failures", self->failures) ||
+	    _dict_setnum(d, "failure_rate", self->failrate) ||
+	    _dict_setnum(d, "rtt", self->rtt) ||
+	    _dict_setnum(d, "rtt_p95", _latency_percentile(self, 0.95)) ||
+	    _dict_setnum(d, "hedges", self->hedges) ||
+	    _dict_setnum(d, "hedge_wins", self->hedge_wins)) {
+		Py_DECREF(d);
+		return NULL;
+	}
+	return d;
+}
+
+
+static char ADNS_State_latency__doc__[] = 
+"s.latency(p)\n\
+\n\
+Returns the time in seconds within which fraction p (0 to 1) of recent\n\
+answers from upstream arrived, or 0 if there have been none yet.\n"
+;
+
+static PyObject *
+ADNS_State_latency(
+	ADNS_Stateobject *self,
+	PyObject *args
+	)
+{
+	double p;
+
+	if (!PyArg_ParseTuple(args, "d", &p))
+		return NULL;
+	return PyFloat_FromDouble(_latency_percentile(self, p));
+}
+
+
+static char ADNS_State_globalsystemfailure__doc__[] = 
+""
+;
+
+static PyObject *
+ADNS_State_globalsystemfailure(
+	ADNS_Stateobject *self,
+	PyObject *unused
+	)
+{
+	adns_globalsystemfailure(self->state);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+_LOCKED(ADNS_State_synchronous, ADNS_Stateobject, &self->lock)
+_LOCKED(ADNS_State_resolve_all, ADNS_Stateobject, &self->lock)
+_LOCKED(ADNS_State_resolve_routes, ADNS_Stateobject, &self->lock)
+_LOCKED(ADNS_State_endpoints, ADNS_Stateobject, &self->lock)
+_LOCKED(ADNS_State_spf, ADNS_Stateobject, &self->lock)
+_LOCKED_FAST(ADNS_State_submit, ADNS_Stateobject, &self->lock)
+_LOCKED_FAST(ADNS_State_submit_reverse, ADNS_Stateobject, &self->lock)
+_LOCKED(ADNS_State_submit_reverse_any, ADNS_Stateobject, &self->lock)
+_LOCKED(ADNS_State_submit_addr, ADNS_Stateobject, &self->lock)
+_LOCKED(ADNS_State_submit_partial, ADNS_Stateobject, &self->lock)
+_LOCKED(ADNS_State_allqueries, ADNS_Stateobject, &self->lock)
+_LOCKED(ADNS_State_cancel_all, ADNS_Stateobject, &self->lock)
+_LOCKED_FAST(ADNS_State_completed, ADNS_Stateobject, &self->lock)
+_LOCKED(ADNS_State_select, ADNS_Stateobject, &self->lock)
+_LOCKED(ADNS_State_globalsystemfailure, ADNS_Stateobject, &self->lock)
+_LOCKED(ADNS_State_record, ADNS_Stateobject, &self->lock)
+_LOCKED(ADNS_State_replay, ADNS_Stateobject, &self->lock)
+_LOCKED(ADNS_State_dump_cache, ADNS_Stateobject, &self->lock)
+_LOCKED(ADNS_State_set_refresh, ADNS_Stateobject, &self->lock)
+_LOCKED(ADNS_State_set_serve_stale, ADNS_Stateobject, &self->lock)
+_LOCKED(ADNS_State_set_ratelimit, ADNS_Stateobject, &self->lock)
+_LOCKED(ADNS_State_set_limits, ADNS_Stateobject, &self->lock)
+_LOCKED(ADNS_State_set_tcp, ADNS_Stateobject, &self->lock)
+_LOCKED(ADNS_State_latency, ADNS_Stateobject, &self->lock)
+_LOCKED(ADNS_State_set_hedge, ADNS_Stateobject, &self->lock)
+_LOCKED(ADNS_State_set_txtmode, ADNS_Stateobject, &self->lock)
+_LOCKED(ADNS_State_stats, ADNS_Stateobject, &self->lock)
+
+static struct PyMethodDef ADNS_State_methods[] = {
+	{"synchronous",	(PyCFunction)ADNS_State_synchronous_locked,	METH_VARARGS,	ADNS_State_synchronous__doc__},
+ {"resolve_all",	(PyCFunction)ADNS_State_resolve_all_locked,	METH_VARARGS,	ADNS_State_resolve_all__doc__},
+ {"resolve_routes",	(PyCFunction)ADNS_State_resolve_routes_locked,	METH_VARARGS,	ADNS_State_resolve_routes__doc__},
+ {"endpoints",	(PyCFunction)ADNS_State_endpoints_locked,	METH_VARARGS,	ADNS_State_endpoints__doc__},
+ {"spf",	(PyCFunction)ADNS_State_spf_locked,	METH_VARARGS,	ADNS_State_spf__doc__},
+ {"submit",	(PyCFunction)(void(*)(void))ADNS_State_submit_locked,	METH_FASTCALL,	ADNS_State_submit__doc__},
+ {"submit_reverse",	(PyCFunction)(void(*)(void))ADNS_State_submit_reverse_locked,	METH_FASTCALL,	ADNS_State_submit_reverse__doc__},
+ {"submit_reverse_any",	(PyCFunction)ADNS_State_submit_reverse_any_locked,	METH_VARARGS,	ADNS_State_submit_reverse_any__doc__},
+ {"submit_addr",	(PyCFunction)ADNS_State_submit_addr_locked,	METH_VARARGS,	ADNS_State_submit_addr__doc__},
+ {"submit_partial",	(PyCFunction)ADNS_State_submit_partial_locked,	METH_VARARGS,	ADNS_State_submit_partial__doc__},
+ {"allqueries",	(PyCFunction)ADNS_State_allqueries_locked,	METH_NOARGS,	ADNS_State_allqueries__doc__},
+ {"cancel_all",	(PyCFunction)ADNS_State_cancel_all_locked,	METH_NOARGS,	ADNS_State_cancel_all__doc__},
+ {"completed",	(PyCFunction)(void(*)(void))ADNS_State_completed_locked,	METH_FASTCALL,	ADNS_State_completed__doc__},
+ {"select",	(PyCFunction)ADNS_State_select_locked,	METH_VARARGS,	ADNS_State_select__doc__},
+ {"globalsystemfailure",	(PyCFunction)ADNS_State_globalsystemfailure_locked,	METH_NOARGS,	ADNS_State_globalsystemfailure__doc__},
+ {"record",	(PyCFunction)ADNS_State_record_locked,	METH_VARARGS,	ADNS_State_record__doc__},
+ {"replay",	(PyCFunction)ADNS_State_replay_locked,	METH_VARARGS,	ADNS_State_replay__doc__},
+ {"dump_cache",	(PyCFunction)ADNS_State_dump_cache_locked,	METH_VARARGS,	ADNS_State_dump_cache__doc__},
+ {"set_refresh",	(PyCFunction)ADNS_State_set_refresh_locked,	METH_VARARGS,	ADNS_State_set_refresh__doc__},
+ {"set_serve_stale",	(PyCFunction)ADNS_State_set_serve_stale_locked,	METH_VARARGS,	ADNS_State_set_serve_stale__doc__},
+ {"set_ratelimit",	(PyCFunction)ADNS_State_set_ratelimit_locked,	METH_VARARGS,	ADNS_State_set_ratelimit__doc__},
+ {"set_limits",	(PyCFunction)ADNS_State_set_limits_locked,	METH_VARARGS,	ADNS_State_set_limits__doc__},
+ {"set_tcp",	(PyCFunction)ADNS_State_set_tcp_locked,	METH_VARARGS,	ADNS_State_set_tcp__doc__},
+ {"latency",	(PyCFunction)ADNS_State_latency_locked,	METH_VARARGS,	ADNS_State_latency__doc__},
+ {"set_hedge",	(PyCFunction)ADNS_State_set_hedge_locked,	METH_VARARGS,	ADNS_State_set_hedge__doc__},
+ {"set_txtmode",	(PyCFunction)ADNS_State_set_txtmode_locked,	METH_VARARGS,	ADNS_State_set_txtmode__doc__},
+ {"stats",	(PyCFunction)ADNS_State_stats_locked,	METH_NOARGS,	ADNS_State_stats__doc__},
+ 
+	{NULL,		NULL}		/* sentinel */
+};
+
+/* ---------- */
+
+
+static ADNS_Stateobject *
+newADNS_Stateobject(adnsstate *m)
+{
+	ADNS_Stateobject *self;
+	
+	self = PyObject_GC_New(ADNS_Stateobject, m->ADNS_Statetype);
+	if (self == NULL)
+		return NULL;
+	self->m = m;
+	self->state = NULL;
+	self->diagfile = NULL;
+	self->recfile = NULL;
+	self->replay = NULL;
+	self->cache = NULL;
+	self->refresh_hits = 0;
+	self->refresh_fraction = 0;
+	self->refreshes = 0;
+	memset(&self->ready, 0, sizeof(self->ready));
+	memset(&self->queue, 0, sizeof(self->queue));
+	memset(&self->bulk, 0, sizeof(self->bulk));
+	memset(&self->racing, 0, sizeof(self->racing));
+	memset(&self->srvsets, 0, sizeof(self->srvsets));
+	self->srv_first = self->srv_last = NULL;
+	self->rtt = self->failrate = 0;
+	self->answers = self->failures = 0;
+	memset(self->lat_hist, 0, sizeof(self->lat_hist));
+	self->lat_count = 0;
+	self->hedge_p = self->hedge_min = 0;
+	self->txtmode = _txt_tuple;
+	self->hedges = self->hedge_wins = 0;
+	self->rnd = ((unsigned long long) time(NULL) << 32 ^ getpid() ^
+		     (unsigned long) self) | 1;
+	self->rl_qps = self->rl_burst = self->rl_tokens = self->rl_stamp = 0;
+	self->rl_maxinflight = 0;
+	self->rl_reserve = 0;
+	self->inflight = 0;
+	self->throttled = 0;
+	self->sent_first = self->sent_last = NULL;
+	self->live_first = self->live_last = NULL;
+	self->answer_bytes = self->lim_bytes = 0;
+	self->lim_pending = 0;
+	self->lim_policy = _lim_reject;
+	self->lim_wait = 0;
+	self->lim_rejected = self->lim_shed = 0;
+	self->ntcp = 0;
+	self->tcp_idle = 0;
+	self->tcp_queries = self->tcp_fallbacks = 0;
+	self->polling = 0;
+	self->wake[0] = self->wake[1] = -1;
+	_lock_init(&self->lock);
+	pthread_cond_init(&self->polled, NULL);
+	if (pipe(self->wake) ||
+	    fcntl(self->wake[0], F_SETFL, O_NONBLOCK) ||
+	    fcntl(self->wake[1], F_SETFL, O_NONBLOCK) ||
+	    fcntl(self->wake[0], F_SETFD, FD_CLOEXEC) ||
+	    fcntl(self->wake[1], F_SETFD, FD_CLOEXEC)) {
+		PyErr_SetFromErrno(m->ErrorObject);
+		Py_DECREF(self);
+		return NULL;
+	}
+	PyObject_GC_Track(self);
+	return self;
+}
+
+
+/* The registry holds references to queries, and they to the state,
+   so the two are collected together, the state breaking the cycle by
+   cancelling its queries. */
+static int
+ADNS_State_traverse(
+	ADNS_Stateobject *self,
+	visitproc visit,
+	void *arg
+	)
+{
+	ADNS_Queryobject *o;
+	Py_VISIT(Py_TYPE(self));
+	for (o = self->live_first; o; o = o->live_next)
+		Py_VISIT(o);
+	return 0;
+}
+
+static int
+ADNS_State_clear(ADNS_Stateobject *self)
+{
+	_cancel_all(self);
+	return 0;
+}
+
+static void
+ADNS_State_dealloc(ADNS_Stateobject *self)
+{
+	PyTypeObject *tp = Py_TYPE(self);
+
+	PyObject_GC_UnTrack(self);
+	if (self->state) {
+		ADNS_Queryobject *o, *next;
+		/* only background queries are left, see _live_add() */
+		for (o = self->sent_first; o; o = next) {
+			next = o->sent_next;
+			if (!o->background) continue;
+			adns_cancel(o->query);
+			_query_done(o);
+			Py_DECREF(o);
+		}
+		Py_BEGIN_ALLOW_THREADS;
+		adns_finish(self->state);
+		Py_END_ALLOW_THREADS;
+	}
+	if (self->diagfile) fclose(self->diagfile);
+	if (self->recfile) fclose(self->recfile);
+	_replay_free(self->replay);
+	_cache_free(self->cache);
+	_srvsets_clear(&self->srvsets);
+	if (self->wake[0] != -1) close(self->wake[0]);
+	if (self->wake[1] != -1) close(self->wake[1]);
+	pthread_cond_destroy(&self->polled);
+	pthread_mutex_destroy(&self->lock.mutex);
+	PyObject_GC_Del(self);
+	Py_DECREF(tp);
+}
+
+static char ADNS_Statetype__doc__[] = 
+"Contains state information for adns session."
+;
+
+static PyType_Slot ADNS_Statetype_slots[] = {
+	{Py_tp_dealloc, ADNS_State_dealloc},
+	{Py_tp_traverse, ADNS_State_traverse},
+	{Py_tp_clear, ADNS_State_clear},
+	{Py_tp_methods, ADNS_State_methods},
+	{Py_tp_doc, ADNS_Statetype__doc__},
+	{0, NULL}
+};
+
+static PyType_Spec ADNS_Statetype_spec = {
+	"adns.ADNS_State",
+	sizeof(ADNS_Stateobject),
+	0,
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION |
+		Py_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_HAVE_GC,
+	ADNS_Statetype_slots
+};
+
+/* End of code for ADNS_State objects */
+/* -------------------------------------------------------- */
+
+
+static char ADNS_Query_check__doc__[] = 
+"answer = q.check()\n\
+\n\
+Check for an answer. Return value same as for\n\
+s.synchronous.\n"
+;
+
+static PyObject *
+_query_result(ADNS_Queryobject *self)
+{
+	adns_answer *answer_r;
+	int r;
+
+	if (_queued(self)) _pump(self->s);
+	if (self->list == &self->s->racing) {
+		_pump(self->s);
+		_collect(self->s);
+		_race_update(self, _now());
+	}
+	if (_queued(self) || self->list == &self->s->racing ||
+	    (self->list == &self->s->ready && self->due > _now())) {
+		PyErr_SetString(self->s->m->NotReadyError, strerror(EWOULDBLOCK));
+		return NULL;
+	}
+	_qlist_unlink(self);
+	if (self->exc_type) {
+		PyErr_Restore(self->exc_type, self->exc_value, self->exc_traceback);
+		self->exc_type = self->exc_value = self->exc_traceback = NULL;
+		return NULL;
+	}
+	if (self->answer) goto ret_answer;
+	if (!(self->query)) {
+		PyErr_SetString(self->s->m->ErrorObject, "query invalidated");
+		return NULL;
+	}
+	r = _query_check(self, &answer_r);
+	if (r) {
+		if (r == EWOULDBLOCK)
+			PyErr_SetString(self->s->m->NotReadyError, strerror(r));
+		else {
+			PyErr_SetString(self->s->m->ErrorObject, strerror(r));
+			_query_done(self);
+		}
+		return NULL;
+	}
+	if (_query_answered(self, answer_r)) return NULL;
+  ret_answer:
+	Py_INCREF(self->answer);
+	return self->answer;
+}
+
+static PyObject *
+ADNS_Query_check(
+	ADNS_Queryobject *self,
+	PyObject *unused
+	)
+{
+	ADNS_Stateobject *s = self->s;
+	PyObject *answer = _query_result(self);
+	if (s->refreshes) _reap_background(s);
+	_live_done(self);
+	return answer;
+}
+
+
+static char ADNS_Query_wait__doc__[] = 
+"answer=q.wait()\n\
+\n\
+Wait for an answer. Return value same as for\n\
+s.synchronous.\n"
+;
+
+static PyObject *
+_query_wait(ADNS_Queryobject *self)
+{
+	ADNS_Stateobject *s = self->s;
+	adns_answer *answer_r;
+	int r;
+
+	/* Other threads may move the query along meanwhile, so look at
+	   where it is afresh after every wait. */
+	for (;;) {
+		if (_queued(self)) {
+			/* make room for it */
+			_collect(s);
+			_pump(s);
+			if (_queued(self) &&
+			    _state_select(s, _throttle_delay(s)))
+				return NULL;
+			continue;
+		}
+		if (self->list == &s->racing) {
+			_pump(s);
+			_collect(s);
+			if (!_race_update(self, _now()) &&
+			    _state_select(s, _race_timeout(self, _now(),
+				s->queue.head || s->bulk.head ?
+				_throttle_delay(s) : 1.0)))
+				return NULL;
+			continue;
+		}
+		if (self->list == &s->ready) {
+			if (self->due > _now()) {
+				_state_sleep(s, self->due - _now());
+				continue;
+			}
+			_qlist_unlink(self);
+		}
+		if (self->exc_type) {
+			PyErr_Restore(self->exc_type, self->exc_value,
+				      self->exc_traceback);
+			self->exc_type = self->exc_value =
+				self->exc_traceback = NULL;
+			return NULL;
+		}
+		if (self->answer) break;
+		if (!(self->query)) {
+			PyErr_SetString(s->m->ErrorObject, "query invalidated");
+			return NULL;
+		}
+		r = _query_check(self, &answer_r);
+		if (r == EWOULDBLOCK) {
+			/* in steps, so that hedges go out in time */
+			if (_state_select(s, s->hedge_p ? _hedge_due(s) : 60.0))
+				return NULL;
+			continue;
+		}
+		if (r) {
+			PyErr_SetString(s->m->ErrorObject, strerror(r));
+			_query_done(self);
+			return NULL;
+		}
+		if (_query_answered(self, answer_r)) return NULL;
+		break;
+	}
+	Py_INCREF(self->answer);
+	return self->answer;
+}
+
+static PyObject *
+ADNS_Query_wait(
+	ADNS_Queryobject *self,
+	PyObject *unused
+	)
+{
+	ADNS_Stateobject *s = self->s;
+	PyObject *answer = _query_wait(self);
+	if (s->refreshes) _reap_background(s);
+	_live_done(self);
+	return answer;
+}
+
+
+static char ADNS_Query_partial__doc__[] = 
+"answer=q.partial()\n\
+\n\
+Return as much of the answer as has arrived, for a query made with\n\
+s.submit_partial(); raises NotReady if nothing has.\n"
 ;
 
+static PyObject *
+ADNS_Query_partial(
+	ADNS_Queryobject *self,
+	PyObject *unused
+	)
+{
+	if (self->list == &self->s->racing) {
+		_pump(self->s);
+		_collect(self->s);
+		_race_update(self, _now());
+	}
+	if (!self->answer) {
+		PyErr_SetString(self->s->m->NotReadyError, strerror(EWOULDBLOCK));
+		return NULL;
+	}
+	Py_INCREF(self->answer);
+	return self->answer;
+}
+
+
+static char ADNS_Query_cancel__doc__[] = 
+"q.cancel()\n\
+\n\
+Cancel a pending query.\n"
+;
 
 static PyObject *
-ADNS_State_allqueries(
-	ADNS_Stateobject *self,
-	PyObject *args
+ADNS_Query_cancel(
+	ADNS_Queryobject *self,
+	PyObject *unused
 	)
 {
-	ADNS_Queryobject *o;
-	adns_query q;
-	PyObject *l;
+	if (!self->list && !self->query) {
+		PyErr_SetString(self->s->m->ErrorObject, "query invalidated");
+		return NULL;
+	}
+	_query_cancel(self);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+_LOCKED(ADNS_Query_check, ADNS_Queryobject, &self->s->lock)
+_LOCKED(ADNS_Query_wait, ADNS_Queryobject, &self->s->lock)
+_LOCKED(ADNS_Query_partial, ADNS_Queryobject, &self->s->lock)
+_LOCKED(ADNS_Query_cancel, ADNS_Queryobject, &self->s->lock)
+
+static struct PyMethodDef ADNS_Query_methods[] = {
+	{"check",	(PyCFunction)ADNS_Query_check_locked,	METH_NOARGS,	ADNS_Query_check__doc__},
+ {"wait",	(PyCFunction)ADNS_Query_wait_locked,	METH_NOARGS,	ADNS_Query_wait__doc__},
+ {"partial",	(PyCFunction)ADNS_Query_partial_locked,	METH_NOARGS,	ADNS_Query_partial__doc__},
+ {"cancel",	(PyCFunction)ADNS_Query_cancel_locked,	METH_NOARGS,	ADNS_Query_cancel__doc__},
+ 
+	{NULL,		NULL}		/* sentinel */
+};
+
+static PyObject *
+ADNS_Query_get_stale(
+	ADNS_Queryobject *self,
+	void *closure
+	)
+{
+	return PyBool_FromLong(self->stale);
+}
+
+static PyGetSetDef ADNS_Query_getset[] = {
+	{"stale", (getter)ADNS_Query_get_stale, NULL,
+	 "True if the answer is an expired cache entry."},
+	{NULL}		/* sentinel */
+};
 
-	if (!PyArg_ParseTuple(args, ""))
+/* ---------- */
+
+
+static ADNS_Queryobject *
+newADNS_Queryobject(ADNS_Stateobject *state)
+{
+	ADNS_Queryobject *self;
+	
+	self = PyObject_GC_New(ADNS_Queryobject, state->m->ADNS_Querytype);
+	if (self == NULL)
 		return NULL;
-	if (!(l = PyList_New(0))) return NULL;
-	for (adns_forallqueries_begin(self->state);
-	     (q = adns_forallqueries_next(self->state, (void *)&o));
-		) {
-		if (PyList_Append(l, (PyObject *) o)) {
-			Py_DECREF(l);
-			return NULL;
-		}
+	Py_INCREF(state);
+	self->s = state;
+	self->query = NULL;
+	self->hedge = NULL;
+	self->hedged = 0;
+	self->answer = NULL;
+	self->exc_type = NULL;
+	self->exc_value = NULL;
+	self->exc_traceback = NULL;
+	self->key = NULL;
+	self->keylen = 0;
+	self->due = 0;
+	self->inflight = 0;
+	self->sent_prev = self->sent_next = NULL;
+	self->live = 0;
+	self->live_prev = self->live_next = NULL;
+	self->charged = 0;
+	self->background = 0;
+	self->bulk = 0;
+	self->batched = 0;
+	self->stale = 0;
+	self->usevc = 0;
+	self->list = NULL;
+	self->prev = self->next = NULL;
+	self->parent = self->kids[0] = self->kids[1] = NULL;
+	self->grace = 0;
+	self->parts = self->callback = NULL;
+	PyObject_GC_Track(self);
+	return self;
+}
+
+
+static void
+ADNS_Query_dealloc(ADNS_Queryobject *self)
+{
+	PyTypeObject *tp = Py_TYPE(self);
+	ADNS_Stateobject *s = self->s;
+
+	PyObject_GC_UnTrack(self);
+	_lock_acquire(&s->lock);
+	_race_drop(self);
+	/* what the caller no longer holds has left the registry, but a
+	   query of the module's own may still be in adns */
+	_query_abandon(self);
+	_query_uncharge(self);
+	_lock_release(&s->lock);
+	PyMem_Free(self->key);
+	if (!self->background) Py_DECREF(s);
+	Py_XDECREF(self->answer);
+	Py_XDECREF(self->exc_type);
+	Py_XDECREF(self->exc_value);
+	Py_XDECREF(self->exc_traceback);
+	Py_XDECREF(self->callback);
+	PyObject_GC_Del(self);
+	Py_DECREF(tp);
+}
+
+static int
+ADNS_Query_traverse(
+	ADNS_Queryobject *self,
+	visitproc visit,
+	void *arg
+	)
+{
+	Py_VISIT(Py_TYPE(self));
+	if (!self->background) Py_VISIT(self->s);
+	Py_VISIT(self->kids[0]);
+	Py_VISIT(self->kids[1]);
+	Py_VISIT(self->parts);
+	Py_VISIT(self->callback);
+	Py_VISIT(self->exc_type);
+	Py_VISIT(self->exc_value);
+	Py_VISIT(self->exc_traceback);
+	return 0;
+}
+
+static char ADNS_Querytype__doc__[] = 
+"A query currently being processed by adns."
+;
+
+static PyType_Slot ADNS_Querytype_slots[] = {
+	{Py_tp_dealloc, ADNS_Query_dealloc},
+	{Py_tp_traverse, ADNS_Query_traverse},
+	{Py_tp_methods, ADNS_Query_methods},
+	{Py_tp_getset, ADNS_Query_getset},
+	{Py_tp_doc, ADNS_Querytype__doc__},
+	{0, NULL}
+};
+
+static PyType_Spec ADNS_Querytype_spec = {
+	"adns.ADNS_Query",
+	sizeof(ADNS_Queryobject),
+	0,
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION |
+		Py_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_HAVE_GC,
+	ADNS_Querytype_slots
+};
+
+/* End of code for ADNS_Query objects */
+/* -------------------------------------------------------- */
+
+/* ---------------------------------------------------------------- */
+
+/* Declarations for objects of type ADNS_Listings */
+
+/* DNSBL verdicts by IPv4 address and list, indexed by /24: each /24
+   seen has a node with a small array of entries sorted by host and
+   list, so a repeat address costs a hash probe and a binary search,
+   and all that is known about a /24 sits together. */
+
+typedef struct {
+	time_t expires;
+	unsigned int codes[2];		/* answers, host byte order */
+	unsigned char host;		/* last octet */
+	unsigned char list;
+	unsigned char ncodes;		/* 0: not listed */
+} _lentry;
+
+typedef struct {
+	_hnode h;			/* key is prefix */
+	unsigned char prefix[3];
+	unsigned int n, size;
+	_lentry *e;
+} _lnode;
+
+typedef struct {
+	PyObject_HEAD
+	_htab index;
+	size_t entries, allocated;
+	unsigned long hits, misses;
+	_lock lock;			/* held by every method */
+} ADNS_Listingsobject;
+
+/* Parses a dotted quad, or with abbrev the first three octets of one
+   or a /24 ('192.0.2', '192.0.2.0/24'). */
+static int
+_listings_addr(
+	adnsstate *m,
+	const char *s,
+	unsigned char *a,
+	int abbrev
+	)
+{
+	char buf[INET_ADDRSTRLEN + 3];
+	size_t n = strlen(s);
+
+	if (n >= sizeof(buf)) goto bad;
+	strcpy(buf, s);
+	if (abbrev && n > 3 && !strcmp(buf + n - 3, "/24"))
+		buf[n -= 3] = 0;
+	if (inet_pton(AF_INET, buf, a) == 1) return 0;
+	if (abbrev && n + 2 < sizeof(buf)) {
+		strcat(buf, ".0");
+		if (inet_pton(AF_INET, buf, a) == 1) return 0;
 	}
-	return l;
+  bad:
+	PyErr_SetString(m->ErrorObject, "invalid IP address");
+	return -1;
 }
 
+static _lnode *
+_listings_node(
+	ADNS_Listingsobject *self,
+	const unsigned char *a,
+	int create
+	)
+{
+	unsigned long hash = _hash((const char *) a, 3);
+	_lnode *node;
 
+	node = (_lnode *) _htab_find(&self->index, (const char *) a, 3, hash);
+	if (node || !create) return node;
+	if (!(node = PyMem_Malloc(sizeof(_lnode))))
+		return (_lnode *) PyErr_NoMemory();
+	memcpy(node->prefix, a, 3);
+	node->h.key = (const char *) node->prefix;
+	node->h.keylen = 3;
+	node->h.hash = hash;
+	node->n = node->size = 0;
+	node->e = NULL;
+	if (_htab_insert(&self->index, &node->h)) {
+		PyMem_Free(node);
+		return (_lnode *) PyErr_NoMemory();
+	}
+	return node;
+}
 
-static char ADNS_State_select__doc__[] = 
-"s.select(timeout=0)\n\
+static void
+_listings_drop(
+	ADNS_Listingsobject *self,
+	_lnode *node
+	)
+{
+	_htab_remove(&self->index, &node->h);
+	self->entries -= node->n;
+	self->allocated -= node->size;
+	PyMem_Free(node->e);
+	PyMem_Free(node);
+}
+
+/* Index of the first entry of node not before (host, list). */
+static unsigned int
+_listings_search(
+	_lnode *node,
+	int host,
+	int list
+	)
+{
+	unsigned int lo = 0, hi = node->n, mid;
+	int key = host << 8 | list;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if ((node->e[mid].host << 8 | node->e[mid].list) < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Removes the expired entries of node; returns how many. */
+static unsigned int
+_listings_compact(
+	ADNS_Listingsobject *self,
+	_lnode *node,
+	time_t now
+	)
+{
+	unsigned int i, j;
+	for (i = j = 0; i < node->n; i++)
+		if (node->e[i].expires > now)
+			node->e[j++] = node->e[i];
+	self->entries -= i - j;
+	node->n = j;
+	return i - j;
+}
+
+/* The codes of e as a tuple of dotted quads. */
+static PyObject *
+_lentry_codes(_lentry *e)
+{
+	PyObject *t;
+	struct in_addr in;
+	int i;
+
+	if (!(t = PyTuple_New(e->ncodes))) return NULL;
+	for (i = 0; i < e->ncodes; i++) {
+		PyObject *s;
+		in.s_addr = htonl(e->codes[i]);
+		if (!(s = PyUnicode_FromString(inet_ntoa(in)))) {
+			Py_DECREF(t);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(t, i, s);
+	}
+	return t;
+}
+
+static char ADNS_Listings_set__doc__[] =
+"L.set(ip,list,answers,ttl)\n\
 \n\
-Like the select() system call, except it works only on\n\
-pending queries, i.e. internally it does:\n\
-1) adns_beforeselect\n\
-2) select\n\
-3) adns_afterselect\n"
+Record the verdict of list (0 to 255) on ip for ttl seconds: answers\n\
+is the sequence of addresses (such as '127.0.0.2') the list returned,\n\
+of which the first two are kept, or empty if ip is not listed.\n"
 ;
 
-
 static PyObject *
-ADNS_State_select(
-	ADNS_Stateobject *self,
+ADNS_Listings_set(
+	ADNS_Listingsobject *self,
 	PyObject *args
 	)
 {
-	fd_set rfds, wfds, efds;
-	int r, maxfd=0;
-	double ft = 0;
-	struct timeval **tv_mod, tv_buf, now, timeout;
-	struct timezone tz;
+	adnsstate *m = PyType_GetModuleState(Py_TYPE(self));
+	char *ip;
+	int list, ttl;
+	PyObject *answers, *seq;
+	unsigned char a[4], c[4];
+	time_t now = time(NULL);
+	unsigned int i;
+	_lnode *node;
+	_lentry *e;
+	Py_ssize_t n, j;
 
-	if (!PyArg_ParseTuple(args, "|d", &ft))
+	if (!PyArg_ParseTuple(args, "siOi", &ip, &list, &answers, &ttl))
 		return NULL;
-	timeout.tv_sec = (int) ft;
-	timeout.tv_usec = (int) ((ft - timeout.tv_sec) * 1e6);
-	tv_mod = NULL;
-	if (gettimeofday(&now, &tz))
-		return PyErr_SetFromErrno(ErrorObject);
-	FD_ZERO(&rfds);
-	FD_ZERO(&wfds);
-	FD_ZERO(&efds);
-	adns_beforeselect(self->state, &maxfd, &rfds, &wfds, &efds,
-			  tv_mod, &tv_buf, &now);
-	Py_BEGIN_ALLOW_THREADS;
-	r = select(maxfd, &rfds, &wfds, &efds, &timeout);
-	Py_END_ALLOW_THREADS;
-	if (r == -1) return PyErr_SetFromErrno(ErrorObject);
-	if (gettimeofday(&now, &tz))
-		return PyErr_SetFromErrno(ErrorObject);
-	adns_afterselect(self->state, maxfd, &rfds, &wfds, &efds, &now);
+	if (list < 0 || list > 255) {
+		PyErr_SetString(PyExc_ValueError, "list must be 0 to 255");
+		return NULL;
+	}
+	if (_listings_addr(m, ip, a, 0) ||
+	    !(seq = PySequence_Fast(answers, "answers must be a sequence")))
+		return NULL;
+	if (ttl <= 0 || !(node = _listings_node(self, a, 1))) {
+		Py_DECREF(seq);
+		if (PyErr_Occurred()) return NULL;
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	i = _listings_search(node, a[3], list);
+	if (i == node->n || node->e[i].host != a[3] || node->e[i].list != list) {
+		if (node->n == node->size &&
+		    !_listings_compact(self, node, now)) {
+			unsigned int size = node->size ? 2 * node->size : 2;
+			if (!(e = PyMem_Realloc(node->e, size * sizeof(_lentry)))) {
+				Py_DECREF(seq);
+				return PyErr_NoMemory();
+			}
+			node->e = e;
+			self->allocated += size - node->size;
+			node->size = size;
+		}
+		i = _listings_search(node, a[3], list);
+		memmove(node->e + i + 1, node->e + i,
+			(node->n - i) * sizeof(_lentry));
+		node->n++;
+		self->entries++;
+	}
+	e = node->e + i;
+	memset(e, 0, sizeof(*e));
+	e->host = a[3];
+	e->list = list;
+	e->expires = now + ttl;
+	n = PySequence_Fast_GET_SIZE(seq);
+	for (j = 0; j < n && e->ncodes < 2; j++) {
+		const char *s = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(seq, j));
+		if (!s || _listings_addr(m, s, c, 0)) {
+			Py_DECREF(seq);
+			return NULL;
+		}
+		e->codes[e->ncodes++] = (unsigned int) c[0] << 24 | c[1] << 16 |
+			c[2] << 8 | c[3];
+	}
+	Py_DECREF(seq);
 	Py_INCREF(Py_None);
 	return Py_None;
 }
 
-
-static char ADNS_State_completed__doc__[] = 
-"s.allqueries()\n\
+static char ADNS_Listings_get__doc__[] =
+"L.get(ip[,list])\n\
 \n\
-Returns a list of all completed queries.\n"
+The answers recorded for ip by list, () if it is not listed, or None\n\
+if there is no unexpired verdict. Without list, a list of (list,\n\
+answers) for every list with a verdict on ip.\n"
 ;
 
-
 static PyObject *
-ADNS_State_completed(
-	ADNS_Stateobject *self,
+ADNS_Listings_get(
+	ADNS_Listingsobject *self,
 	PyObject *args
 	)
 {
-	adns_answer *answer_r;
-	int r;
-	ADNS_Queryobject *o, *o2;
-	adns_query q;
-	PyObject *l;
+	adnsstate *m = PyType_GetModuleState(Py_TYPE(self));
+	char *ip;
+	int list = -1;
+	unsigned char a[4];
+	time_t now = time(NULL);
+	unsigned int i;
+	_lnode *node;
+	PyObject *l, *codes, *v;
 
-	if (!(l = ADNS_State_select(self, args))) return NULL;
-	Py_DECREF(l);
-	if (!(l = PyList_New(0))) return NULL;
-	for (adns_forallqueries_begin(self->state);
-	     (q = adns_forallqueries_next(self->state, (void *)&o));
-		) {
-		r = adns_check(self->state, &q, &answer_r, (void *) &o2);
-		if (r) {
-			if (r == EWOULDBLOCK)
-				continue;
-			else {
-				PyErr_SetString(ErrorObject, strerror(r));
-				PyErr_Fetch(&(o->exc_type),
-					    &(o->exc_value),
-					    &(o->exc_traceback));
-				continue;
-			}
+	if (!PyArg_ParseTuple(args, "s|i", &ip, &list) ||
+	    _listings_addr(m, ip, a, 0))
+		return NULL;
+	node = _listings_node(self, a, 0);
+	i = node ? _listings_search(node, a[3], list < 0 ? 0 : list) : 0;
+	if (list >= 0) {
+		if (!node || i == node->n || node->e[i].host != a[3] ||
+		    node->e[i].list != list || node->e[i].expires <= now) {
+			self->misses++;
+			Py_INCREF(Py_None);
+			return Py_None;
 		}
-		assert(o == o2);
-		o->answer = interpret_answer(answer_r);
-		free(answer_r);
-		o->query = NULL;
-		if (PyList_Append(l, (PyObject *) o)) {
+		self->hits++;
+		return _lentry_codes(node->e + i);
+	}
+	if (!(l = PyList_New(0))) return NULL;
+	for (; node && i < node->n && node->e[i].host == a[3]; i++) {
+		if (node->e[i].expires <= now) continue;
+		v = NULL;
+		if (!(codes = _lentry_codes(node->e + i)) ||
+		    !(v = Py_BuildValue("iN", node->e[i].list, codes)) ||
+		    PyList_Append(l, v)) {
+			Py_XDECREF(v);
 			Py_DECREF(l);
 			return NULL;
 		}
+		Py_DECREF(v);
 	}
+	if (PyList_GET_SIZE(l)) self->hits++;
+	else self->misses++;
 	return l;
 }
 
-
-
-static char ADNS_State_globalsystemfailure__doc__[] = 
-""
+static char ADNS_Listings_range__doc__[] =
+"L.range(net)\n\
+\n\
+Everything known about the /24 net ('192.0.2.0/24', or any address in\n\
+it): a list of (ip, list, answers) in address order.\n"
 ;
 
 static PyObject *
-ADNS_State_globalsystemfailure(
-	ADNS_Stateobject *self,
+ADNS_Listings_range(
+	ADNS_Listingsobject *self,
 	PyObject *args
 	)
 {
-	if (!PyArg_ParseTuple(args, ""))
+	adnsstate *m = PyType_GetModuleState(Py_TYPE(self));
+	char *net, ip[INET_ADDRSTRLEN];
+	unsigned char a[4];
+	time_t now = time(NULL);
+	unsigned int i;
+	_lnode *node;
+	PyObject *l, *codes, *v;
+
+	if (!PyArg_ParseTuple(args, "s", &net) || _listings_addr(m, net, a, 1))
 		return NULL;
-	adns_globalsystemfailure(self->state);
-	Py_INCREF(Py_None);
-	return Py_None;
+	if (!(l = PyList_New(0))) return NULL;
+	node = _listings_node(self, a, 0);
+	for (i = 0; node && i < node->n; i++) {
+		if (node->e[i].expires <= now) continue;
+		v = NULL;
+		sprintf(ip, "%d.%d.%d.%d", a[0], a[1], a[2], node->e[i].host);
+		if (!(codes = _lentry_codes(node->e + i)) ||
+		    !(v = Py_BuildValue("siN", ip, node->e[i].list, codes)) ||
+		    PyList_Append(l, v)) {
+			Py_XDECREF(v);
+			Py_DECREF(l);
+			return NULL;
+		}
+		Py_DECREF(v);
+	}
+	return l;
 }
 
+static char ADNS_Listings_expire__doc__[] =
+"L.expire()\n\
+\n\
+Forget expired verdicts now rather than as their /24 fills up, and\n\
+return how many there were.\n"
+;
 
-static struct PyMethodDef ADNS_State_methods[] = {
-	{"synchronous",	(PyCFunction)ADNS_State_synchronous,	METH_VARARGS,	ADNS_State_synchronous__doc__},
- {"submit",	(PyCFunction)ADNS_State_submit,	METH_VARARGS,	ADNS_State_submit__doc__},
- {"submit_reverse",	(PyCFunction)ADNS_State_submit_reverse,	METH_VARARGS,	ADNS_State_submit_reverse__doc__},
- {"submit_reverse_any",	(PyCFunction)ADNS_State_submit_reverse_any,	METH_VARARGS,	ADNS_State_submit_reverse_any__doc__},
- {"allqueries",	(PyCFunction)ADNS_State_allqueries,	METH_VARARGS,	ADNS_State_allqueries__doc__},
- {"completed",	(PyCFunction)ADNS_State_completed,	METH_VARARGS,	ADNS_State_completed__doc__},
- {"select",	(PyCFunction)ADNS_State_select,	METH_VARARGS,	ADNS_State_select__doc__},
- {"globalsystemfailure",	(PyCFunction)ADNS_State_globalsystemfailure,	METH_VARARGS,	ADNS_State_globalsystemfailure__doc__},
- 
-	{NULL,		NULL}		/* sentinel */
-};
+static PyObject *
+ADNS_Listings_expire(
+	ADNS_Listingsobject *self,
+	PyObject *unused
+	)
+{
+	time_t now = time(NULL);
+	unsigned long n = 0;
+	size_t b;
+	_hnode *h, *next;
 
-/* ---------- */
+	for (b = 0; b < self->index.nbuckets; b++)
+		for (h = self->index.buckets[b]; h; h = next) {
+			_lnode *node = (_lnode *) h;
+			next = h->next;
+			n += _listings_compact(self, node, now);
+			if (!node->n)
+				_listings_drop(self, node);
+		}
+	return PyLong_FromLong(n);
+}
 
+static char ADNS_Listings_stats__doc__[] =
+"L.stats()\n\
+\n\
+Returns a dict of entries, prefixes (/24s), bytes of memory used, and\n\
+the hits and misses of L.get().\n"
+;
 
 static PyObject *
-ADNS_State_getattr(
-	ADNS_Stateobject *self,
-	char *name
+ADNS_Listings_stats(
+	ADNS_Listingsobject *self,
+	PyObject *unused
 	)
 {
-	/* XXXX Add your own getattr code here */
-	return Py_FindMethod(ADNS_State_methods, (PyObject *)self, name);
-}
+	PyObject *d;
+	double bytes;
 
-static ADNS_Stateobject *
-newADNS_Stateobject(void)
-{
-	ADNS_Stateobject *self;
-	
-	self = PyObject_New(ADNS_Stateobject, &ADNS_Statetype);
-	if (self == NULL)
+	bytes = sizeof(*self) + self->index.nbuckets * sizeof(_hnode *) +
+		self->index.count * sizeof(_lnode) +
+		self->allocated * sizeof(_lentry);
+	if (!(d = PyDict_New())) return NULL;
+	if (_dict_setnum(d, "entries", self->entries) ||
+	    _dict_setnum(d, "prefixes", self->index.count) ||
+	    _dict_setnum(d, "bytes", bytes) ||
+	    _dict_setnum(d, "hits", self->hits) ||
+	    _dict_setnum(d, "misses", self->misses)) {
+		Py_DECREF(d);
 		return NULL;
-	self->state = NULL;
-	return self;
+	}
+	return d;
 }
 
+_LOCKED(ADNS_Listings_set, ADNS_Listingsobject, &self->lock)
+_LOCKED(ADNS_Listings_get, ADNS_Listingsobject, &self->lock)
+_LOCKED(ADNS_Listings_range, ADNS_Listingsobject, &self->lock)
+_LOCKED(ADNS_Listings_expire, ADNS_Listingsobject, &self->lock)
+_LOCKED(ADNS_Listings_stats, ADNS_Listingsobject, &self->lock)
+
+static struct PyMethodDef ADNS_Listings_methods[] = {
+	{"set",	(PyCFunction)ADNS_Listings_set_locked,	METH_VARARGS,	ADNS_Listings_set__doc__},
+ {"get",	(PyCFunction)ADNS_Listings_get_locked,	METH_VARARGS,	ADNS_Listings_get__doc__},
+ {"range",	(PyCFunction)ADNS_Listings_range_locked,	METH_VARARGS,	ADNS_Listings_range__doc__},
+ {"expire",	(PyCFunction)ADNS_Listings_expire_locked,	METH_NOARGS,	ADNS_Listings_expire__doc__},
+ {"stats",	(PyCFunction)ADNS_Listings_stats_locked,	METH_NOARGS,	ADNS_Listings_stats__doc__},
+
+	{NULL,		NULL}		/* sentinel */
+};
+
+/* ---------- */
 
 static void
-ADNS_State_dealloc(ADNS_Stateobject *self)
-{
-	Py_BEGIN_ALLOW_THREADS;
-	adns_finish(self->state);
-	Py_END_ALLOW_THREADS;
-	Py_INCREF(Py_None);
-	PyObject_Del(self);
+ADNS_Listings_dealloc(ADNS_Listingsobject *self)
+{
+	PyTypeObject *tp = Py_TYPE(self);
+	size_t b;
+	_hnode *h, *next;
+
+	for (b = 0; b < self->index.nbuckets; b++)
+		for (h = self->index.buckets[b]; h; h = next) {
+			next = h->next;
+			PyMem_Free(((_lnode *) h)->e);
+			PyMem_Free(h);
+		}
+	_htab_free(&self->index);
+	pthread_mutex_destroy(&self->lock.mutex);
+	PyObject_Free(self);
+	Py_DECREF(tp);
 }
 
-static char ADNS_Statetype__doc__[] = 
-"Contains state information for adns session."
+static char ADNS_Listingstype__doc__[] =
+"DNSBL verdicts by address, see adns.listings()."
 ;
 
-static PyTypeObject ADNS_Statetype = {
-	PyObject_HEAD_INIT(&PyType_Type)
-	0,				/*ob_size*/
-	"ADNS_State",			/*tp_name*/
-	sizeof(ADNS_Stateobject),		/*tp_basicsize*/
-	0,				/*tp_itemsize*/
-	/* methods */
-	(destructor)ADNS_State_dealloc,	/*tp_dealloc*/
-	(printfunc)0,		/*tp_print*/
-	(getattrfunc)ADNS_State_getattr,	/*tp_getattr*/
-	(setattrfunc)0,	/*tp_setattr*/
-	(cmpfunc)0,		/*tp_compare*/
-	(reprfunc)0,		/*tp_repr*/
-	0,			/*tp_as_number*/
-	0,		/*tp_as_sequence*/
-	0,		/*tp_as_mapping*/
-	(hashfunc)0,		/*tp_hash*/
-	(ternaryfunc)0,		/*tp_call*/
-	(reprfunc)0,		/*tp_str*/
-
-	/* Space for future expansion */
-	0L,0L,0L,0L,
-	ADNS_Statetype__doc__ /* Documentation string */
+static PyType_Slot ADNS_Listingstype_slots[] = {
+	{Py_tp_dealloc, ADNS_Listings_dealloc},
+	{Py_tp_methods, ADNS_Listings_methods},
+	{Py_tp_doc, ADNS_Listingstype__doc__},
+	{0, NULL}
 };
 
-/* End of code for ADNS_State objects */
-/* -------------------------------------------------------- */
+static PyType_Spec ADNS_Listingstype_spec = {
+	"adns.ADNS_Listings",
+	sizeof(ADNS_Listingsobject),
+	0,
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION |
+		Py_TPFLAGS_IMMUTABLETYPE,
+	ADNS_Listingstype_slots
+};
 
+/* End of code for ADNS_Listings objects */
+/* -------------------------------------------------------- */
 
-static char ADNS_Query_check__doc__[] = 
-"answer = q.check()\n\
+static char adns_listings__doc__[] =
+"adns.listings()\n\
 \n\
-Check for an answer. Return value same as for\n\
-s.synchronous.\n"
+Create an ADNS_Listings, a compact store of DNSBL verdicts by IPv4\n\
+address with expiry, which answers for repeat addresses without DNS\n\
+and for whole /24s at once. DNSBL.DNSBLQueryEngine keeps one.\n"
 ;
 
 static PyObject *
-ADNS_Query_check(
-	ADNS_Queryobject *self,
-	PyObject *args
+adns__listings(
+	PyObject *self,
+	PyObject *unused
 	)
 {
-	adns_answer *answer_r;
-	int r;
-	PyObject *o2=(PyObject *)self;
+	adnsstate *m = PyModule_GetState(self);
+	ADNS_Listingsobject *l;
 
-	if (!PyArg_ParseTuple(args, ""))
-		return NULL;
-	if (self->exc_type) {
-		PyErr_Restore(self->exc_type, self->exc_value, self->exc_traceback);
-		self->exc_type = self->exc_value = self->exc_traceback = NULL;
-		return NULL;
-	}
-	if (self->answer) goto ret_answer;
-	if (!(self->query)) {
-		PyErr_SetString(ErrorObject, "query invalidated");
-		return NULL;
-	}
-	r = adns_check(self->s->state, &self->query, &answer_r, (void *) &o2);
-	if (r) {
-		if (r == EWOULDBLOCK)
-			PyErr_SetString(NotReadyError, strerror(r));
-		else {
-			PyErr_SetString(ErrorObject, strerror(r));
-			self->query = NULL;
-		}
+	if (!(l = PyObject_New(ADNS_Listingsobject, m->ADNS_Listingstype)))
 		return NULL;
-	}
-	assert(o2 == (PyObject *) self);
-	self->answer = interpret_answer(answer_r);
-	self->query = NULL;
-	free(answer_r);
-  ret_answer:
-	Py_INCREF(self->answer);
-	return self->answer;
+	memset(&l->index, 0, sizeof(l->index));
+	l->entries = l->allocated = 0;
+	l->hits = l->misses = 0;
+	_lock_init(&l->lock);
+	return (PyObject *) l;
 }
 
 
-static char ADNS_Query_wait__doc__[] = 
-"answer=q.wait()\n\
+static char adns_init__doc__[] =
+"s=adns.init([initflags,debugfileobj=stderr,configtext='',cache=0,snapshot=None,\n\
+shared=None,shared_size=16M])\n\
 \n\
-Wait for an answer. Return value same as for\n\
-s.synchronous.\n"
+Initialize an ADNS_State object, which contains state information\n\
+used internally by adns.\n\
+\n\
+cache is the number of answers to keep in an LRU cache; 0 disables\n\
+caching. snapshot names a file written by s.dump_cache() whose\n\
+unexpired entries are loaded into the cache. shared names a file,\n\
+created with room for shared_size bytes of answers if need be (and\n\
+mode 0600), that the caches of all states naming it share, even across\n\
+processes of the same user.\n\
+\n\
+A state may be shared by any number of threads."
 ;
 
 static PyObject *
-ADNS_Query_wait(
-	ADNS_Queryobject *self,
-	PyObject *args
+adns__init(
+	PyObject *self,	/* Not used */
+	PyObject *args,
+	PyObject *kwargs
 	)
 {
-	adns_answer *answer_r;
-	int r;
-	PyObject *o2=(PyObject *)self;
+	static char *kwlist[] = { "flags", "diagfile", "configtext",
+				  "cache", "snapshot", "shared", "shared_size",
+				  NULL };
+	adnsstate *m = PyModule_GetState(self);
+	adns_initflags flags = 0;
+	int status, fd, cachesize = 0;
+	long sharedsize = _SHM_DEFAULT;
+	PyObject *diagobj = NULL;
+	char *configtext = NULL, *snapshot = NULL, *shared = NULL;
+	ADNS_Stateobject *s;
 
-	if (!PyArg_ParseTuple(args, ""))
-		return NULL;
-	if (self->exc_type) {
-		PyErr_Restore(self->exc_type, self->exc_value, self->exc_traceback);
-		self->exc_type = self->exc_value = self->exc_traceback = NULL;
+	if (!PyArg_ParseTupleAndKeywords(
+		args, kwargs, "|iOsizzl", kwlist,
+		&flags, &diagobj, &configtext,
+		&cachesize, &snapshot, &shared, &sharedsize))
 		return NULL;
+	if ((snapshot || shared) && !cachesize) cachesize = _CACHE_DEFAULT;
+	if (!(s = newADNS_Stateobject(m))) return NULL;
+	if (diagobj && diagobj != Py_None) {
+		/* adns wants a stdio stream of its own on the file */
+		if ((fd = PyObject_AsFileDescriptor(diagobj)) == -1)
+			goto error;
+		if ((fd = dup(fd)) == -1 ||
+		    !(s->diagfile = fdopen(fd, "w"))) {
+			PyErr_SetFromErrno(m->ErrorObject);
+			if (fd != -1) close(fd);
+			goto error;
+		}
+		setvbuf(s->diagfile, NULL, _IOLBF, 0);
 	}
-	if (self->answer) goto ret_answer;
-	if (!(self->query)) {
-		PyErr_SetString(ErrorObject, "query invalidated");
-		return NULL;
+	if (cachesize > 0) {
+		if (!(s->cache = _cache_new(cachesize)) ||
+		    (snapshot && _cache_load(m, s->cache, snapshot)) ||
+		    (shared && sharedsize > 0 &&
+		     !(s->cache->shm = _shm_open(m, shared, sharedsize))))
+			goto error;
 	}
-	Py_BEGIN_ALLOW_THREADS;
-	r = adns_wait(self->s->state, &self->query, &answer_r, (void *) &o2);
-	Py_END_ALLOW_THREADS;
-	if (r) {
-		if (r == EWOULDBLOCK)
-			PyErr_SetString(NotReadyError, strerror(r));
-		else {
-			PyErr_SetString(ErrorObject, strerror(r));
-			self->query = NULL;
-		}
-		return NULL;
+	if (configtext)
+		status = adns_init_strcfg(&s->state, flags,
+					  s->diagfile, configtext);
+	else
+		status = adns_init(&s->state, flags, s->diagfile);
+	if (status) {
+		errno = status;
+		PyErr_SetFromErrno(m->ErrorObject);
+		goto error;
 	}
-	assert(o2 == (PyObject *) self);
-	self->answer = interpret_answer(answer_r);
-	self->query = NULL;
-	free(answer_r);
-  ret_answer:
-	Py_INCREF(self->answer);
-	return self->answer;
+	return (PyObject *) s;
+  error:
+	Py_DECREF(s);
+	return NULL;
 }
 
-
-static char ADNS_Query_cancel__doc__[] = 
-"q.cancel()\n\
+static char adns_select__doc__[] =
+"adns.select(states[,timeout=0])\n\
 \n\
-Cancel a pending query.\n"
+Like s.select(), but waits for activity on any of several states, so\n\
+that a program can drive them together.  A state that another thread\n\
+is already waiting on is left to that thread.\n"
 ;
 
 static PyObject *
-ADNS_Query_cancel(
-	ADNS_Queryobject *self,
+adns__select(
+	PyObject *self,
 	PyObject *args
 	)
 {
-	if (!PyArg_ParseTuple(args, ""))
+	adnsstate *m = PyModule_GetState(self);
+	PyObject *states, *seq;
+	ADNS_Stateobject *s;
+	fd_set rfds, wfds, efds;
+	struct timeval tv, tv_buf, *tv_mod, now;
+	double ft = 0;
+	Py_ssize_t i, n;
+	int r, err, maxfd = 0;
+	char *mine, buf[64];
+
+	if (!PyArg_ParseTuple(args, "O|d", &states, &ft))
 		return NULL;
-	if (!(self->query)) {
-		PyErr_SetString(ErrorObject, "query invalidated");
+	if (!(seq = PySequence_Fast(states, "states must be a sequence")))
 		return NULL;
+	n = PySequence_Fast_GET_SIZE(seq);
+	for (i = 0; i < n; i++) {
+		s = (ADNS_Stateobject *) PySequence_Fast_GET_ITEM(seq, i);
+		if (Py_TYPE(s) != m->ADNS_Statetype) {
+			PyErr_SetString(PyExc_TypeError, "states must be ADNS_State");
+			Py_DECREF(seq);
+			return NULL;
+		}
+	}
+	/* which states this thread polls, as _state_io() would */
+	if (!(mine = PyMem_Malloc(n ? n : 1))) {
+		Py_DECREF(seq);
+		return PyErr_NoMemory();
+	}
+	for (i = 0; i < n; i++) {
+		s = (ADNS_Stateobject *) PySequence_Fast_GET_ITEM(seq, i);
+		_lock_acquire(&s->lock);
+		_pump(s);
+		_race_all(s, _now());
+		ft = _state_timeout(s, ft);
+		_lock_release(&s->lock);
+	}
+	tv.tv_sec = (long) ft;
+	tv.tv_usec = (long) ((ft - tv.tv_sec) * 1e6);
+	tv_mod = &tv;
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+	FD_ZERO(&efds);
+	gettimeofday(&now, NULL);
+	for (i = 0; i < n; i++) {
+		s = (ADNS_Stateobject *) PySequence_Fast_GET_ITEM(seq, i);
+		_lock_acquire(&s->lock);
+		if ((mine[i] = !s->polling)) {
+			adns_beforeselect(s->state, &maxfd, &rfds, &wfds, &efds,
+					  &tv_mod, &tv_buf, &now);
+			FD_SET(s->wake[0], &rfds);
+			if (s->wake[0] >= maxfd) maxfd = s->wake[0] + 1;
+			s->polling = 1;
+		}
+		_lock_release(&s->lock);
 	}
 	Py_BEGIN_ALLOW_THREADS;
-	adns_cancel(self->query);
+	r = select(maxfd, &rfds, &wfds, &efds, tv_mod);
+	err = errno;
 	Py_END_ALLOW_THREADS;
+	gettimeofday(&now, NULL);
+	for (i = 0; i < n; i++) {
+		if (!mine[i]) continue;
+		s = (ADNS_Stateobject *) PySequence_Fast_GET_ITEM(seq, i);
+		_lock_acquire(&s->lock);
+		s->polling = 0;
+		if (r > 0 && FD_ISSET(s->wake[0], &rfds))
+			while (read(s->wake[0], buf, sizeof(buf)) > 0)
+				;
+		if (r != -1)
+			adns_afterselect(s->state, maxfd, &rfds, &wfds, &efds,
+					 &now);
+		pthread_cond_broadcast(&s->polled);
+		_lock_release(&s->lock);
+	}
+	PyMem_Free(mine);
+	Py_DECREF(seq);
+	if (r == -1 && err != EINTR) {
+		errno = err;
+		return PyErr_SetFromErrno(m->ErrorObject);
+	}
 	Py_INCREF(Py_None);
-	self->query = NULL;
 	return Py_None;
 }
 
+/* Decode benchmark: synthetic answers shaped like real ones for each
+   RR type, so that interpret_answer can be timed, and what it
+   allocates measured, without a network. */
 
-static struct PyMethodDef ADNS_Query_methods[] = {
-	{"check",	(PyCFunction)ADNS_Query_check,	METH_VARARGS,	ADNS_Query_check__doc__},
- {"wait",	(PyCFunction)ADNS_Query_wait,	METH_VARARGS,	ADNS_Query_wait__doc__},
- {"cancel",	(PyCFunction)ADNS_Query_cancel,	METH_VARARGS,	ADNS_Query_cancel__doc__},
- 
-	{NULL,		NULL}		/* sentinel */
-};
-
-/* ---------- */
-
+static char _bench_txt1[] = "v=spf1 include:_spf.example.com ip4:192.0.2.0/24 ~all";
+static char _bench_txt2[] = "google-site-verification=4ibFUgB-wXLQ_S7vsXVomSTVamuOXBiVAzpR5IZ87D0";
 
-static PyObject *
-ADNS_Query_getattr(
-	ADNS_Queryobject *self,
-	char *name
+static void
+_bench_addr(
+	adns_rr_addr *a,
+	int i
 	)
 {
-	/* XXXX Add your own getattr code here */
-	return Py_FindMethod(ADNS_Query_methods, (PyObject *)self, name);
-}
-
-static ADNS_Queryobject *
-newADNS_Queryobject(ADNS_Stateobject *state)
-{
-	ADNS_Queryobject *self;
-	
-	self = PyObject_New(ADNS_Queryobject, &ADNS_Querytype);
-	if (self == NULL)
-		return NULL;
-	Py_INCREF(state);
-	self->s = state;
-	self->query = NULL;
-	self->answer = NULL;
-	self->exc_type = NULL;
-	self->exc_value = NULL;
-	self->exc_traceback = NULL;
-	return self;
+	if (i & 1) {
+		a->len = sizeof(struct sockaddr_in6);
+		a->addr.inet6.sin6_family = AF_INET6;
+		inet_pton(AF_INET6, "2001:db8::1", &a->addr.inet6.sin6_addr);
+		a->addr.inet6.sin6_addr.s6_addr[15] = (unsigned char) i;
+	} else {
+		a->len = sizeof(struct sockaddr_in);
+		a->addr.inet.sin_family = AF_INET;
+		a->addr.inet.sin_addr.s_addr = htonl(0xc0000200 | (i & 0xff));
+	}
 }
 
-
 static void
-ADNS_Query_dealloc(ADNS_Queryobject *self)
+_bench_hostaddr(
+	adns_rr_hostaddr *ha,
+	char *host,
+	adns_rr_addr *addrs,
+	int i
+	)
 {
-	Py_DECREF(self->s);
-	Py_XDECREF(self->answer);
-	Py_XDECREF(self->exc_type);
-	Py_XDECREF(self->exc_value);
-	Py_XDECREF(self->exc_traceback);
-	PyObject_Del(self);
+	ha->host = host;
+	ha->astatus = adns_s_ok;
+	ha->naddrs = 2;
+	ha->addrs = addrs;
+	_bench_addr(addrs, 2 * i);
+	_bench_addr(addrs + 1, 2 * i + 1);
 }
 
-static char ADNS_Querytype__doc__[] = 
-"A query currently being processed by adns."
-;
-
-static PyTypeObject ADNS_Querytype = {
-	PyObject_HEAD_INIT(&PyType_Type)
-	0,				/*ob_size*/
-	"ADNS_Query",			/*tp_name*/
-	sizeof(ADNS_Queryobject),		/*tp_basicsize*/
-	0,				/*tp_itemsize*/
-	/* methods */
-	(destructor)ADNS_Query_dealloc,	/*tp_dealloc*/
-	(printfunc)0,		/*tp_print*/
-	(getattrfunc)ADNS_Query_getattr,	/*tp_getattr*/
-	(setattrfunc)0,	/*tp_setattr*/
-	(cmpfunc)0,		/*tp_compare*/
-	(reprfunc)0,		/*tp_repr*/
-	0,			/*tp_as_number*/
-	0,		/*tp_as_sequence*/
-	0,		/*tp_as_mapping*/
-	(hashfunc)0,		/*tp_hash*/
-	(ternaryfunc)0,		/*tp_call*/
-	(reprfunc)0,		/*tp_str*/
-
-	/* Space for future expansion */
-	0L,0L,0L,0L,
-	ADNS_Querytype__doc__ /* Documentation string */
-};
-
-/* End of code for ADNS_Query objects */
-/* -------------------------------------------------------- */
+/* An answer of nrrs RRs of type, in one block to be free()d, or NULL
+   if interpret_answer does not know the type. */
+static adns_answer *
+_bench_answer(
+	adns_rrtype type,
+	int nrrs
+	)
+{
+	adns_rrtype t = type & adns_rrt_typemask, td = type & adns__qtf_deref;
+	size_t rrsz, extra, head = (sizeof(adns_answer) + 15) & ~15;
+	adns_answer *a;
+	char *side;
+	int i;
 
+	switch (t) {
+	case adns_r_a: rrsz = td ? sizeof(adns_rr_addr) : sizeof(struct in_addr); break;
+	case adns_r_aaaa: rrsz = td ? sizeof(adns_rr_addr) : sizeof(struct in6_addr); break;
+	case adns_r_hinfo: rrsz = sizeof(adns_rr_intstrpair); break;
+	case adns_r_mx_raw: rrsz = td ? sizeof(adns_rr_inthostaddr) : sizeof(adns_rr_intstr); break;
+	case adns_r_ptr_raw: case adns_r_cname: rrsz = sizeof(char *); break;
+	case adns_r_txt: rrsz = sizeof(adns_rr_intstr *); break;
+	case adns_r_ns_raw: rrsz = td ? sizeof(adns_rr_hostaddr) : sizeof(char *); break;
+	case adns_r_soa_raw: rrsz = sizeof(adns_rr_soa); break;
+	case adns_r_rp_raw: rrsz = sizeof(adns_rr_strpair); break;
+	case adns_r_srv_raw: rrsz = td ? sizeof(adns_rr_srvha) : sizeof(adns_rr_srvraw); break;
+	default:
+		return NULL;
+	}
+	/* per RR: two addresses for a host, or three character-strings */
+	extra = 2 * sizeof(adns_rr_addr);
+	if (extra < 3 * sizeof(adns_rr_intstr))
+		extra = 3 * sizeof(adns_rr_intstr);
+	if (!(a = calloc(1, head + ((nrrs * rrsz + 15) & ~15) + nrrs * extra)))
+		return NULL;
+	a->status = adns_s_ok;
+	a->type = type;
+	a->owner = "example.com";
+	a->expires = time(NULL) + 3600;
+	a->nrrs = nrrs;
+	a->rrsz = rrsz;
+	a->rrs.untyped = (char *) a + head;
+	side = (char *) a + head + ((nrrs * rrsz + 15) & ~15);
+	for (i = 0; i < nrrs; i++, side += extra) {
+		switch (t) {
+		case adns_r_a:
+			if (td) _bench_addr(a->rrs.addr + i, 2 * i);
+			else a->rrs.inaddr[i].s_addr = htonl(0xc0000200 | (i & 0xff));
+			break;
+		case adns_r_aaaa:
+			if (td) _bench_addr(a->rrs.addr + i, 2 * i + 1);
+			else {
+				inet_pton(AF_INET6, "2001:db8::1", a->rrs.in6addr + i);
+				a->rrs.in6addr[i].s6_addr[15] = (unsigned char) i;
+			}
+			break;
+		case adns_r_hinfo:
+			a->rrs.intstrpair[i].array[0].str = "INTEL-386";
+			a->rrs.intstrpair[i].array[0].i = 9;
+			a->rrs.intstrpair[i].array[1].str = "UNIX";
+			a->rrs.intstrpair[i].array[1].i = 4;
+			break;
+		case adns_r_mx_raw:
+			if (td) {
+				a->rrs.inthostaddr[i].i = 10 * (i + 1);
+				_bench_hostaddr(&a->rrs.inthostaddr[i].ha,
+						"mx1.mail.example.com",
+						(adns_rr_addr *) side, i);
+			} else {
+				a->rrs.intstr[i].i = 10 * (i + 1);
+				a->rrs.intstr[i].str = "mx1.mail.example.com";
+			}
+			break;
+		case adns_r_ptr_raw:
+		case adns_r_cname:
+			a->rrs.str[i] = "host-192-0-2-7.dyn.example.net";
+			break;
+		case adns_r_txt:
+			{
+				adns_rr_intstr *s = (adns_rr_intstr *) side;
+				s[0].str = _bench_txt1;
+				s[0].i = sizeof(_bench_txt1) - 1;
+				s[1].str = _bench_txt2;
+				s[1].i = sizeof(_bench_txt2) - 1;
+				s[2].str = NULL;
+				s[2].i = -1;
+				a->rrs.manyistr[i] = s;
+			}
+			break;
+		case adns_r_ns_raw:
+			if (td) _bench_hostaddr(a->rrs.hostaddr + i,
+						"ns1.dns.example.net",
+						(adns_rr_addr *) side, i);
+			else a->rrs.str[i] = "ns1.dns.example.net";
+			break;
+		case adns_r_soa_raw:
+			a->rrs.soa[i].mname = "ns1.dns.example.net";
+			a->rrs.soa[i].rname = "hostmaster.example.net";
+			a->rrs.soa[i].serial = 2024061501;
+			a->rrs.soa[i].refresh = 7200;
+			a->rrs.soa[i].retry = 900;
+			a->rrs.soa[i].expire = 1209600;
+			a->rrs.soa[i].minimum = 300;
+			break;
+		case adns_r_rp_raw:
+			a->rrs.strpair[i].array[0] = "admin.example.com";
+			a->rrs.strpair[i].array[1] = "contact.example.com";
+			break;
+		case adns_r_srv_raw:
+			if (td) {
+				a->rrs.srvha[i].priority = 10;
+				a->rrs.srvha[i].weight = 60;
+				a->rrs.srvha[i].port = 5060;
+				_bench_hostaddr(&a->rrs.srvha[i].ha,
+						"sip1.voip.example.com",
+						(adns_rr_addr *) side, i);
+			} else {
+				a->rrs.srvraw[i].priority = 10;
+				a->rrs.srvraw[i].weight = 60;
+				a->rrs.srvraw[i].port = 5060;
+				a->rrs.srvraw[i].host = "sip1.voip.example.com";
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	return a;
+}
 
-static char adns_init__doc__[] =
-"s=adns.init([initflags,debugfileobj=stderr,configtext=''])\n\
+static char adns_bench_decode__doc__[] =
+"times = adns._bench_decode(type, nrrs, rounds[, txtmode[, keep]])\n\
 \n\
-Initialize an ADNS_State object, which contains state information\n\
-used internally by adns."
+Decode a synthetic answer of nrrs RRs of type rounds times, as a query\n\
+with s.set_txtmode(txtmode) would, and return the nanoseconds each\n\
+round took.  Every result is kept until the end, so none is made from\n\
+freed memory; with keep, the results are returned instead, so that\n\
+the caller can see what they hold. See decodebench.py.\n"
 ;
 
-int
-_file_converter(
-	PyObject *obj,
-	FILE **f
-	)
-{
-	*f = PyFile_AsFile(obj);
-	return (*f != NULL);
-}
-
 static PyObject *
-adns__init(
-	PyObject *self,	/* Not used */
-	PyObject *args,
-	PyObject *kwargs
+adns__bench_decode(
+	PyObject *self,
+	PyObject *args
 	)
 {
-	static char *kwlist[] = { "flags", "diagfile", "configtext" };
-	adns_initflags flags = 0;
-	int status;
-	FILE *diagfile = NULL;
-	char *configtext = NULL;
-	ADNS_Stateobject *s;
+	PyObject *results = NULL, *times = NULL, *r;
+	adns_answer *answer;
+	struct timespec t0, t1;
+	long long *ns;
+	int type, nrrs, rounds, txtmode = _txt_tuple, keep = 0, i;
 
-	if (!PyArg_ParseTupleAndKeywords(
-		args, kwargs, "|iO&s", kwlist,
-		&flags, _file_converter, &diagfile, &configtext))
+	if (!PyArg_ParseTuple(args, "iii|ii", &type, &nrrs, &rounds, &txtmode,
+			      &keep))
 		return NULL;
-	if (!(s = newADNS_Stateobject())) return NULL;
-	if (configtext)
-		status = adns_init_strcfg(&s->state, flags,
-					  diagfile, configtext);
-	else
-		status = adns_init(&s->state, flags, diagfile);
-	if (status) {
-		PyErr_SetFromErrno(ErrorObject);
-		ADNS_State_dealloc(s);
+	if (nrrs < 1 || rounds < 1) {
+		PyErr_SetString(PyExc_ValueError, "nrrs and rounds must be positive");
 		return NULL;
 	}
-	return (PyObject *) s;
+	if (txtmode != _txt_tuple && txtmode != _txt_joined &&
+	    txtmode != _txt_buffer) {
+		PyErr_SetString(PyExc_ValueError, "unknown txtmode");
+		return NULL;
+	}
+	if (!(answer = _bench_answer(type, nrrs))) {
+		PyErr_SetString(PyExc_ValueError, "no synthetic answer for this type");
+		return NULL;
+	}
+	if (!(ns = PyMem_Malloc(rounds * sizeof(long long)))) {
+		PyErr_NoMemory();
+		goto done;
+	}
+	if (!(results = PyList_New(rounds))) goto done;
+	for (i = 0; i < rounds; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		r = interpret_answer(answer, txtmode);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		if (!r) goto done;
+		PyList_SET_ITEM(results, i, r);
+		ns[i] = (t1.tv_sec - t0.tv_sec) * 1000000000LL +
+			(t1.tv_nsec - t0.tv_nsec);
+	}
+	if (keep) {
+		times = results;
+		results = NULL;
+		goto done;
+	}
+	Py_CLEAR(results);
+	if (!(times = PyList_New(rounds))) goto done;
+	for (i = 0; i < rounds; i++) {
+		PyObject *t = PyLong_FromLongLong(ns[i]);
+		if (!t) {
+			Py_CLEAR(times);
+			goto done;
+		}
+		PyList_SET_ITEM(times, i, t);
+	}
+  done:
+	Py_XDECREF(results);
+	PyMem_Free(ns);
+	free(answer);
+	return times;
 }
 
 /* List of methods defined in the module */
 
 static struct PyMethodDef adns_methods[] = {
-	{"init", (PyCFunction)adns__init, METH_VARARGS|METH_KEYWORDS, adns_init__doc__},
+	{"init", (PyCFunction)(void(*)(void))adns__init, METH_VARARGS|METH_KEYWORDS, adns_init__doc__},
 	{"exception",(PyCFunction)adns_exception, METH_VARARGS, adns_exception__doc__},
+	{"select", (PyCFunction)adns__select, METH_VARARGS, adns_select__doc__},
+	{"listings", (PyCFunction)adns__listings, METH_NOARGS, adns_listings__doc__},
+	{"_bench_decode", (PyCFunction)adns__bench_decode, METH_VARARGS, adns_bench_decode__doc__},
  
 	{NULL,	 (PyCFunction)NULL, 0, NULL}		/* sentinel */
 };
 
 
-/* Initialization function for the module (*must* be called initadns) */
+/* Initialization function for the module, see PyInit_adns() */
 
 static char adns_module_documentation[] = 
 ""
@@ -1049,7 +7634,7 @@ static char adns_module_documentation[] =
 
 static PyObject *
 _new_exception(
-	PyObject *dict,
+	PyObject *module,
 	char *name,
 	PyObject *base
 	)
@@ -1060,66 +7645,166 @@ _new_exception(
 	sprintf(longname, "adns.%s", name);
 	if ((v = PyErr_NewException(longname, base, NULL)) == NULL)
 		return NULL;
-	if (PyDict_SetItemString(dict, name, v)) return NULL;
+	if (PyModule_AddObjectRef(module, name, v)) {
+		Py_DECREF(v);
+		return NULL;
+	}
 	return v;
 }
 
 static int
 _new_constant_class(
-	PyObject *mdict,
+	PyObject *module,
 	char *type,
 	_constant_class *table
 	)
 {
-	PyObject *d, *c, *v;
+	PyObject *d, *c = NULL, *v;
 	int i;
-	/* XXX This leaks memory if it fails, but then the whole module
-	   fails to import, so probably no big deal */
-	if (!(d = PyDict_New())) goto error;
+
+	if (!(d = PyDict_New())) return -1;
+	if (!(v = PyModule_GetNameObject(module))) goto error;
+	i = PyDict_SetItemString(d, "__module__", v);
+	Py_DECREF(v);
+	if (i) goto error;
 	for (i = 0; table[i].name; i++) {
-		if (!(v = PyInt_FromLong((long)table[i].value))) goto error;
-		if (PyDict_SetItemString(d, table[i].name, v)) goto error;
+		if (!(v = PyLong_FromLong((long)table[i].value))) goto error;
+		if (PyDict_SetItemString(d, table[i].name, v)) {
+			Py_DECREF(v);
+			goto error;
+		}
+		Py_DECREF(v);
+	}
+	if (!(c = PyObject_CallFunction((PyObject *) &PyType_Type, "s()O",
+					type, d)))
+		goto error;
+	Py_DECREF(d);
+	if (PyModule_AddObjectRef(module, type, c)) {
+		Py_DECREF(c);
+		return -1;
 	}
-	if (!(c = PyClass_New(NULL,d,PyString_InternFromString(type)))) goto error;
-	if (PyDict_SetItemString(mdict, type, c)) goto error;
+	Py_DECREF(c);
 	return 0;
   error:
-	Py_XDECREF(d);
+	Py_DECREF(d);
 	return -1;
 }
 
-void
-initadns(void)
+static int
+adns_exec(PyObject *module)
 {
-	PyObject *m, *d;
+	adnsstate *m = PyModule_GetState(module);
+
+	if (!(m->ErrorObject = _new_exception(module, "Error", PyExc_Exception)) ||
+	    !(m->NotReadyError = _new_exception(module, "NotReady", m->ErrorObject)) ||
+	    !(m->LocalError = _new_exception(module, "LocalError", m->ErrorObject)) ||
+	    !(m->RemoteError = _new_exception(module, "RemoteError", m->ErrorObject)) ||
+	    !(m->RemoteFailureError = _new_exception(module, "RemoteFailureError", m->RemoteError)) ||
+	    !(m->RemoteTempError = _new_exception(module, "RemoteTempError", m->RemoteError)) ||
+	    !(m->RemoteConfigError = _new_exception(module, "RemoteConfigError", m->RemoteError)) ||
+	    !(m->QueryError = _new_exception(module, "QueryError", m->ErrorObject)) ||
+	    !(m->PermanentError = _new_exception(module, "PermanentError", m->ErrorObject)) ||
+	    !(m->NXDomainError = _new_exception(module, "NXDomain", m->PermanentError)) ||
+	    !(m->NoDataError = _new_exception(module, "NoData", m->PermanentError)) ||
+	    !(m->LimitError = _new_exception(module, "LimitError", m->LocalError)))
+		return -1;
+
+	if (!(m->ADNS_Statetype = (PyTypeObject *) PyType_FromModuleAndSpec(
+		      module, &ADNS_Statetype_spec, NULL)) ||
+	    !(m->ADNS_Querytype = (PyTypeObject *) PyType_FromModuleAndSpec(
+		      module, &ADNS_Querytype_spec, NULL)) ||
+	    !(m->ADNS_Listingstype = (PyTypeObject *) PyType_FromModuleAndSpec(
+		      module, &ADNS_Listingstype_spec, NULL)))
+		return -1;
+
+	if (_new_constant_class(module, "iflags", adns_iflags) ||
+	    _new_constant_class(module, "qflags", adns_qflags) ||
+	    _new_constant_class(module, "rr", adns_rr) ||
+	    _new_constant_class(module, "status", adns_s) ||
+	    _new_constant_class(module, "txtmode", adns_txtmode) ||
+	    _new_constant_class(module, "limit", adns_limit) ||
+	    _new_constant_class(module, "priority", adns_priority))
+		return -1;
+	return 0;
+}
 
-	/* Create the module and add the functions */
-	m = Py_InitModule4("adns", adns_methods,
-		adns_module_documentation,
-		(PyObject*)NULL,PYTHON_API_VERSION);
+static int
+adns_traverse(
+	PyObject *module,
+	visitproc visit,
+	void *arg
+	)
+{
+	adnsstate *m = PyModule_GetState(module);
+	Py_VISIT(m->ErrorObject);
+	Py_VISIT(m->NotReadyError);
+	Py_VISIT(m->LocalError);
+	Py_VISIT(m->RemoteError);
+	Py_VISIT(m->RemoteFailureError);
+	Py_VISIT(m->RemoteTempError);
+	Py_VISIT(m->RemoteConfigError);
+	Py_VISIT(m->QueryError);
+	Py_VISIT(m->PermanentError);
+	Py_VISIT(m->NXDomainError);
+	Py_VISIT(m->NoDataError);
+	Py_VISIT(m->LimitError);
+	Py_VISIT(m->ADNS_Statetype);
+	Py_VISIT(m->ADNS_Querytype);
+	Py_VISIT(m->ADNS_Listingstype);
+	return 0;
+}
 
-	/* Add some symbolic constants to the module */
-	d = PyModule_GetDict(m);
-	ErrorObject = _new_exception(d, "Error", PyExc_StandardError);
-	NotReadyError = _new_exception(d, "NotReady", ErrorObject);
-	LocalError = _new_exception(d, "LocalError", ErrorObject);
-	RemoteError = _new_exception(d, "RemoteError", ErrorObject);
-	RemoteFailureError = _new_exception(d, "RemoteFailureError", RemoteError);
-	RemoteTempError = _new_exception(d, "RemoteTempError", RemoteError);
-	RemoteConfigError = _new_exception(d, "RemoteConfigError", RemoteError);
-	QueryError = _new_exception(d, "QueryError", ErrorObject);
-	PermanentError = _new_exception(d, "PermanentError", ErrorObject);
-	NXDomainError = _new_exception(d, "NXDomain", PermanentError);
-	NoDataError = _new_exception(d, "NoData", PermanentError);
+static int
+adns_clear(PyObject *module)
+{
+	adnsstate *m = PyModule_GetState(module);
+	Py_CLEAR(m->ErrorObject);
+	Py_CLEAR(m->NotReadyError);
+	Py_CLEAR(m->LocalError);
+	Py_CLEAR(m->RemoteError);
+	Py_CLEAR(m->RemoteFailureError);
+	Py_CLEAR(m->RemoteTempError);
+	Py_CLEAR(m->RemoteConfigError);
+	Py_CLEAR(m->QueryError);
+	Py_CLEAR(m->PermanentError);
+	Py_CLEAR(m->NXDomainError);
+	Py_CLEAR(m->NoDataError);
+	Py_CLEAR(m->LimitError);
+	Py_CLEAR(m->ADNS_Statetype);
+	Py_CLEAR(m->ADNS_Querytype);
+	Py_CLEAR(m->ADNS_Listingstype);
+	return 0;
+}
 
-	/* XXXX Add constants here */
-	_new_constant_class(d, "iflags", adns_iflags);
-	_new_constant_class(d, "qflags", adns_qflags);
-	_new_constant_class(d, "rr", adns_rr);
-	_new_constant_class(d, "status", adns_s);
-	/* Check for errors */
-	if (PyErr_Occurred())
-		Py_FatalError("can't initialize module adns");
+static void
+adns_free(void *module)
+{
+	adns_clear((PyObject *) module);
 }
 
+static PyModuleDef_Slot adns_slots[] = {
+	{Py_mod_exec, adns_exec},
+#ifdef Py_mod_multiple_interpreters
+	/* nothing is shared between instances of the module */
+	{Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+	{0, NULL}
+};
+
+static struct PyModuleDef adnsmodule = {
+	PyModuleDef_HEAD_INIT,
+	"adns",
+	adns_module_documentation,
+	sizeof(adnsstate),
+	adns_methods,
+	adns_slots,
+	adns_traverse,
+	adns_clear,
+	adns_free
+};
 
+PyMODINIT_FUNC
+PyInit_adns(void)
+{
+	return PyModuleDef_Init(&adnsmodule);
+}
@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+
+"""Decode benchmark: how long turning an adns answer into Python objects
+takes, per RR type and result format, and how many memory blocks the
+result holds.
+The answers are synthetic, built in memory by adns._bench_decode(), so no
+network is involved.
+
+    python3 decodebench.py [-r rounds] [-H] [type ...]
+
+prints ns/RR at the median, 90th and 99th percentile, RRs decoded per
+second, and blocks per RR, as sys.getallocatedblocks() counts them; -H
+adds a histogram of ns/RR per type.
+"""
+
+import gc, sys, getopt
+import adns
+
+rr = adns.rr
+
+# type, RRs in a typical answer, and the formats to try
+CASES = [
+    ('A',       rr.A,       4,  (None,)),
+    ('AAAA',    rr.AAAA,    4,  (None,)),
+    ('ADDR',    rr.ADDR,    4,  (None,)),
+    ('CNAME',   rr.CNAME,   1,  (None,)),
+    ('PTRraw',  rr.PTRraw,  1,  (None,)),
+    ('HINFO',   rr.HINFO,   1,  (None,)),
+    ('MXraw',   rr.MXraw,   3,  (None,)),
+    ('MX',      rr.MX,      3,  (None,)),
+    ('NSraw',   rr.NSraw,   4,  (None,)),
+    ('NS',      rr.NS,      4,  (None,)),
+    ('SOAraw',  rr.SOAraw,  1,  (None,)),
+    ('RPraw',   rr.RPraw,   1,  (None,)),
+    ('SRVraw',  rr.SRVraw,  3,  (None,)),
+    ('SRV',     rr.SRV,     3,  (None,)),
+    ('TXT',     rr.TXT,     4,  ('tuple', 'joined', 'buffer')),
+    ]
+
+def percentile(sorted_values, p):
+    return sorted_values[min(len(sorted_values) - 1,
+                             int(p * len(sorted_values)))]
+
+def histogram(per_rr, width=40):
+    """Power-of-two buckets of ns/RR."""
+    buckets = {}
+    for v in per_rr:
+        b = 1
+        while b < v: b *= 2
+        buckets[b] = buckets.get(b, 0) + 1
+    most = max(buckets.values())
+    for b in sorted(buckets):
+        print("    <=%6d ns %7d %s" % (b, buckets[b],
+                                      '#' * max(1, buckets[b] * width // most)))
+
+def blocks(rtype, nrrs, txtmode, rounds):
+    """Blocks that rounds results hold, less the list they come in."""
+    before = sys.getallocatedblocks()
+    results = adns._bench_decode(rtype, nrrs, rounds, txtmode, True)
+    held = sys.getallocatedblocks() - before - 1
+    del results
+    return held
+
+def run(name, rtype, nrrs, mode, rounds, show_histogram):
+    txtmode = getattr(adns.txtmode, mode or 'tuple')
+    adns._bench_decode(rtype, nrrs, min(rounds, 1000), txtmode)  # warm up
+    n = min(rounds, 1000)
+    gc.disable()
+    try:
+        times = adns._bench_decode(rtype, nrrs, rounds, txtmode)
+        allocs = blocks(rtype, nrrs, txtmode, n)
+    finally:
+        gc.enable()
+    per_rr = sorted(t / nrrs for t in times)
+    total = sum(times)
+    print("%-8s %-7s %4d %8.1f %8.1f %8.1f %12.0f %8.2f" % (
+        name, mode or '-', nrrs,
+        percentile(per_rr, 0.5), percentile(per_rr, 0.9),
+        percentile(per_rr, 0.99),
+        nrrs * len(times) / (total / 1e9) if total else 0,
+        allocs / float(nrrs * n)))
+    if show_histogram:
+        histogram(per_rr)
+
+def main(argv):
+    rounds, show_histogram = 20000, False
+    opts, names = getopt.getopt(argv, 'r:H')
+    for o, v in opts:
+        if o == '-r': rounds = int(v)
+        elif o == '-H': show_histogram = True
+    print("%-8s %-7s %4s %8s %8s %8s %12s %8s" % (
+        'type', 'format', 'RRs', 'p50 ns', 'p90 ns', 'p99 ns', 'RR/s',
+        'blocks'))
+    for name, rtype, nrrs, modes in CASES:
+        if names and name not in names: continue
+        for mode in modes:
+            run(name, rtype, nrrs, mode, rounds, show_histogram)
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
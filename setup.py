@@ -1,10 +1,9 @@
-#!/usr/bin/env python
+#!/usr/bin/env python3
 
 """Setup script for the adns module distribution."""
 
 import os, sys
-from distutils.core import setup
-from distutils.extension import Extension
+from setuptools import setup, Extension
 
 # You probably don't have to do anything past this point. If you
 # do, please mail me the configuration for your platform. Don't
@@ -18,8 +17,8 @@ extra_objects = []
 if os.name == "posix": # most Linux/UNIX platforms
     libraries = ["adns"]
 else:
-    raise "UnknownPlatform", "sys.platform=%s, os.name=%s" % \
-          (sys.platform, os.name)
+    raise RuntimeError("unknown platform: sys.platform=%s, os.name=%s" %
+                       (sys.platform, os.name))
     
 long_description = \
 """adns-python is a Python module that interfaces to the adns asynchronous
@@ -36,11 +35,13 @@ setup (# Distribution meta-data
     url = "https://github.com/andreiko/adns-python/",
     long_description=long_description,
     license = "GPL",
+    python_requires = ">=3.10",
     classifiers = [
     "Development Status :: 6 - Mature",
     "Intended Audience :: Developers",
     "License :: OSI Approved :: GNU General Public License (GPL)",
     "Operating System :: POSIX",
+    "Programming Language :: Python :: 3",
     "Topic :: Internet :: Name Service (DNS)",
     "Topic :: Software Development :: Libraries",
     ],
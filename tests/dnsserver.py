@@ -0,0 +1,201 @@
+"""A small nameserver for the tests.
+
+It answers every name itself, from its first label:
+
+    nx...           NXDOMAIN
+    nodata...       no records
+    empty...        no records either
+    servfail...     SERVFAIL
+    *slow*          0.3 seconds late
+    lossy...        the first UDP query for each name and type goes unanswered
+    big...          a TXT record too large for UDP
+    host-a-b-c-d... the address a.b.c.d, which PTR queries point back to
+    d.c.b.a.dnsbl.example  a DNSBL listing odd addresses as 127.0.0.2
+
+and otherwise with made-up but stable records.  adns can only talk to
+port 53, so the tests need to be able to bind it (root, or a network
+namespace of their own) and are skipped otherwise.  Further servers on
+other loopback addresses stand in for several upstreams."""
+
+import adns, socket, struct, threading, unittest, zlib
+
+ADDRESS = '127.0.0.1'
+CONFIG = 'nameserver %s\n' % ADDRESS
+
+A, NS, CNAME, SOA, PTR, HINFO, MX, TXT, RP, AAAA, SRV = \
+   1, 2, 5, 6, 12, 13, 15, 16, 17, 28, 33
+
+def _name(name):
+    out = b''
+    for label in name.rstrip('.').split('.'):
+        if label: out += bytes([len(label)]) + label.encode()
+    return out + b'\0'
+
+def _string(s):
+    return bytes([len(s)]) + s
+
+def _hash(name):
+    return zlib.crc32(name.encode())
+
+def _spf(owner):
+    for prefix, policy in (
+        ('inc', 'v=spf1 ip4:198.51.100.0/24 ip6:2001:db8:1::/48 ~all'),
+        ('redir', 'v=spf1 redirect=inc.example'),
+        ('voids', 'v=spf1 a:nx1.example a:nx2.example a:nx3.example -all'),
+        ('voidok1', 'v=spf1 a:empty1.example -all'),
+        ('voidok3', 'v=spf1 a:empty1.example a:empty2.example '
+                    'exists:empty3.example -all'),
+        ('helo', 'v=spf1 exists:%{h} -all')):
+        if owner.startswith(prefix): return policy
+    return ('v=spf1 include:inc1.%s include:inc2.%s a mx ip4:203.0.113.7 -all'
+            % (owner, owner))
+
+def records(owner, qtype):
+    """The rcode and the (type, rdata) list for owner."""
+    if owner.startswith('nx'): return 3, []
+    if owner.startswith('servfail'): return 2, []
+    if owner.startswith(('nodata', 'empty')): return 0, []
+    if owner.endswith('.dnsbl.example'):
+        if int(owner.split('.')[0]) % 2 == 0: return 3, []
+        return 0, [(A, bytes((127, 0, 0, 2)))] if qtype == A else []
+    h = _hash(owner) % 250 + 1
+    if qtype == A:
+        if owner.startswith('host-'):
+            return 0, [(A, bytes(int(b) for b in owner[5:].split('.')[0]
+                                 .split('-')))]
+        return 0, [(A, bytes((192, 0, 2, h)))]
+    if qtype == AAAA:
+        return 0, [(AAAA, socket.inet_pton(socket.AF_INET6, '2001:db8::%x' % h))]
+    if qtype == MX:
+        return 0, [(MX, struct.pack('!H', 10 * (i + 1)) +
+                    _name('mx%d.%s' % (i + 1, owner))) for i in range(2)]
+    if qtype == NS:
+        return 0, [(NS, _name('ns.' + owner))]
+    if qtype == PTR and owner.endswith('.in-addr.arpa'):
+        # host-192-0-2-7.example, which resolves back to the address
+        host = '-'.join(reversed(owner.split('.')[:4]))
+        return 0, [(PTR, _name('host-%s.example' % host))]
+    if qtype in (PTR, CNAME):
+        return 0, [(qtype, _name('host-%d.example' % (_hash(owner) % 1000)))]
+    if qtype == SOA:
+        return 0, [(SOA, _name('ns.example') + _name('hostmaster.example') +
+                    struct.pack('!5I', 1, 2, 3, 4, 5))]
+    if qtype == HINFO:
+        return 0, [(HINFO, _string(b'PDP-11') + _string(b'UNIX'))]
+    if qtype == RP:
+        return 0, [(RP, _name('admin.example') + _name('txt.example'))]
+    if qtype == TXT:
+        if owner.startswith('big'): text = b'x' * 500
+        else: text = _spf(owner).encode()
+        return 0, [(TXT, b''.join(_string(text[i:i+200])
+                                  for i in range(0, len(text), 200))),
+                   (TXT, _string(b'some other text'))]
+    if qtype == SRV:
+        return 0, [(SRV, struct.pack('!3H', prio, weight, port) +
+                    _name('%s.%s' % (host, owner)))
+                   for host, prio, weight, port in
+                   (('a', 10, 60, 5060), ('b', 10, 40, 5061),
+                    ('c', 20, 0, 5062))]
+    return 0, []
+
+def _parse(query):
+    qid, flags = struct.unpack('!HH', query[:4])
+    i, labels = 12, []
+    while query[i]:
+        labels.append(query[i+1:i+1+query[i]].decode())
+        i += 1 + query[i]
+    qtype, = struct.unpack('!H', query[i+1:i+3])
+    return qid, flags, '.'.join(labels).lower(), qtype, query[12:i+5]
+
+def response(query, ttl=300, udp=True, rcode=None):
+    qid, flags, owner, qtype, question = _parse(query)
+    if rcode is None: rcode, rrs = records(owner, qtype)
+    else: rrs = []
+    answers = b''.join(_name(owner) + struct.pack('!HHIH', t, 1, ttl, len(d)) + d
+                       for t, d in rrs)
+    flags = 0x8480 | (flags & 0x0100) | rcode
+    if udp and 12 + len(question) + len(answers) > 512:
+        flags, rrs, answers = flags | 0x0200, [], b''
+    return struct.pack('!6H', qid, flags, 1, len(rrs), 0, 0) + question + answers
+
+class Server:
+
+    def __init__(self, address=ADDRESS):
+        self.queries = []        # (name, type, 'udp' or 'tcp')
+        self.ttl = 300
+        self.delay = 0           # added to every answer
+        self.rcode = None        # e.g. 2 to SERVFAIL everything
+        self._lost = set()
+        self._udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self._tcp = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self._tcp.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self._udp.bind((address, 53))
+        self._tcp.bind((address, 53))
+        self._tcp.listen(16)
+        for target in (self._serve_udp, self._serve_tcp):
+            threading.Thread(target=target, daemon=True).start()
+
+    def _delay(self, owner):
+        return self.delay + (0.3 if 'slow' in owner.split('.')[0] else 0)
+
+    def _serve_udp(self):
+        while True:
+            query, peer = self._udp.recvfrom(512)
+            try: qid, flags, owner, qtype, question = _parse(query)
+            except (IndexError, struct.error): continue
+            self.queries.append((owner, qtype, 'udp'))
+            if owner.startswith('lossy') and (owner, qtype) not in self._lost:
+                self._lost.add((owner, qtype))
+                continue
+            reply = response(query, self.ttl, rcode=self.rcode)
+            t = threading.Timer(self._delay(owner), self._udp.sendto,
+                                (reply, peer))
+            t.daemon = True
+            t.start()
+
+    def _serve_tcp(self):
+        while True:
+            conn, peer = self._tcp.accept()
+            threading.Thread(target=self._serve_conn, args=(conn,),
+                             daemon=True).start()
+
+    def _serve_conn(self, conn):
+        lock = threading.Lock()
+        def send(reply):
+            try:
+                with lock: conn.sendall(struct.pack('!H', len(reply)) + reply)
+            except OSError: pass    # adns hung up meanwhile
+        with conn:
+            while True:
+                head = conn.recv(2, socket.MSG_WAITALL)
+                if len(head) < 2: return
+                query = conn.recv(struct.unpack('!H', head)[0],
+                                  socket.MSG_WAITALL)
+                try: owner, qtype = _parse(query)[2:4]
+                except (IndexError, struct.error): return
+                self.queries.append((owner, qtype, 'tcp'))
+                t = threading.Timer(self._delay(owner), send,
+                                    (response(query, self.ttl, False,
+                                              self.rcode),))
+                t.daemon = True
+                t.start()
+
+server = None
+servers = {}
+
+def start(address=ADDRESS):
+    """Starts the server on address once per process; skips the test if
+    port 53 cannot be bound there."""
+    global server
+    if address not in servers:
+        try: servers[address] = Server(address)
+        except OSError as e:
+            raise unittest.SkipTest('cannot serve DNS on %s:53: %s'
+                                    % (address, e))
+    if address == ADDRESS: server = servers[address]
+    return servers[address]
+
+def init(**kw):
+    """A state asking the test server."""
+    start()
+    return adns.init(adns.iflags.noautosys, configtext=CONFIG, **kw)
@@ -0,0 +1,82 @@
+"""s.resolve_all() and s.resolve_routes()."""
+
+import time, unittest
+import adns, dnsserver
+
+rr = adns.rr
+
+class ResolveAllTest(unittest.TestCase):
+
+    def test_order(self):
+        s = dnsserver.init()
+        names = ['n%d.example' % i for i in range(50)] + ['nx.example']
+        answers = s.resolve_all(names, rr.A)
+        self.assertEqual(len(answers), len(names))
+        for name, answer in zip(names, answers):
+            want = s.synchronous(name, rr.A)
+            self.assertEqual((answer[0], answer[3]), (want[0], want[3]))
+        self.assertEqual(answers[-1][0], adns.status.nxdomain)
+        self.assertEqual(s.resolve_all([], rr.A), [])
+
+    def test_timeout(self):
+        s = dnsserver.init()
+        answers = s.resolve_all(['slow.example', 'a.example'], rr.A, 0, 0.03)
+        self.assertIsNone(answers[0])
+        self.assertEqual(answers[1][0], adns.status.ok)
+        self.assertEqual(s.stats()['inflight'], 0)
+
+    def test_leaves_other_queries(self):
+        s = dnsserver.init()
+        q = s.submit('slow.example', rr.A)
+        s.resolve_all(['a.example'], rr.A)
+        self.assertEqual(q.wait()[0], adns.status.ok)
+
+    def test_cached(self):
+        s = dnsserver.init(cache=100)
+        names = ['n%d.example' % i for i in range(20)]
+        self.assertEqual(s.resolve_all(names, rr.A), s.resolve_all(names, rr.A))
+        self.assertEqual(s.stats()['cache_hits'], 20)
+
+    def test_maxinflight(self):
+        s = dnsserver.init()
+        s.set_ratelimit(0, 0, 4)
+        names = ['n%d.example' % i for i in range(20)]
+        answers = s.resolve_all(names, rr.A, 0, 10)
+        self.assertTrue(all(a and a[0] == adns.status.ok for a in answers))
+
+    def test_maxinflight_held_by_query(self):
+        # the one slot is taken by a query nobody collects
+        s = dnsserver.init()
+        s.set_ratelimit(0, 0, 1)
+        q = s.submit('a.example', rr.A)
+        t = time.time()
+        answers = s.resolve_all(['b.example', 'c.example'], rr.A, 0, 10)
+        self.assertLess(time.time() - t, 2)
+        self.assertTrue(all(a and a[0] == adns.status.ok for a in answers))
+        self.assertEqual(s.completed(0), [q])
+        self.assertEqual(q.check()[0], adns.status.ok)
+
+class ResolveRoutesTest(unittest.TestCase):
+
+    def test_routes(self):
+        s = dnsserver.init()
+        routes = s.resolve_routes(['a.example', 'nx.example'])
+        status, hosts = routes[0]
+        self.assertEqual(status, adns.status.ok)
+        self.assertEqual([h[:2] for h in hosts],
+                         [(10, 'mx1.a.example'), (20, 'mx2.a.example')])
+        self.assertTrue(all(h[3] for h in hosts))
+        self.assertEqual(routes[1][0], adns.status.nxdomain)
+
+    def test_maxinflight_held_by_query(self):
+        s = dnsserver.init()
+        s.set_ratelimit(0, 0, 1)
+        q = s.submit('a.example', rr.A)
+        t = time.time()
+        routes = s.resolve_routes(['b.example'], 0, 10)
+        self.assertLess(time.time() - t, 2)
+        self.assertEqual(routes[0][0], adns.status.ok)
+        self.assertEqual(q.wait()[0], adns.status.ok)
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,242 @@
+"""Recording and replay, and the answer cache."""
+
+import os, subprocess, sys, tempfile, unittest
+import adns, dnsserver
+
+rr = adns.rr
+
+TYPES = (rr.A, rr.AAAA, rr.ADDR, rr.MX, rr.MXraw, rr.NS, rr.NSraw,
+         rr.TXT, rr.SOA, rr.HINFO, rr.RP)
+
+class TempDirTest(unittest.TestCase):
+
+    def setUp(self):
+        d = tempfile.TemporaryDirectory()
+        self.addCleanup(d.cleanup)
+        self.dir = d.name
+
+class RecordReplayTest(TempDirTest):
+
+    def setUp(self):
+        TempDirTest.setUp(self)
+        self.path = os.path.join(self.dir, 'lookups.rec')
+
+    def record(self):
+        s = dnsserver.init()
+        s.record(self.path)
+        answers = dict((t, s.synchronous('a.example', t)) for t in TYPES)
+        answers['srv'] = s.synchronous('_sip._tcp.example', rr.SRV)
+        answers['ptr'] = s.submit_reverse('192.0.2.5', rr.PTR).wait()
+        answers['nx'] = s.synchronous('nx.example', rr.A)
+        s.record(None)
+        return answers
+
+    def test_roundtrip(self):
+        want = self.record()
+        r = adns.init(adns.iflags.noautosys)
+        r.replay(self.path)
+        for t in TYPES:
+            self.assertEqual(r.synchronous('a.example', t), want[t])
+        self.assertEqual(r.synchronous('_sip._tcp.example', rr.SRV),
+                         want['srv'])
+        self.assertEqual(r.submit_reverse('192.0.2.5', rr.PTR).wait(),
+                         want['ptr'])
+        self.assertEqual(r.synchronous('nx.example', rr.A), want['nx'])
+        self.assertEqual(want['nx'][0], adns.status.nxdomain)
+
+    def test_submit(self):
+        want = self.record()
+        r = adns.init(adns.iflags.noautosys)
+        r.replay(self.path)
+        q = r.submit('a.example', rr.MX)
+        self.assertEqual(r.completed(1), [q])
+        self.assertEqual(q.check(), want[rr.MX])
+
+    def test_unrecorded(self):
+        self.record()
+        r = adns.init(adns.iflags.noautosys)
+        r.replay(self.path)
+        self.assertRaises(adns.Error, r.synchronous, 'b.example', rr.A)
+        self.assertRaises(adns.Error, r.submit, 'a.example', rr.CNAME)
+
+    def test_append(self):
+        # a repeated query gets each recorded answer in turn
+        first = self.record()
+        second = self.record()
+        r = adns.init(adns.iflags.noautosys)
+        r.replay(self.path)
+        for want in (first, second, first):
+            self.assertEqual(r.synchronous('a.example', rr.TXT), want[rr.TXT])
+
+    def test_expiry_after_2106(self):
+        s = dnsserver.init()
+        s.record(self.path)
+        want = s.synchronous('a.example', rr.A)
+        s.record(None)
+        with open(self.path, 'r+b') as f:
+            rec = f.read()
+            # magic, length, latency, key length, key, then the answer:
+            # arena size, status, type, expires
+            keylen = int.from_bytes(rec[16:18], 'big')
+            f.seek(18 + keylen + 12)
+            f.write((1 << 33).to_bytes(8, 'big'))
+        r = adns.init(adns.iflags.noautosys)
+        r.replay(self.path)
+        self.assertEqual(r.synchronous('a.example', rr.A),
+                         want[:2] + (1 << 33,) + want[3:])
+
+    def test_not_a_recording(self):
+        with open(self.path, 'wb') as f: f.write(b'nonsense')
+        r = adns.init(adns.iflags.noautosys)
+        self.assertRaises(adns.Error, r.replay, self.path)
+
+class CacheTest(TempDirTest):
+
+    def test_hit(self):
+        s = dnsserver.init(cache=100)
+        a = s.synchronous('a.example', rr.MX)
+        self.assertEqual(s.synchronous('a.example', rr.MX), a)
+        q = s.submit('a.example', rr.MX)
+        self.assertEqual(s.completed(1), [q])
+        self.assertEqual(q.check(), a)
+        st = s.stats()
+        self.assertEqual((st['cache_misses'], st['cache_hits']), (1, 2))
+
+    def test_failures_not_kept(self):
+        s = dnsserver.init(cache=100)
+        s.synchronous('servfail.example', rr.A)
+        s.synchronous('servfail.example', rr.A)
+        self.assertEqual(s.stats()['cache_hits'], 0)
+
+    def test_lru(self):
+        s = dnsserver.init(cache=2)
+        for name in ('a.example', 'b.example', 'c.example', 'a.example'):
+            s.synchronous(name, rr.A)
+        self.assertEqual(s.stats()['cache_hits'], 0)
+        self.assertEqual(s.stats()['cache_entries'], 2)
+
+    def test_snapshot(self):
+        path = os.path.join(self.dir, 'adns.snap')
+        s = dnsserver.init(cache=100)
+        want = dict((t, s.synchronous('a.example', t)) for t in TYPES)
+        s.dump_cache(path)
+        t = dnsserver.init(cache=100, snapshot=path)
+        for rrtype, answer in want.items():
+            self.assertEqual(t.synchronous('a.example', rrtype), answer)
+        self.assertEqual(t.stats()['cache_misses'], 0)
+
+    def test_snapshot_expiry_after_2106(self):
+        path = os.path.join(self.dir, 'adns.snap')
+        s = dnsserver.init(cache=100)
+        want = s.synchronous('a.example', rr.A)
+        s.dump_cache(path)
+        with open(path, 'r+b') as f:
+            # magic, record length, expires: cut to 32 bits, this
+            # would be in the past
+            f.seek(12)
+            f.write(((1 << 32) + 60).to_bytes(8, 'big'))
+        t = dnsserver.init(cache=100, snapshot=path)
+        self.assertEqual(t.synchronous('a.example', rr.A), want)
+        self.assertEqual(t.stats()['cache_hits'], 1)
+
+class SharedTest(TempDirTest):
+
+    # the header, then slots of seq, writer's pid, expires, hash, key
+    # length, pad, blob length, data
+    HEADER, SLOT = 64, 512
+
+    def setUp(self):
+        TempDirTest.setUp(self)
+        self.path = os.path.join(self.dir, 'adns.cache')
+
+    def init(self):
+        return dnsserver.init(cache=100, shared=self.path, shared_size=8192)
+
+    def slots(self, f):
+        f.seek(0, 2)
+        for offset in range(self.HEADER, f.tell(), self.SLOT):
+            f.seek(offset)
+            seq = int.from_bytes(f.read(4), sys.byteorder)
+            if seq: yield offset, seq
+
+    def test_shared(self):
+        want = self.init().synchronous('a.example', rr.A)
+        t = self.init()
+        self.assertEqual(t.synchronous('a.example', rr.A), want)
+        self.assertEqual(t.stats()['shared_hits'], 1)
+        self.assertEqual(os.stat(self.path).st_mode & 0o777, 0o600)
+
+    def test_expiry_after_2106(self):
+        want = self.init().synchronous('a.example', rr.A)
+        with open(self.path, 'r+b') as f:
+            # cut to 32 bits, this would be in the past
+            (offset, seq), = self.slots(f)
+            f.seek(offset + 8)
+            f.write(((1 << 32) + 60).to_bytes(8, sys.byteorder))
+        t = self.init()
+        self.assertEqual(t.synchronous('a.example', rr.A), want)
+        self.assertEqual(t.stats()['shared_hits'], 1)
+
+    def busy(self, pid):
+        # a writer that stopped half way through the slot
+        self.init().synchronous('a.example', rr.A)
+        with open(self.path, 'r+b') as f:
+            (offset, seq), = self.slots(f)
+            f.seek(offset)
+            f.write((seq + 1).to_bytes(4, sys.byteorder) +
+                    pid.to_bytes(4, sys.byteorder))
+
+    def test_dead_writer(self):
+        # its slot is taken over by the next writer
+        p = subprocess.Popen([sys.executable, '-c', ''])
+        p.wait()
+        self.busy(p.pid)
+        s = self.init()
+        s.synchronous('a.example', rr.A)
+        self.assertEqual(s.stats()['shared_stores'], 1)
+        t = self.init()
+        t.synchronous('a.example', rr.A)
+        self.assertEqual(t.stats()['shared_hits'], 1)
+
+    def test_stalled_writer(self):
+        # it is still there, so its slot is left alone
+        self.busy(os.getpid())
+        s = self.init()
+        s.synchronous('a.example', rr.A)
+        self.assertEqual(s.stats()['shared_stores'], 0)
+        with open(self.path, 'rb') as f:
+            (offset, seq), = self.slots(f)
+            self.assertTrue(seq & 1)
+        t = self.init()
+        t.synchronous('a.example', rr.A)
+        self.assertEqual(t.stats()['shared_hits'], 0)
+
+class RefreshTest(unittest.TestCase):
+
+    def refreshing(self):
+        s = dnsserver.init(cache=100)
+        s.set_refresh(2, 1.0)
+        for i in range(3): s.synchronous('a.example', rr.A)
+        self.assertEqual(s.stats()['cache_refreshes'], 1)
+        return s
+
+    def test_reaped_by_wait(self):
+        s = self.refreshing()
+        s.submit('slow.example', rr.A).wait()
+        self.assertEqual(s.stats()['inflight'], 0)
+
+    def test_reaped_by_check(self):
+        s = self.refreshing()
+        q = s.submit('slow.example', rr.A)
+        while True:
+            try: q.check(); break
+            except adns.NotReady: s.select(0.05)
+        self.assertEqual(s.stats()['inflight'], 0)
+
+    def test_reaped_by_resolve_all(self):
+        s = self.refreshing()
+        s.resolve_all(['slow.example'], rr.A)
+        self.assertEqual(s.stats()['inflight'], 0)
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,19 @@
+"""adns._bench_decode() over decodebench's cases."""
+
+import unittest
+import adns, decodebench
+
+class DecodeTest(unittest.TestCase):
+
+    def test_cases(self):
+        # every type it times is interpreted, not passed over as None
+        for name, rtype, nrrs, modes in decodebench.CASES:
+            for mode in modes:
+                txtmode = getattr(adns.txtmode, mode or 'tuple')
+                (answer,) = adns._bench_decode(rtype, nrrs, 1, txtmode, True)
+                self.assertEqual(answer[0], adns.status.ok)
+                self.assertEqual(len(answer[3]), nrrs, name)
+                self.assertNotIn(None, answer[3], name)
+
+if __name__ == '__main__':
+    unittest.main()
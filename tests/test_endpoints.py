@@ -0,0 +1,47 @@
+"""s.endpoints()."""
+
+import unittest
+import dnsserver
+
+class EndpointsTest(unittest.TestCase):
+
+    def check_order(self, endpoints):
+        ports = [port for address, port in endpoints]
+        # priority 10: 5060 and 5061 in either order, then 5062
+        self.assertEqual(set(ports), set((5060, 5061, 5062)))
+        self.assertEqual(ports[-1], 5062)
+        self.assertLess(max(i for i, p in enumerate(ports) if p != 5062),
+                        ports.index(5062))
+
+    def test_order(self):
+        s = dnsserver.init()
+        self.check_order(s.endpoints('_sip._tcp.example'))
+
+    def test_kept(self):
+        s = dnsserver.init()
+        first = s.endpoints('_sip._tcp.example')
+        n = s.stats()['answers']
+        for i in range(20):
+            self.assertEqual(sorted(s.endpoints('_sip._tcp.example')),
+                             sorted(first))
+        self.assertEqual(s.stats()['answers'], n)
+
+    def test_without_glue(self):
+        s = dnsserver.init()
+        self.check_order(s.endpoints('_sip._tcp.noglue.example'))
+
+    def test_least_recently_used_dropped(self):
+        s = dnsserver.init()
+        s.endpoints('_sip._tcp.hot.example')
+        s.endpoints('_sip._tcp.cold.example')
+        for i in range(4095):
+            if i % 1000 == 0: s.endpoints('_sip._tcp.hot.example')
+            s.endpoints('_sip._tcp.n%d.example' % i)
+        n = s.stats()['answers']
+        s.endpoints('_sip._tcp.hot.example')
+        self.assertEqual(s.stats()['answers'], n)
+        s.endpoints('_sip._tcp.cold.example')
+        self.assertEqual(s.stats()['answers'], n + 1)
+
+if __name__ == '__main__':
+    unittest.main()
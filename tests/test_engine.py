@@ -0,0 +1,61 @@
+"""ADNS.QueryEngine."""
+
+import unittest
+import adns, ADNS, dnsserver
+
+rr = adns.rr
+
+class StubQuery:
+
+    def __init__(self, result):
+        self.result = result
+
+    def check(self):
+        if isinstance(self.result, Exception): raise self.result
+        return self.result
+
+class StubState:
+    """Completes every query at once, with what the test asks for."""
+
+    def __init__(self):
+        self.results = {}
+        self.done = []
+
+    def submit(self, qname, rr, flags, priority):
+        q = StubQuery(self.results[qname])
+        self.done.append(q)
+        return q
+
+    def completed(self, timeout=0):
+        done, self.done = self.done, []
+        return done
+
+class QueryEngineTest(unittest.TestCase):
+
+    def test_answers(self):
+        e = ADNS.QueryEngine(dnsserver.init())
+        got = {}
+        for name in ('a.example', 'nx.example'):
+            e.submit(name, rr.A, callback=lambda a, qname, *r:
+                     got.__setitem__(qname, a[0]))
+        e.finish()
+        self.assertEqual(got, {'a.example': adns.status.ok,
+                               'nx.example': adns.status.nxdomain})
+
+    def test_failures(self):
+        s = StubState()
+        s.results['ok.example'] = (adns.status.ok, None, 0, ('192.0.2.1',))
+        s.results['shed.example'] = adns.LimitError('shed')
+        s.results['failed.example'] = adns.Error('query invalidated')
+        e = ADNS.QueryEngine(s)
+        got = {}
+        for name in s.results:
+            e.submit(name, rr.A, callback=lambda a, qname, *r:
+                     got.__setitem__(qname, a[0]))
+        e.run()
+        self.assertTrue(e.finished())
+        self.assertEqual(got, {'ok.example': adns.status.ok,
+                               'failed.example': adns.status.systemfail})
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,81 @@
+"""s.set_hedge()."""
+
+import time, unittest
+import adns, dnsserver
+
+rr = adns.rr
+
+class HedgeTest(unittest.TestCase):
+
+    def setUp(self):
+        self.s = dnsserver.init()
+        self.s.set_hedge(0.9)
+        # enough answers for a percentile
+        self.s.resolve_all(['warm%d.example' % i for i in range(30)], rr.A)
+
+    def until(self, cond, timeout=2):
+        # the queries it is used for do not complete meanwhile
+        end = time.time() + timeout
+        while not cond() and time.time() < end:
+            self.assertEqual(self.s.completed(0.01), [])
+        return cond()
+
+    def test_lost_packet(self):
+        # adns itself would only ask again seconds later
+        t = time.time()
+        answer = self.s.synchronous('lossy-sync.example', rr.A)
+        self.assertLess(time.time() - t, 0.2)
+        self.assertEqual(answer[0], adns.status.ok)
+        st = self.s.stats()
+        self.assertEqual((st['hedges'], st['hedge_wins']), (1, 1))
+        self.assertEqual(st['inflight'], 0)
+
+    def test_completed(self):
+        q = self.s.submit('lossy-completed.example', rr.A)
+        got, end = [], time.time() + 0.2
+        while not got and time.time() < end:
+            got = self.s.completed(0.01)
+        self.assertEqual(got, [q])
+        self.assertEqual(q.check()[0], adns.status.ok)
+        self.assertEqual(self.s.stats()['hedge_wins'], 1)
+        self.assertEqual(self.s.stats()['inflight'], 0)
+
+    def test_batch(self):
+        names = ['lossy-batch%d.example' % i for i in range(5)]
+        t = time.time()
+        answers = self.s.resolve_all(names, rr.A)
+        self.assertLess(time.time() - t, 0.2)
+        self.assertTrue(all(a[0] == adns.status.ok for a in answers))
+        self.assertEqual(self.s.stats()['hedge_wins'], 5)
+        self.assertEqual(self.s.stats()['inflight'], 0)
+
+    def test_cancel(self):
+        # a hedge that takes a while to answer
+        q = self.s.submit('lossy-slow-cancel.example', rr.A)
+        self.assertTrue(self.until(lambda: self.s.stats()['hedges']))
+        self.assertEqual(self.s.stats()['inflight'], 2)
+        q.cancel()
+        self.assertEqual(self.s.stats()['inflight'], 0)
+
+    def test_maxinflight(self):
+        # the hedge takes the second slot, so the next query waits
+        self.s.set_ratelimit(0, 0, 2)
+        q1 = self.s.submit('lossy-slow-cap.example', rr.A)
+        self.assertTrue(self.until(lambda: self.s.stats()['hedges']))
+        q2 = self.s.submit('a.example', rr.A)
+        st = self.s.stats()
+        self.assertEqual((st['inflight'], st['queued']), (2, 1))
+        self.assertEqual(q1.wait()[0], adns.status.ok)
+        self.assertEqual(q2.wait()[0], adns.status.ok)
+        self.assertEqual(self.s.stats()['inflight'], 0)
+
+    def test_no_room(self):
+        # no hedges while the slots are all taken
+        self.s.set_ratelimit(0, 0, 1)
+        q = self.s.submit('lossy-full.example', rr.A)
+        self.until(lambda: False, 0.05)
+        self.assertEqual(self.s.stats()['hedges'], 0)
+        q.cancel()
+
+if __name__ == '__main__':
+    unittest.main()
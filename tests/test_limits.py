@@ -0,0 +1,59 @@
+"""s.set_limits()."""
+
+import time, unittest
+import adns, dnsserver
+
+rr = adns.rr
+
+class LimitsTest(unittest.TestCase):
+
+    def test_reject(self):
+        s = dnsserver.init()
+        s.set_limits(2)
+        qs = [s.submit('slow%d.example' % i, rr.A) for i in range(2)]
+        self.assertRaises(adns.LimitError, s.submit, 'a.example', rr.A)
+        self.assertEqual(s.stats()['limit_rejected'], 1)
+        for q in qs: self.assertEqual(q.wait()[0], adns.status.ok)
+        s.submit('a.example', rr.A)
+
+    def test_shed(self):
+        s = dnsserver.init()
+        s.set_limits(2, 0, adns.limit.shed)
+        q1, q2 = [s.submit('slow%d.example' % i, rr.A) for i in range(2)]
+        q3 = s.submit('a.example', rr.A)
+        self.assertEqual(s.stats()['limit_shed'], 1)
+        self.assertRaises(adns.LimitError, q1.check)
+        self.assertEqual(q2.wait()[0], adns.status.ok)
+        self.assertEqual(q3.wait()[0], adns.status.ok)
+
+    def test_block(self):
+        s = dnsserver.init()
+        s.set_limits(1, 0, adns.limit.block, 5)
+        q1 = s.submit('slow.example', rr.A)
+        q2 = s.submit('a.example', rr.A)
+        self.assertEqual(s.completed(0), [q1])
+        self.assertEqual(q2.wait()[0], adns.status.ok)
+        s.set_limits(1, 0, adns.limit.block, 0.01)
+        s.submit('slow.example', rr.A)
+        self.assertRaises(adns.LimitError, s.submit, 'a.example', rr.A)
+
+    def test_bytes(self):
+        # only letting go of answers makes room, so neither shedding
+        # nor blocking is tried
+        s = dnsserver.init()
+        q = s.submit('a.example', rr.MX)
+        q.wait()
+        self.assertGreater(s.stats()['answer_bytes'], 0)
+        p = s.submit('slow.example', rr.A)
+        for policy in (adns.limit.shed, adns.limit.block):
+            s.set_limits(0, 1, policy, 5)
+            t = time.time()
+            self.assertRaises(adns.LimitError, s.submit, 'a.example', rr.A)
+            self.assertLess(time.time() - t, 0.25)
+        self.assertEqual(s.stats()['limit_shed'], 0)
+        self.assertEqual(p.wait()[0], adns.status.ok)
+        del p, q
+        s.submit('a.example', rr.A)
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,103 @@
+"""adns.listings() and DNSBL.DNSBLQueryEngine."""
+
+import time, unittest
+import adns, DNSBL, dnsserver
+
+class ListingsTest(unittest.TestCase):
+
+    def setUp(self):
+        self.L = adns.listings()
+
+    def test_set_get(self):
+        # only the first two answers are kept
+        self.L.set('192.0.2.1', 0, ['127.0.0.2', '127.0.0.3', '127.0.0.4'], 60)
+        self.L.set('192.0.2.1', 7, ['127.0.0.9'], 60)
+        self.assertEqual(self.L.get('192.0.2.1', 0), ('127.0.0.2', '127.0.0.3'))
+        self.assertEqual(self.L.get('192.0.2.1'),
+                         [(0, ('127.0.0.2', '127.0.0.3')), (7, ('127.0.0.9',))])
+        self.assertIsNone(self.L.get('192.0.2.1', 1))
+        self.assertIsNone(self.L.get('192.0.2.2', 0))
+        self.assertEqual(self.L.get('192.0.2.2'), [])
+        self.L.set('192.0.2.1', 7, ['127.0.0.10'], 60)
+        self.assertEqual(self.L.get('192.0.2.1', 7), ('127.0.0.10',))
+        st = self.L.stats()
+        self.assertEqual((st['entries'], st['prefixes']), (2, 1))
+        self.assertEqual((st['hits'], st['misses']), (3, 3))
+
+    def test_negative(self):
+        self.L.set('192.0.2.2', 0, [], 60)
+        self.assertEqual(self.L.get('192.0.2.2', 0), ())
+        self.assertEqual(self.L.get('192.0.2.2'), [(0, ())])
+        # nothing to keep
+        self.L.set('192.0.2.3', 0, [], 0)
+        self.assertIsNone(self.L.get('192.0.2.3', 0))
+
+    def test_range(self):
+        for host in reversed(range(256)):
+            ip = '192.0.2.%d' % host
+            self.L.set(ip, 1, ['127.0.0.2'] if host % 2 else [], 60)
+            self.L.set(ip, 0, [], 60)
+        self.L.set('192.0.3.1', 0, ['127.0.0.2'], 60)
+        got = self.L.range('192.0.2.0/24')
+        self.assertEqual(len(got), 512)
+        self.assertEqual(got[:4], [('192.0.2.0', 0, ()), ('192.0.2.0', 1, ()),
+                                   ('192.0.2.1', 0, ()),
+                                   ('192.0.2.1', 1, ('127.0.0.2',))])
+        self.assertEqual(got[-1], ('192.0.2.255', 1, ('127.0.0.2',)))
+        self.assertEqual(self.L.range('192.0.2'), got)
+        self.assertEqual(self.L.range('192.0.2.77'), got)
+        self.assertEqual(self.L.range('198.51.100.0/24'), [])
+        self.assertEqual(self.L.stats()['prefixes'], 2)
+
+    def test_expiry(self):
+        # a full /24 makes room from its expired entries before growing
+        for host in range(4):
+            self.L.set('192.0.2.%d' % host, 0, ['127.0.0.2'], 1)
+        self.L.set('198.51.100.1', 0, [], 1)
+        self.L.set('198.51.100.2', 0, [], 60)
+        bytes = self.L.stats()['bytes']
+        time.sleep(1.01)
+        self.assertIsNone(self.L.get('192.0.2.0', 0))
+        self.assertEqual(self.L.range('192.0.2.0/24'), [])
+        self.assertEqual(self.L.range('198.51.100.0/24'),
+                         [('198.51.100.2', 0, ())])
+        for host in range(4, 8):
+            self.L.set('192.0.2.%d' % host, 0, ['127.0.0.2'], 60)
+        st = self.L.stats()
+        self.assertEqual((st['entries'], st['bytes']), (6, bytes))
+        # the rest go now
+        self.assertEqual(self.L.expire(), 1)
+        self.assertEqual(self.L.stats()['entries'], 5)
+        self.assertEqual(len(self.L.range('192.0.2.0/24')), 4)
+
+    def test_errors(self):
+        self.assertRaises(adns.Error, self.L.set, 'bogus', 0, [], 60)
+        self.assertRaises(adns.Error, self.L.set, '192.0.2.1', 0, ['x'], 60)
+        self.assertRaises(ValueError, self.L.set, '192.0.2.1', 256, [], 60)
+        self.assertRaises(adns.Error, self.L.get, '192.0.2')
+        self.assertRaises(adns.Error, self.L.range, '192.0.2.0/23')
+
+class DNSBLQueryEngineTest(unittest.TestCase):
+
+    def test_verdicts(self):
+        e = DNSBL.DNSBLQueryEngine(dnsserver.init(), [
+            DNSBL.DNSBL('TEST', 'dnsbl.example', 'http://dnsbl.example/%s',
+                        {'127.0.0.2': 'spam'})])
+        for ip in ('192.0.2.1', '192.0.2.2'):
+            e.submit_dnsbl(ip)
+        e.finish()
+        results = {'192.0.2.1': [('spam', 'http://dnsbl.example/192.0.2.1')],
+                   '192.0.2.2': []}
+        self.assertEqual(e.dnsbl_results, results)
+        self.assertEqual(e.dnsbl_range('192.0.2.0/24'),
+                         [('192.0.2.1', 'TEST', ('127.0.0.2',)),
+                          ('192.0.2.2', 'TEST', ())])
+        # both verdicts, not only the listing, come from the store
+        for ip in ('192.0.2.1', '192.0.2.2'):
+            e.submit_dnsbl(ip)
+        self.assertTrue(e.finished())
+        self.assertEqual(e.dnsbl_results, results)
+        self.assertEqual(e.listings.stats()['hits'], 2)
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,41 @@
+"""s.submit_partial()."""
+
+import time, unittest
+import adns, dnsserver
+
+rr = adns.rr
+
+class PartialTest(unittest.TestCase):
+
+    def test_records(self):
+        s = dnsserver.init()
+        seen = []
+        q = s.submit_partial('a.example', rr.MX, 0,
+                             lambda q, r: seen.append(r[1][0]))
+        answer = q.wait()
+        self.assertEqual(answer[0], adns.status.ok)
+        self.assertEqual(sorted(seen), ['mx1.a.example', 'mx2.a.example'])
+        self.assertTrue(all(r[1][2] for r in answer[3]))
+
+    def test_callback_cancels_next(self):
+        # the queries after the cancelled one still get their turn
+        s = dnsserver.init()
+        queries, cancelled = [], []
+        def cancel_next(q, r):
+            if cancelled: return
+            cancelled.append(queries[1])
+            queries[1].cancel()
+        for i in range(4):
+            queries.append(s.submit_partial('p%d.example' % i, rr.MX, 0,
+                                            cancel_next if i == 0 else None))
+        # every answer is in by each round, so the others are ready
+        # in the round that the first is
+        for i in range(20):
+            time.sleep(0.1)
+            done = s.completed(0)
+            if queries[0] in done: break
+        self.assertEqual(sorted(done, key=queries.index),
+                         [queries[0], queries[2], queries[3]])
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,114 @@
+"""ADNS.ResolverPool."""
+
+import time, unittest
+import adns, ADNS, dnsserver
+
+rr = adns.rr
+
+ONE, TWO = '127.0.0.2', '127.0.0.3'
+
+class ResolverPoolTest(unittest.TestCase):
+
+    def setUp(self):
+        self.one, self.two = [dnsserver.start(a) for a in (ONE, TWO)]
+        for server in (self.one, self.two):
+            server.delay, server.rcode = 0, None
+            del server.queries[:]
+        self.got = []
+
+    def callback(self, answer, qname, rr, flags, extra):
+        self.got.append((qname, answer[0]))
+
+    def pool(self, **kw):
+        pool = ADNS.ResolverPool([ONE, TWO], **kw)
+        # one answer from each, the second upstream the slower
+        self.two.delay = 0.02
+        for i in range(2):
+            pool.submit('warm%d.example' % i, rr.A, callback=self.callback)
+        pool.finish()
+        self.two.delay = 0
+        return pool
+
+    def resolve(self, pool, name):
+        pool.submit(name, rr.A, callback=self.callback)
+        pool.finish()
+        return self.got[-1][1]
+
+    def test_ranking(self):
+        pool = self.pool()
+        self.assertEqual((len(self.one.queries), len(self.two.queries)), (1, 1))
+        for i in range(10):
+            self.assertEqual(self.resolve(pool, 'rank%d.example' % i),
+                             adns.status.ok)
+        self.assertEqual((len(self.one.queries), len(self.two.queries)), (11, 1))
+
+    def test_probe(self):
+        self.one.rcode = 2
+        pool = self.pool(maxfailure=0.05, probe=0.3)
+        # probed once at once, then left alone until probe seconds pass
+        for i in range(5):
+            self.resolve(pool, 'healthy%d.example' % i)
+        self.assertEqual((len(self.one.queries), len(self.two.queries)), (2, 5))
+        time.sleep(0.3)
+        self.one.rcode = None
+        for i in range(3):
+            self.assertEqual(self.resolve(pool, 'later%d.example' % i),
+                             adns.status.ok)
+        self.assertEqual((len(self.one.queries), len(self.two.queries)), (3, 7))
+
+    def test_hedge(self):
+        pool = self.pool(hedge=0.9)
+        self.one.delay = 0.5
+        t = time.time()
+        self.assertEqual(self.resolve(pool, 'hedged.example'), adns.status.ok)
+        self.assertLess(time.time() - t, 0.3)
+        self.assertEqual((pool.hedges, pool.hedge_wins), (1, 1))
+        # the slow one was cancelled
+        self.assertEqual([st['inflight'] for st in pool.stats().values()],
+                         [0, 0])
+
+    def test_hedge_once(self):
+        # the hedge fails, so the first answer is waited for, not hedged again
+        pool = self.pool(hedge=0.9)
+        self.one.delay, self.two.rcode = 0.2, 2
+        self.assertEqual(self.resolve(pool, 'once.example'), adns.status.ok)
+        self.assertEqual((pool.hedges, pool.hedge_wins), (1, 0))
+        self.assertEqual(len(self.got), 3)
+
+    def test_cancel(self):
+        pool = self.pool(hedge=0.9)
+        self.one.delay = self.two.delay = 0.2
+        q = pool.submit('cancelled.example', rr.A, callback=self.callback)
+        end = time.time() + 1
+        while not pool.hedges and time.time() < end:
+            pool.run(0.01)
+        self.assertEqual([st['inflight'] for st in pool.stats().values()],
+                         [1, 1])
+        pool.cancel(q)
+        self.assertTrue(pool.finished())
+        self.assertEqual([st['inflight'] for st in pool.stats().values()],
+                         [0, 0])
+        time.sleep(0.25)
+        pool.run()
+        self.assertEqual(len(self.got), 2)
+
+    def test_priority(self):
+        # passed through to the upstream's state, which checks it
+        pool = self.pool()
+        self.assertRaises(ValueError, pool.submit, 'a.example', rr.A,
+                          callback=self.callback, priority=5)
+        self.assertRaises(ValueError, pool.submit_reverse, '192.0.2.7',
+                          rr.PTR, callback=self.callback, priority=5)
+        got = []
+        pool.submit('bulk.example', rr.A, 0, lambda *a: got.append(a[:4]),
+                    priority=adns.priority.bulk)
+        pool.submit_reverse('192.0.2.7', rr.PTR, 0,
+                            lambda *a: got.append(a[:4]),
+                            priority=adns.priority.bulk)
+        pool.finish()
+        self.assertEqual(sorted((a[0][0],) + a[1:] for a in got),
+                         [(adns.status.ok, '192.0.2.7', rr.PTR, 0),
+                          (adns.status.ok, 'bulk.example', rr.A, 0)])
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,32 @@
+"""Query priorities."""
+
+import unittest
+import adns, dnsserver
+
+rr = adns.rr
+
+class PriorityTest(unittest.TestCase):
+
+    def test_interactive_first(self):
+        s = dnsserver.init()
+        s.set_ratelimit(0, 0, 1)
+        bulk = adns.priority.bulk
+        b1 = s.submit('slow.example', rr.A, 0, bulk)
+        b2 = s.submit_reverse('192.0.2.7', rr.PTR, 0, bulk)
+        i = s.submit('a.example', rr.A, 0, adns.priority.interactive)
+        done = []
+        while len(done) < 3: done += s.completed(5)
+        self.assertEqual(done, [b1, i, b2])
+
+    def test_unknown(self):
+        s = dnsserver.init()
+        self.assertRaises(ValueError, s.submit, 'a.example', rr.A, 0, 2)
+        self.assertRaises(ValueError, s.submit, 'a.example', rr.A, 0, -1)
+        self.assertRaises(ValueError, s.submit_reverse, '192.0.2.7',
+                          rr.PTR, 0, 5)
+        self.assertRaises(ValueError, s.submit_reverse_any, '192.0.2.7',
+                          'example', rr.PTR, 0, 5)
+        self.assertEqual(s.stats()['inflight'], 0)
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,39 @@
+"""s.spf()."""
+
+import unittest
+import adns, dnsserver
+
+class SPFTest(unittest.TestCase):
+
+    def setUp(self):
+        self.s = dnsserver.init()
+
+    def test_include(self):
+        self.assertEqual(self.s.spf('inc.example', '198.51.100.1'), 'pass')
+        self.assertEqual(self.s.spf('inc.example', '192.0.2.200'), 'softfail')
+        self.assertEqual(self.s.spf('redir.example', '198.51.100.1'), 'pass')
+
+    def test_no_record(self):
+        self.assertEqual(self.s.spf('nx.example', '192.0.2.1'), 'none')
+        self.assertEqual(self.s.spf('nodata.example', '192.0.2.1'), 'none')
+        self.assertEqual(self.s.spf('empty.example', '192.0.2.1'), 'none')
+
+    def test_void_lookup(self):
+        # a name with no addresses just does not match
+        self.assertEqual(self.s.spf('voidok1.example', '192.0.2.1'), 'fail')
+
+    def test_void_limit(self):
+        self.assertEqual(self.s.spf('voids.example', '192.0.2.1'), 'permerror')
+        self.assertEqual(self.s.spf('voidok3.example', '192.0.2.1'),
+                         'permerror')
+
+    def test_helo(self):
+        # exists:%{h}
+        spf = self.s.spf
+        self.assertEqual(spf('helo.example', '192.0.2.1', 'a@b.example', 0,
+                             'mail.example'), 'pass')
+        self.assertEqual(spf('helo.example', '192.0.2.1', 'a@b.example', 0,
+                             'nx.example'), 'fail')
+
+if __name__ == '__main__':
+    unittest.main()
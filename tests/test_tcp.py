@@ -0,0 +1,49 @@
+"""s.set_tcp()."""
+
+import time, unittest
+import adns, dnsserver
+
+rr = adns.rr
+
+class TCPTest(unittest.TestCase):
+
+    def big(self, s):
+        self.assertEqual(s.synchronous('big.example', rr.TXT)[0],
+                         adns.status.ok)
+
+    def counts(self, s):
+        st = s.stats()
+        return st['tcp_queries'], st['tcp_fallbacks']
+
+    def test_types(self):
+        s = dnsserver.init()
+        s.set_tcp((rr.TXT,))
+        self.big(s)
+        self.assertEqual(self.counts(s), (1, 0))
+
+    def test_learnt(self):
+        # once a type has fallen back, its queries go over TCP and do
+        # not count as falling back again
+        s = dnsserver.init()
+        s.set_tcp((), 60)
+        self.big(s)
+        self.assertEqual(self.counts(s), (0, 1))
+        self.big(s)
+        self.assertEqual(self.counts(s), (1, 1))
+
+    def test_idle(self):
+        # each query of the type keeps it on TCP for idle seconds more
+        s = dnsserver.init()
+        s.set_tcp((), 0.3)
+        self.big(s)
+        time.sleep(0.2)
+        self.big(s)
+        time.sleep(0.2)
+        s.synchronous('a.example', rr.TXT)
+        self.assertEqual(self.counts(s), (2, 1))
+        time.sleep(0.4)
+        s.synchronous('a.example', rr.TXT)
+        self.assertEqual(self.counts(s), (2, 1))
+
+if __name__ == '__main__':
+    unittest.main()
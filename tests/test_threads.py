@@ -0,0 +1,76 @@
+"""Threads sharing a state."""
+
+import threading, time, unittest
+import adns, dnsserver
+
+rr = adns.rr
+
+class ThreadsTest(unittest.TestCase):
+
+    THREADS, QUERIES = 8, 200
+
+    def test_stress(self):
+        # submitters that check and wait on their own queries, while
+        # other threads collect completions and drive adns.select()
+        s = dnsserver.init()
+        want = s.synchronous('a.example', rr.A)[3]
+        done = threading.Event()
+        answers, errors = [], []
+
+        def submitter(t):
+            try:
+                queries = []
+                for i in range(self.QUERIES):
+                    name = ('slow-%d-%d.example' if i % 10 == 0 else
+                            'a%d-%d.example') % (t, i)
+                    queries.append(s.submit(name, rr.A))
+                    if i % 3 == 0:
+                        try: answers.append(queries[0].check())
+                        except adns.NotReady: pass
+                        else: queries.pop(0)
+                    if i % 7 == 0:
+                        answers.append(s.synchronous('a.example', rr.A))
+                for q in queries: answers.append(q.wait())
+            except Exception as e:
+                errors.append(e)
+
+        def completer():
+            while not done.is_set(): s.completed(0.01)
+
+        def selecter():
+            while not done.is_set(): adns.select([s], 0.01)
+
+        workers = [threading.Thread(target=submitter, args=(t,))
+                   for t in range(self.THREADS)]
+        helpers = [threading.Thread(target=f) for f in (completer, selecter)]
+        for t in workers + helpers: t.start()
+        for t in workers: t.join(60)
+        done.set()
+        for t in helpers: t.join(60)
+        self.assertFalse(any(t.is_alive() for t in workers + helpers))
+        self.assertEqual(errors, [])
+        self.assertTrue(all(a[0] == adns.status.ok for a in answers))
+        self.assertEqual(len(answers), self.THREADS *
+                         (self.QUERIES + (self.QUERIES + 6) // 7))
+        self.assertEqual(s.stats()['inflight'], 0)
+        self.assertEqual(s.synchronous('a.example', rr.A)[3], want)
+
+    def test_select_woken_by_submit(self):
+        # adns.select() in one thread wakes up for a query another
+        # thread submits, and answers it
+        s = dnsserver.init()
+        took = []
+        def selecter():
+            t = time.time()
+            adns.select([s], 5)
+            took.append(time.time() - t)
+        t = threading.Thread(target=selecter)
+        t.start()
+        time.sleep(0.2)
+        q = s.submit('a.example', rr.A)
+        t.join(10)
+        self.assertLess(took[0], 2)
+        self.assertEqual(q.wait()[0], adns.status.ok)
+
+if __name__ == '__main__':
+    unittest.main()